@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/**
+ * \file cond.c Conditions which must hold before a snapshot is started.
+ *
+ * These are checked by dss itself, without running an external command. Time
+ * windows are stored as a bitmap with one bit per minute of the week, which
+ * makes it easy to find out when the next window opens.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "gcc-compat.h"
+#include "log.h"
+#include "err.h"
+#include "str.h"
+#include "cond.h"
+
+#define MINUTES_PER_DAY (24 * 60)
+
+static const char * const day_names[] = {"sun", "mon", "tue", "wed", "thu",
+	"fri", "sat"};
+
+static int parse_day(const char *p, int *day)
+{
+	int i;
+
+	for (i = 0; i < 7; i++) {
+		if (strncasecmp(p, day_names[i], 3))
+			continue;
+		*day = i;
+		return 3;
+	}
+	return -E_TIME_WINDOW;
+}
+
+/* Parse a list like "Mon-Fri,Sun" into a bit mask of days. */
+static int parse_days(const char *p, unsigned *mask)
+{
+	const char *start = p;
+
+	*mask = 0;
+	for (;;) {
+		int first, last, ret = parse_day(p, &first);
+
+		if (ret < 0)
+			return ret;
+		p += ret;
+		last = first;
+		if (*p == '-') {
+			ret = parse_day(p + 1, &last);
+			if (ret < 0)
+				return ret;
+			p += ret + 1;
+		}
+		for (;; first = (first + 1) % 7) {
+			*mask |= 1 << first;
+			if (first == last)
+				break;
+		}
+		if (*p != ',')
+			return p - start;
+		p++;
+	}
+}
+
+static int parse_hh_mm(const char *p, int *minutes)
+{
+	int h, m, n;
+
+	if (sscanf(p, "%2d:%2d%n", &h, &m, &n) != 2)
+		return -E_TIME_WINDOW;
+	if (h < 0 || h > 24 || m < 0 || m > 59 || (h == 24 && m != 0))
+		return -E_TIME_WINDOW;
+	*minutes = h * 60 + m;
+	return n;
+}
+
+/*
+ * A window is "[days] [HH:MM-HH:MM]". If the time range wraps around
+ * midnight, it starts on the given days and ends on the next day.
+ */
+static int parse_time_window(const char *spec, uint8_t *bitmap)
+{
+	const char *p = spec + strspn(spec, " \t");
+	unsigned days = 0x7f;
+	int day, start = 0, end = MINUTES_PER_DAY, ret, m;
+
+	if (*p && !(*p >= '0' && *p <= '9')) {
+		ret = parse_days(p, &days);
+		if (ret < 0)
+			return ret;
+		p += ret;
+		p += strspn(p, " \t");
+	}
+	if (*p) {
+		ret = parse_hh_mm(p, &start);
+		if (ret < 0)
+			return ret;
+		p += ret;
+		if (*p++ != '-')
+			return -E_TIME_WINDOW;
+		ret = parse_hh_mm(p, &end);
+		if (ret < 0)
+			return ret;
+		p += ret;
+		if (end <= start)
+			end += MINUTES_PER_DAY;
+	}
+	if (p[strspn(p, " \t")])
+		return -E_TIME_WINDOW;
+	for (day = 0; day < 7; day++) {
+		if (!(days & (1 << day)))
+			continue;
+		for (m = start; m < end; m++) {
+			int minute = (day * MINUTES_PER_DAY + m) % MINUTES_PER_WEEK;
+			bitmap[minute / 8] |= 1 << (minute % 8);
+		}
+	}
+	return 1;
+}
+
+/**
+ * Compute the bitmap of a set of time windows.
+ *
+ * \param specs The windows, see the description of --create-window.
+ * \param num_specs The number of entries in \a specs.
+ * \param result A bitmap of \ref MINUTES_PER_WEEK bits is returned here.
+ *
+ * \return Standard.
+ */
+int parse_time_windows(char * const *specs, unsigned num_specs,
+		uint8_t **result)
+{
+	uint8_t *bitmap = dss_calloc(MINUTES_PER_WEEK / 8);
+	unsigned u;
+	int ret;
+
+	for (u = 0; u < num_specs; u++) {
+		ret = parse_time_window(specs[u], bitmap);
+		if (ret < 0) {
+			DSS_ERROR_LOG(("bad time window: %s\n", specs[u]));
+			free(bitmap);
+			return ret;
+		}
+	}
+	*result = bitmap;
+	return 1;
+}
+
+static int minute_of_week(int64_t t, int *seconds)
+{
+	time_t t_copy = (time_t)t;
+	struct tm t_tm;
+
+	if (!localtime_r(&t_copy, &t_tm))
+		return -E_LOCALTIME;
+	*seconds = t_tm.tm_sec;
+	return (t_tm.tm_wday * 24 + t_tm.tm_hour) * 60 + t_tm.tm_min;
+}
+
+static inline int bit_is_set(const uint8_t *bitmap, int minute)
+{
+	return bitmap[minute / 8] & (1 << (minute % 8));
+}
+
+/**
+ * Check whether a point in time lies within a set of time windows.
+ *
+ * \param bitmap As returned by \ref parse_time_windows().
+ * \param t The time to check.
+ * \param next_change The first time after \a t at which the result changes.
+ *
+ * If the result never changes, \a next_change is set to one week from \a t.
+ *
+ * \return Positive if \a t lies within a window, zero if not, negative on
+ * errors.
+ */
+int in_time_window(const uint8_t *bitmap, int64_t t, int64_t *next_change)
+{
+	int sec, m, n, ret = minute_of_week(t, &sec);
+
+	if (ret < 0)
+		return ret;
+	m = ret;
+	ret = bit_is_set(bitmap, m)? 1 : 0;
+	for (n = 1; n < MINUTES_PER_WEEK; n++)
+		if (!bit_is_set(bitmap, (m + n) % MINUTES_PER_WEEK) != !ret)
+			break;
+	*next_change = t - sec + 60 * n;
+	return ret;
+}
+
+/**
+ * Check whether a file system is mounted at the given path.
+ *
+ * \param path The mountpoint.
+ *
+ * A directory is a mountpoint if it lives on a different device than its
+ * parent, or if it is the root directory.
+ *
+ * \return Positive if \a path is a mountpoint, zero if not, negative on
+ * errors. It is not an error if \a path does not exist.
+ */
+int is_mountpoint(const char *path)
+{
+	struct stat st, parent_st;
+	char *parent = make_message("%s/..", path);
+	int ret;
+
+	if (stat(path, &st) < 0) {
+		ret = errno == ENOENT? 0 : -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	if (stat(parent, &parent_st) < 0) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	ret = st.st_dev != parent_st.st_dev || st.st_ino == parent_st.st_ino;
+out:
+	free(parent);
+	return ret;
+}
+
+/**
+ * Get the recent I/O pressure of the system.
+ *
+ * \param percent The share of time in which at least one task was stalled on
+ * I/O, averaged over the last ten seconds.
+ *
+ * \return Standard. This fails on kernels without pressure stall information.
+ */
+int get_io_pressure(double *percent)
+{
+	FILE *f = fopen("/proc/pressure/io", "r");
+	char line[200];
+	int ret = -ERRNO_TO_DSS_ERROR(ENODATA);
+
+	if (!f)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "some avg10=%lf", percent) == 1) {
+			ret = 1;
+			break;
+		}
+	}
+	fclose(f);
+	return ret;
+}
@@ -0,0 +1,16 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/** \file cond.h Conditions for snapshot creation, see cond.c. */
+
+/** The number of bits of a time window bitmap. */
+#define MINUTES_PER_WEEK (7 * 24 * 60)
+
+int parse_time_windows(char * const *specs, unsigned num_specs,
+		uint8_t **result);
+int in_time_window(const uint8_t *bitmap, int64_t t, int64_t *next_change);
+int is_mountpoint(const char *path);
+int get_io_pressure(double *percent);
@@ -0,0 +1,477 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/**
+ * \file coproc.c The hook coprocess.
+ *
+ * Instead of executing a hook command for each event, dss may start a single
+ * long-running process and send the events to it. This saves the startup cost
+ * of the hook, which is significant for interpreted languages if snapshots
+ * are taken every few minutes.
+ *
+ * stdin and stdout of the coprocess are connected to a socket. Each event is
+ * one line of space-separated key=value pairs, for example
+ *
+ *	id=3 event=pre-remove path=/dest/2011-01-01T00:00:00 reason=outdated
+ *
+ * Bytes of a value which are special, i.e. '%', '=', whitespace and control
+ * characters, are written as %XX with two hex digits. The coprocess must
+ * answer pre-create and pre-remove events with a line like
+ *
+ *	id=3 status=0
+ *
+ * where the status has the meaning of the exit status of the corresponding
+ * hook: non-zero vetoes the operation. Other events need no reply, and keys
+ * which dss does not know about are ignored.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+
+#include "gcc-compat.h"
+#include "log.h"
+#include "err.h"
+#include "str.h"
+#include "file.h"
+#include "tv.h"
+#include "exec.h"
+#include "event.h"
+#include "coproc.h"
+
+/* Do not start the coprocess more often than this. */
+#define RESTART_DELAY 60
+
+/* Seconds between SIGTERM and SIGKILL. */
+#define KILL_DELAY 10
+
+/* Requests which wait for a reply, at most one per event type. */
+#define MAX_PENDING 4
+
+/* The wait status for a missing reply, which vetoes the operation. */
+#define VETO_STATUS W_EXITCODE(1, 0)
+
+static const char * const event_names[] = {
+	[CE_PRE_CREATE] = "pre-create",
+	[CE_POST_CREATE] = "post-create",
+	[CE_PRE_REMOVE] = "pre-remove",
+	[CE_POST_REMOVE] = "post-remove",
+	[CE_EXIT] = "exit",
+};
+
+/** An event which waits for a reply. */
+struct request {
+	/** Identifies the reply. */
+	unsigned id;
+	/** For log messages. */
+	enum coproc_event event;
+	/** Zero means no timeout. */
+	int64_t deadline;
+	/** Called with the status of the reply. */
+	int (*done)(int status);
+};
+
+static struct {
+	char *cmdline;
+	pid_t pid;
+	int fd;
+	struct line_buffer lb;
+	int64_t next_start;
+	/* When to send SIGKILL to a coprocess which ignored SIGTERM. */
+	int64_t kill_deadline;
+	unsigned next_id;
+	struct request pending[MAX_PENDING];
+	unsigned num_pending;
+	unsigned num_starts, num_events, num_vetoes, num_timeouts;
+} cp = {.fd = -1};
+
+static int start_coproc(void)
+{
+	int ret, fds[2];
+
+	cp.next_start = get_current_time() + RESTART_DELAY;
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	ret = mark_fd_nonblocking(fds[0]);
+	if (ret < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return ret;
+	}
+	DSS_NOTICE_LOG(("starting hook coprocess %s\n", cp.cmdline));
+	dss_exec_cmdline_stdio(&cp.pid, fds[1], cp.cmdline);
+	close(fds[1]);
+	cp.fd = fds[0];
+	cp.lb.len = 0;
+	cp.num_starts++;
+	return 1;
+}
+
+/**
+ * Start the hook coprocess.
+ *
+ * \param cmdline The command and its arguments, separated by spaces.
+ *
+ * After this, \ref coproc_enabled() returns true.
+ *
+ * \return Standard.
+ */
+int coproc_init(const char *cmdline)
+{
+	assert(!cp.cmdline);
+	cp.cmdline = dss_strdup(cmdline);
+	return start_coproc();
+}
+
+/**
+ * Find out whether the events go to the hook coprocess.
+ *
+ * \return Non-zero after \ref coproc_init().
+ */
+int coproc_enabled(void)
+{
+	return cp.cmdline != NULL;
+}
+
+/**
+ * Get the socket of the hook coprocess.
+ *
+ * \return The file descriptor, or -1 if the coprocess is not running.
+ */
+int coproc_fd(void)
+{
+	return cp.fd;
+}
+
+/* Veto all pending requests. Returns the first error of the callbacks. */
+static int fail_pending(void)
+{
+	int ret = 1;
+
+	while (cp.num_pending > 0) {
+		struct request r = cp.pending[--cp.num_pending];
+		int ret2 = r.done(VETO_STATUS);
+
+		cp.num_vetoes++;
+		if (ret2 < 0 && ret >= 0)
+			ret = ret2;
+	}
+	return ret;
+}
+
+/*
+ * Close the socket, which tells the coprocess to exit. If it does not, it is
+ * terminated, and killed if it is still around after KILL_DELAY seconds. The
+ * coprocess is restarted on the next event after it has been reaped.
+ */
+static int stop_coproc(int sig)
+{
+	if (cp.fd >= 0) {
+		event_unwatch(cp.fd);
+		close(cp.fd);
+		cp.fd = -1;
+	}
+	if (sig && cp.pid > 0) {
+		kill(cp.pid, sig);
+		if (sig != SIGKILL && cp.kill_deadline == 0)
+			cp.kill_deadline = get_current_time() + KILL_DELAY;
+	}
+	return fail_pending();
+}
+
+static int ensure_running(void)
+{
+	int ret;
+
+	if (cp.fd >= 0)
+		return 1;
+	if (cp.pid > 0 || get_current_time() < cp.next_start)
+		return 0;
+	ret = start_coproc();
+	if (ret < 0)
+		DSS_ERROR_LOG(("can not start hook coprocess: %s\n",
+			dss_strerror(-ret)));
+	return ret;
+}
+
+static void append_value(char **line, const char *key, const char *val)
+{
+	size_t len = strlen(*line);
+	const unsigned char *p;
+	char *q;
+
+	/* worst case: every byte is escaped */
+	*line = dss_realloc(*line, len + strlen(key) + 3 * strlen(val) + 3);
+	q = *line + len;
+	q += sprintf(q, " %s=", key);
+	for (p = (const unsigned char *)val; *p; p++) {
+		if (*p <= ' ' || *p == '%' || *p == '=' || *p == 0x7f)
+			q += sprintf(q, "%%%02X", *p);
+		else
+			*q++ = *p;
+	}
+	*q = '\0';
+}
+
+static int send_event(unsigned id, enum coproc_event event, const char *path,
+		const char *reason)
+{
+	char *line = make_message("id=%u event=%s", id, event_names[event]);
+	size_t len, sent = 0;
+	int ret = 1;
+
+	if (path)
+		append_value(&line, "path", path);
+	if (reason)
+		append_value(&line, "reason", reason);
+	DSS_DEBUG_LOG(("to hook coprocess: %s\n", line));
+	len = strlen(line);
+	line[len++] = '\n'; /* replaces the terminating zero byte */
+	while (sent < len) {
+		/* a coprocess which does not read its input is broken */
+		ssize_t n = send(cp.fd, line + sent, len - sent,
+			MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -ERRNO_TO_DSS_ERROR(errno);
+			break;
+		}
+		sent += n;
+	}
+	free(line);
+	if (ret < 0) {
+		DSS_WARNING_LOG(("hook coprocess: %s\n", dss_strerror(-ret)));
+		stop_coproc(SIGTERM);
+		return ret;
+	}
+	cp.num_events++;
+	return 1;
+}
+
+/**
+ * Send an event which needs a reply.
+ *
+ * \param event \ref CE_PRE_CREATE or \ref CE_PRE_REMOVE.
+ * \param path The snapshot, may be \p NULL.
+ * \param reason Why the event happens, may be \p NULL.
+ * \param timeout Seconds to wait for the reply, zero means no timeout.
+ * \param done Called with a wait status when the reply arrives.
+ *
+ * If the reply does not arrive in time, or if the coprocess dies, \a done is
+ * called with a non-zero exit status, and the coprocess is restarted. The
+ * return value of \a done is passed back to the caller of \ref coproc_read(),
+ * \ref coproc_expire() or \ref coproc_exited().
+ *
+ * \return Positive if the event was sent, zero or negative if not. In the
+ * latter case \a done is never called.
+ */
+int coproc_request(enum coproc_event event, const char *path,
+		const char *reason, int timeout, int (*done)(int status))
+{
+	struct request *r;
+	int ret = ensure_running();
+
+	if (ret <= 0)
+		return ret;
+	assert(cp.num_pending < MAX_PENDING);
+	ret = send_event(cp.next_id, event, path, reason);
+	if (ret < 0)
+		return ret;
+	r = cp.pending + cp.num_pending++;
+	r->id = cp.next_id++;
+	r->event = event;
+	r->deadline = timeout > 0? get_current_time() + timeout : 0;
+	r->done = done;
+	return 1;
+}
+
+/**
+ * Send an event which needs no reply.
+ *
+ * \param event The event.
+ * \param path The snapshot, may be \p NULL.
+ * \param reason Why the event happens, may be \p NULL.
+ *
+ * Failures are logged but otherwise ignored.
+ */
+void coproc_notify(enum coproc_event event, const char *path,
+		const char *reason)
+{
+	if (ensure_running() <= 0) {
+		DSS_WARNING_LOG(("hook coprocess not running, %s event "
+			"dropped\n", event_names[event]));
+		return;
+	}
+	send_event(cp.next_id++, event, path, reason);
+}
+
+static void handle_reply(char *line, void *data)
+{
+	int *result = data;
+	unsigned u;
+	int64_t id = -1, status = -1;
+	char *word, *save;
+
+	DSS_DEBUG_LOG(("from hook coprocess: %s\n", line));
+	for (word = strtok_r(line, " \t", &save); word;
+			word = strtok_r(NULL, " \t", &save)) {
+		if (!strncmp(word, "id=", 3))
+			dss_atoi64(word + 3, &id);
+		else if (!strncmp(word, "status=", 7))
+			dss_atoi64(word + 7, &status);
+	}
+	if (status < 0 || status > 255) {
+		DSS_WARNING_LOG(("hook coprocess: bad reply\n"));
+		return;
+	}
+	for (u = 0; u < cp.num_pending; u++) {
+		struct request r = cp.pending[u];
+		int ret;
+
+		if (r.id != id)
+			continue;
+		cp.pending[u] = cp.pending[--cp.num_pending];
+		if (status != 0)
+			cp.num_vetoes++;
+		ret = r.done(W_EXITCODE((int)status, 0));
+		if (ret < 0 && *result >= 0)
+			*result = ret;
+		return;
+	}
+	DSS_INFO_LOG(("hook coprocess: late reply %" PRId64 " ignored\n",
+		id));
+}
+
+/**
+ * Read the replies of the hook coprocess.
+ *
+ * This must be called when the socket of the coprocess is readable.
+ *
+ * \return Standard.
+ */
+int coproc_read(void)
+{
+	int result = 1, ret = read_lines(cp.fd, &cp.lb, handle_reply, &result);
+
+	if (ret > 0)
+		return result;
+	if (ret == 0)
+		DSS_WARNING_LOG(("hook coprocess closed its output\n"));
+	else
+		DSS_WARNING_LOG(("hook coprocess: %s\n", dss_strerror(-ret)));
+	ret = stop_coproc(SIGTERM);
+	return result < 0? result : ret;
+}
+
+/**
+ * Veto the requests whose reply is overdue.
+ *
+ * The coprocess is considered hung and is terminated. A coprocess which
+ * survived SIGTERM for too long is killed.
+ *
+ * \return Standard.
+ */
+int coproc_expire(void)
+{
+	int64_t now = get_current_time();
+	unsigned u;
+
+	if (cp.kill_deadline > 0 && cp.kill_deadline <= now && cp.pid > 0) {
+		DSS_WARNING_LOG(("hook coprocess ignored SIGTERM, killing it\n"));
+		cp.kill_deadline = 0;
+		kill(cp.pid, SIGKILL);
+	}
+	for (u = 0; u < cp.num_pending; u++) {
+		struct request *r = cp.pending + u;
+
+		if (r->deadline == 0 || r->deadline > now)
+			continue;
+		DSS_ERROR_LOG(("no reply to %s event from hook coprocess\n",
+			event_names[r->event]));
+		cp.num_timeouts++;
+		return stop_coproc(SIGKILL);
+	}
+	return 1;
+}
+
+/**
+ * Get the time at which \ref coproc_expire() has something to do next.
+ *
+ * \return Zero if no reply is awaited or there is no timeout, and no coprocess
+ * waits to be killed.
+ */
+int64_t coproc_next_deadline(void)
+{
+	int64_t deadline = cp.pid > 0? cp.kill_deadline : 0;
+	unsigned u;
+
+	for (u = 0; u < cp.num_pending; u++) {
+		int64_t d = cp.pending[u].deadline;
+
+		if (d > 0 && (deadline == 0 || d < deadline))
+			deadline = d;
+	}
+	return deadline;
+}
+
+/**
+ * Handle the exit of a child process.
+ *
+ * \param pid The child which has exited.
+ * \param status Its exit status.
+ *
+ * \return Zero if \a pid is not the hook coprocess. Otherwise the pending
+ * requests are vetoed, and the result of their callbacks is returned.
+ */
+int coproc_exited(pid_t pid, int status)
+{
+	if (pid != cp.pid || pid == 0)
+		return 0;
+	cp.pid = 0;
+	cp.kill_deadline = 0;
+	DSS_WARNING_LOG(("hook coprocess exited with status %#x\n",
+		(unsigned)status));
+	return stop_coproc(0);
+}
+
+/**
+ * Tell the hook coprocess to exit.
+ *
+ * The socket is closed, and the coprocess is expected to exit on end of file.
+ */
+void coproc_shutdown(void)
+{
+	if (cp.fd < 0)
+		return;
+	event_unwatch(cp.fd);
+	close(cp.fd);
+	cp.fd = -1;
+}
+
+/**
+ * Print the state of the hook coprocess.
+ *
+ * \param f Where to print to.
+ */
+void coproc_dump(FILE *f)
+{
+	if (!cp.cmdline)
+		return;
+	fprintf(f, "hook coprocess: pid %d, started %u time(s), %u events, "
+		"%u pending, %u vetoes, %u timeouts\n", (int)cp.pid,
+		cp.num_starts, cp.num_events, cp.num_pending, cp.num_vetoes,
+		cp.num_timeouts);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/** \file coproc.h The hook coprocess, see coproc.c. */
+
+/** The events which are sent to the hook coprocess. */
+enum coproc_event {
+	/** A snapshot is about to be created. Needs a reply. */
+	CE_PRE_CREATE,
+	/** A snapshot has been created. */
+	CE_POST_CREATE,
+	/** A snapshot is about to be removed. Needs a reply. */
+	CE_PRE_REMOVE,
+	/** A snapshot has been removed. */
+	CE_POST_REMOVE,
+	/** dss is about to exit. */
+	CE_EXIT,
+};
+
+int coproc_init(const char *cmdline);
+int coproc_enabled(void);
+int coproc_fd(void);
+int coproc_request(enum coproc_event event, const char *path,
+		const char *reason, int timeout, int (*done)(int status));
+void coproc_notify(enum coproc_event event, const char *path,
+		const char *reason);
+int coproc_read(void);
+int coproc_expire(void);
+int64_t coproc_next_deadline(void);
+int coproc_exited(pid_t pid, int status);
+void coproc_shutdown(void);
+void coproc_dump(FILE *f);
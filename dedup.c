@@ -0,0 +1,551 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/**
+ * \file dedup.c Hardlink moved files, reflink modified files.
+ *
+ * rsync's --link-dest only finds unchanged files under the same relative path.
+ * Files which were renamed or moved to another directory on the source are
+ * therefore copied again. This file implements a post-processing step which
+ * finds such files in a new snapshot and replaces them by hardlinks.
+ *
+ * Candidates are regular files of the new snapshot with a link count of one,
+ * i.e. files which rsync did not hardlink. A candidate is replaced by a
+ * hardlink to a file of the reference snapshot if both files have the same
+ * size, permissions, owner and modification time, and the same content. To
+ * avoid reading files needlessly, contents are compared by a hash first. Only
+ * if the hashes match, the files are compared byte by byte.
+ *
+ * Candidates which are not hardlinked this way, but have a counterpart under
+ * the same path in the reference snapshot, may be replaced by an extent-sharing
+ * copy instead, see reflink.c.
+ *
+ * Finally, the number of links per inode is limited, for example to 65000 on
+ * ext4. A file which never changes on the source gains one link per snapshot,
+ * and once the limit is reached, rsync can no longer hardlink against it. To
+ * avoid this, files of the new snapshot whose link count approaches the limit
+ * are replaced by a copy. The next snapshot is hardlinked against the copy,
+ * which starts a new chain of links. This costs one copy per file for every
+ * few ten thousand snapshots.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "gcc-compat.h"
+#include "log.h"
+#include "err.h"
+#include "str.h"
+#include "file.h"
+#include "reflink.h"
+#include "dedup.h"
+
+/** A regular file of the reference snapshot. */
+struct ref_file {
+	/** Path, relative to the dest dir. */
+	char *path;
+	/** As returned by lstat(2). */
+	struct stat st;
+	/** Content hash, only valid if \a have_hash is set. */
+	uint64_t hash;
+	/** Whether \a hash was already computed. */
+	int have_hash;
+};
+
+/** An inode whose chain of links was split, see \ref split_link_chain(). */
+struct split_inode {
+	/** Device and inode number of the old inode. */
+	dev_t dev;
+	ino_t ino;
+	/** The first path which received a new inode. */
+	char *path;
+};
+
+struct dedup_data {
+	/** Parameters as passed to \ref dedup_snapshot(). */
+	const struct dedup_params *params;
+	/** Paths of the snapshot and the reference snapshot. */
+	const char *snapshot, *reference;
+	/** Set if the first reflink attempt failed for lack of support. */
+	int no_reflinks;
+	/** The index of the reference snapshot, sorted by size. */
+	struct ref_file *files;
+	size_t num_files, array_size;
+	/** Number of files replaced by hardlinks. */
+	unsigned num_linked;
+	/** The size of these files. */
+	int64_t linked_size;
+	/** Number of modified files which share blocks with their old version. */
+	unsigned num_reflinked;
+	/** The number of shared bytes. */
+	int64_t shared_size;
+	/**
+	 * Inodes which were split, and the path of their replacement. This is
+	 * a hash table with \a split_array_size slots, a power of two. Unused
+	 * slots have a NULL path.
+	 */
+	struct split_inode *split;
+	unsigned num_split, split_array_size;
+	/** The total size of the split files. */
+	int64_t split_size;
+	/** The maximal link count of the files of the snapshot. */
+	nlink_t max_nlink;
+};
+
+#define DEDUP_BUFSIZE (64 * 1024)
+
+/* 64 bit FNV-1a hash of the contents of a file. */
+static int hash_file(const char *path, uint64_t *result)
+{
+	char *buf = dss_malloc(DEDUP_BUFSIZE);
+	uint64_t hash = 14695981039346656037ULL;
+	int ret, fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	for (;;) {
+		ssize_t i, n = read(fd, buf, DEDUP_BUFSIZE);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -ERRNO_TO_DSS_ERROR(errno);
+			break;
+		}
+		if (n == 0) {
+			*result = hash;
+			ret = 1;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			hash ^= (unsigned char)buf[i];
+			hash *= 1099511628211ULL;
+		}
+	}
+	close(fd);
+out:
+	free(buf);
+	return ret;
+}
+
+/* Returns positive if both files have the same content, zero if not. */
+static int files_equal(const char *path1, const char *path2)
+{
+	char *buf1 = dss_malloc(DEDUP_BUFSIZE), *buf2 = dss_malloc(DEDUP_BUFSIZE);
+	int ret = 0, fd1 = open(path1, O_RDONLY), fd2 = open(path2, O_RDONLY);
+
+	if (fd1 < 0 || fd2 < 0)
+		goto out;
+	for (;;) {
+		ssize_t n1 = read(fd1, buf1, DEDUP_BUFSIZE), n2;
+
+		if (n1 < 0)
+			break;
+		/* regular files: short reads only happen at EOF */
+		n2 = read(fd2, buf2, n1 > 0? n1 : 1);
+		if (n1 != n2 || memcmp(buf1, buf2, n1))
+			break;
+		if (n1 == 0) {
+			ret = 1;
+			break;
+		}
+	}
+out:
+	if (fd1 >= 0)
+		close(fd1);
+	if (fd2 >= 0)
+		close(fd2);
+	free(buf1);
+	free(buf2);
+	return ret;
+}
+
+static int add_ref_file(const char *path, const struct stat *st, void *private)
+{
+	struct dedup_data *dd = private;
+	struct ref_file *rf;
+
+	if (S_ISDIR(st->st_mode))
+		return 1;
+	if (!S_ISREG(st->st_mode) || st->st_size < dd->params->moved_min_size)
+		return 1;
+	if (dd->num_files >= dd->array_size) {
+		dd->array_size = 2 * dd->array_size + 1;
+		dd->files = dss_realloc(dd->files,
+			dd->array_size * sizeof(struct ref_file));
+	}
+	rf = dd->files + dd->num_files++;
+	rf->path = dss_strdup(path);
+	rf->st = *st;
+	rf->have_hash = 0;
+	return 1;
+}
+
+#define NUM_COMPARE(x, y) ((int)((x) > (y)) - (int)((x) < (y)))
+
+static int compare_ref_files(const void *a, const void *b)
+{
+	const struct ref_file *rf1 = a, *rf2 = b;
+
+	if (rf1->st.st_size != rf2->st.st_size)
+		return NUM_COMPARE(rf1->st.st_size, rf2->st.st_size);
+	if (rf1->st.st_dev != rf2->st.st_dev)
+		return NUM_COMPARE(rf1->st.st_dev, rf2->st.st_dev);
+	return NUM_COMPARE(rf1->st.st_ino, rf2->st.st_ino);
+}
+
+/* Sort the index and drop multiple paths of the same inode. */
+static void sort_index(struct dedup_data *dd)
+{
+	size_t i, j;
+
+	qsort(dd->files, dd->num_files, sizeof(struct ref_file),
+		compare_ref_files);
+	for (i = 0, j = 0; i < dd->num_files; i++) {
+		if (j > 0 && dd->files[j - 1].st.st_dev == dd->files[i].st.st_dev
+				&& dd->files[j - 1].st.st_ino == dd->files[i].st.st_ino) {
+			free(dd->files[i].path);
+			continue;
+		}
+		dd->files[j++] = dd->files[i];
+	}
+	dd->num_files = j;
+}
+
+/* Index of the first reference file of the given size, or num_files. */
+static size_t lookup_size(struct dedup_data *dd, off_t size)
+{
+	size_t lo = 0, hi = dd->num_files;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (dd->files[mid].st.st_size < size)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int same_metadata(const struct stat *st1, const struct stat *st2)
+{
+	return st1->st_mode == st2->st_mode && st1->st_uid == st2->st_uid
+		&& st1->st_gid == st2->st_gid && st1->st_mtime == st2->st_mtime
+		&& st1->st_dev == st2->st_dev;
+}
+
+/* Atomically replace path by a hardlink to target. */
+static int replace_by_link(const char *target, const char *path)
+{
+	char *tmp = make_message("%s.dss-dedup", path);
+	int ret;
+
+	if (link(target, tmp) < 0) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	ret = dss_rename(tmp, path);
+	if (ret < 0)
+		unlink(tmp);
+out:
+	free(tmp);
+	return ret;
+}
+
+/* Returns positive if path was replaced by a hardlink to a moved file. */
+static int link_moved_file(struct dedup_data *dd, const char *path,
+		const struct stat *st)
+{
+	size_t i;
+	uint64_t hash;
+	int ret, have_hash = 0;
+
+	if (st->st_size < dd->params->moved_min_size)
+		return 0;
+	for (i = lookup_size(dd, st->st_size); i < dd->num_files; i++) {
+		struct ref_file *rf = dd->files + i;
+
+		if (rf->st.st_size != st->st_size)
+			break;
+		if (!same_metadata(&rf->st, st))
+			continue;
+		if (!have_hash) {
+			if (hash_file(path, &hash) < 0)
+				return 0;
+			have_hash = 1;
+		}
+		if (!rf->have_hash) {
+			if (hash_file(rf->path, &rf->hash) < 0)
+				continue;
+			rf->have_hash = 1;
+		}
+		if (rf->hash != hash)
+			continue;
+		if (!files_equal(rf->path, path))
+			continue;
+		ret = replace_by_link(rf->path, path);
+		if (ret < 0) { /* e.g. EMLINK, not fatal */
+			DSS_WARNING_LOG(("%s: %s\n", path, dss_strerror(-ret)));
+			return 0;
+		}
+		DSS_DEBUG_LOG(("%s -> %s\n", path, rf->path));
+		dd->num_linked++;
+		dd->linked_size += st->st_size;
+		return 1;
+	}
+	return 0;
+}
+
+/* Let a modified file share blocks with its version in the reference. */
+static void reflink_file(struct dedup_data *dd, const char *path,
+		const struct stat *st)
+{
+	char *ref_path;
+	struct stat ref_st;
+	int64_t shared;
+	int ret;
+
+	if (dd->no_reflinks || st->st_size < dd->params->reflink_min_size)
+		return;
+	ref_path = make_message("%s%s", dd->reference,
+		path + strlen(dd->snapshot));
+	if (lstat(ref_path, &ref_st) < 0 || !S_ISREG(ref_st.st_mode))
+		goto out;
+	ret = reflink_changed_file(path, st, ref_path, &shared);
+	if (ret < 0) {
+		if (reflinks_unsupported(ret)) {
+			DSS_NOTICE_LOG(("no reflink support: %s\n",
+				dss_strerror(-ret)));
+			dd->no_reflinks = 1;
+		} else
+			DSS_WARNING_LOG(("%s: %s\n", path, dss_strerror(-ret)));
+		goto out;
+	}
+	if (ret == 0)
+		goto out;
+	DSS_DEBUG_LOG(("%s: %" PRId64 " bytes shared with %s\n", path,
+		shared, ref_path));
+	dd->num_reflinked++;
+	dd->shared_size += shared;
+out:
+	free(ref_path);
+}
+
+static int copy_file(const char *src, const char *dst, const struct stat *st)
+{
+	char *buf = dss_malloc(DEDUP_BUFSIZE);
+	int ret, dst_fd = -1, fd = open(src, O_RDONLY);
+
+	if (fd < 0) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	dst_fd = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (dst_fd < 0) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	for (;;) {
+		ssize_t written = 0, n = read(fd, buf, DEDUP_BUFSIZE);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -ERRNO_TO_DSS_ERROR(errno);
+			goto out;
+		}
+		if (n == 0)
+			break;
+		while (written < n) {
+			ssize_t w = write(dst_fd, buf + written, n - written);
+
+			if (w < 0) {
+				if (errno == EINTR)
+					continue;
+				ret = -ERRNO_TO_DSS_ERROR(errno);
+				goto out;
+			}
+			written += w;
+		}
+	}
+	copy_metadata(dst_fd, st);
+	ret = copy_xattrs(fd, dst_fd);
+	if (ret < 0)
+		goto out;
+	ret = close(dst_fd) < 0? -ERRNO_TO_DSS_ERROR(errno) : 1;
+	dst_fd = -1;
+out:
+	if (dst_fd >= 0)
+		close(dst_fd);
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	return ret;
+}
+
+/*
+ * The slot of the hash table for the given inode: either the slot which holds
+ * it, or the empty slot where it belongs. The table is at most half full, so
+ * the probe sequence always ends at an empty slot.
+ */
+static struct split_inode *split_slot(struct dedup_data *dd, dev_t dev,
+		ino_t ino)
+{
+	unsigned mask = dd->split_array_size - 1;
+	uint64_t h = ((uint64_t)ino ^ ((uint64_t)dev << 32))
+		* 0x9e3779b97f4a7c15ULL;
+	unsigned u = (h >> 32) & mask;
+
+	for (; dd->split[u].path; u = (u + 1) & mask)
+		if (dd->split[u].dev == dev && dd->split[u].ino == ino)
+			break;
+	return dd->split + u;
+}
+
+static void grow_split_table(struct dedup_data *dd)
+{
+	struct split_inode *old = dd->split;
+	unsigned u, old_size = dd->split_array_size;
+
+	dd->split_array_size = old_size? 2 * old_size : 64;
+	dd->split = dss_calloc(dd->split_array_size * sizeof(*dd->split));
+	for (u = 0; u < old_size; u++)
+		if (old[u].path)
+			*split_slot(dd, old[u].dev, old[u].ino) = old[u];
+	free(old);
+}
+
+/*
+ * Give a file whose link count approaches the limit a new inode. Further paths
+ * of the snapshot which refer to the same old inode are hardlinked against
+ * the new one.
+ */
+static void split_link_chain(struct dedup_data *dd, const char *path,
+		const struct stat *st)
+{
+	char *tmp;
+	struct split_inode *si;
+	int ret;
+
+	if (dd->num_split > 0) {
+		si = split_slot(dd, st->st_dev, st->st_ino);
+		if (si->path) {
+			ret = replace_by_link(si->path, path);
+			if (ret < 0)
+				DSS_WARNING_LOG(("%s: %s\n", path,
+					dss_strerror(-ret)));
+			return;
+		}
+	}
+	if (dd->params->max_links <= 0 || st->st_nlink < dd->params->max_links)
+		return;
+	tmp = make_message("%s.dss-split", path);
+	ret = copy_file(path, tmp, st);
+	if (ret >= 0)
+		ret = dss_rename(tmp, path);
+	if (ret < 0) {
+		DSS_WARNING_LOG(("%s: %s\n", path, dss_strerror(-ret)));
+		unlink(tmp);
+		goto out;
+	}
+	DSS_DEBUG_LOG(("%s: new inode (%u links)\n", path,
+		(unsigned)st->st_nlink));
+	if (2 * (dd->num_split + 1) > dd->split_array_size)
+		grow_split_table(dd);
+	si = split_slot(dd, st->st_dev, st->st_ino);
+	dd->num_split++;
+	si->dev = st->st_dev;
+	si->ino = st->st_ino;
+	si->path = dss_strdup(path);
+	dd->split_size += st->st_size;
+out:
+	free(tmp);
+}
+
+static int dedup_file(const char *path, const struct stat *st, void *private)
+{
+	struct dedup_data *dd = private;
+
+	if (!S_ISREG(st->st_mode))
+		return 1;
+	if (st->st_nlink > dd->max_nlink)
+		dd->max_nlink = st->st_nlink;
+	/* Files with more than one link are unchanged. */
+	if (st->st_nlink != 1) {
+		split_link_chain(dd, path, st);
+		return 1;
+	}
+	if (dd->params->moved_min_size >= 0 && link_moved_file(dd, path, st))
+		return 1;
+	if (dd->params->reflink_min_size >= 0)
+		reflink_file(dd, path, st);
+	return 1;
+}
+
+/**
+ * Reduce the space occupied by a snapshot.
+ *
+ * \param snapshot The snapshot to deduplicate.
+ * \param reference The reference snapshot.
+ * \param params Which methods to apply to which files.
+ *
+ * On success, the number and the total size of the affected files are written
+ * to stdout, in the same format as the statistics of rsync.
+ *
+ * \return Standard.
+ */
+int dedup_snapshot(const char *snapshot, const char *reference,
+		const struct dedup_params *params)
+{
+	struct dedup_data dd;
+	size_t i;
+	int ret;
+
+	memset(&dd, 0, sizeof(dd));
+	dd.params = params;
+	dd.snapshot = snapshot;
+	dd.reference = reference;
+	if (params->moved_min_size >= 0) {
+		DSS_INFO_LOG(("indexing %s\n", reference));
+		ret = for_each_file_in_tree(reference, add_ref_file, &dd);
+		if (ret < 0)
+			goto out;
+		sort_index(&dd);
+		DSS_INFO_LOG(("%zu files indexed\n", dd.num_files));
+	}
+	ret = for_each_file_in_tree(snapshot, dedup_file, &dd);
+	if (ret < 0)
+		goto out;
+	printf("Deduplicated files: %u\n", dd.num_linked);
+	printf("Deduplicated file size: %" PRId64 " bytes\n", dd.linked_size);
+	printf("Reflinked files: %u\n", dd.num_reflinked);
+	printf("Reflinked shared size: %" PRId64 " bytes\n", dd.shared_size);
+	printf("Split link chains: %u\n", dd.num_split);
+	printf("Split link chain size: %" PRId64 " bytes\n", dd.split_size);
+	printf("Maximal link count: %u\n", (unsigned)dd.max_nlink);
+	ret = 1;
+out:
+	for (i = 0; i < dd.num_files; i++)
+		free(dd.files[i].path);
+	free(dd.files);
+	for (i = 0; i < dd.split_array_size; i++)
+		free(dd.split[i].path);
+	free(dd.split);
+	if (ret < 0)
+		DSS_ERROR_LOG(("%s\n", dss_strerror(-ret)));
+	return ret;
+}
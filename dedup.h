@@ -0,0 +1,20 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/** \file dedup.h Post-processing of new snapshots, see dedup.c. */
+
+/** Arguments to \ref dedup_snapshot(). Negative sizes disable a method. */
+struct dedup_params {
+	/** Minimal size of files to be hardlinked against moved files. */
+	int64_t moved_min_size;
+	/** Minimal size of modified files to be replaced by reflinks. */
+	int64_t reflink_min_size;
+	/** Link count at which files get a new inode, non-positive: never. */
+	int64_t max_links;
+};
+
+int dedup_snapshot(const char *snapshot, const char *reference,
+		const struct dedup_params *params);
@@ -19,6 +19,7 @@
 #include <sys/wait.h>
 #include <fnmatch.h>
 #include <limits.h>
+#include <dirent.h>
 
 
 #include "gcc-compat.h"
@@ -34,25 +35,50 @@
 #include "tv.h"
 #include "snap.h"
 #include "ipc.h"
+#include "stats.h"
+#include "ssh.h"
+#include "dedup.h"
+#include "thin.h"
+#include "prefetch.h"
+#include "tar.h"
+#include "tune.h"
+#include "predict.h"
+#include "sched.h"
+#include "cond.h"
+#include "event.h"
+#include "hook.h"
+#include "coproc.h"
 
 /** Command line and config file options. */
 static struct gengetopt_args_info conf;
 /** Non-NULL if we log to a file. */
 static FILE *logfile;
 /** The read end of the signal pipe */
-static int signal_pipe;
+static int signal_fd;
 /** Process id of current pre-create-hook/rsync/post-create-hook process. */
 static pid_t create_pid;
 /** Whether the pre-create-hook/rsync/post-create-hook is currently stopped. */
 static int create_process_stopped;
 /** Process id of current pre-remove/rm/post-remove process. */
 static pid_t remove_pid;
+/** Process id of the process which warms the inode cache, see --prefetch. */
+static pid_t prefetch_pid;
 /** When the next snapshot is due. */
 static int64_t next_snapshot_time;
+/** When snapshots may be started, see --create-window. NULL means always. */
+static uint8_t *create_windows;
+/** Do not check the conditions for snapshot creation before this time. */
+static int64_t next_condition_check;
+/** The durations of past snapshots, see predict.c. */
+static struct duration_model duration_model;
+/** Whether \a duration_model has been read from the dest dir. */
+static int duration_model_loaded;
 /** When to try to remove something. */
 static struct timeval next_removal_check;
-/** Creation time of the snapshot currently being created. */
+/** Creation time of the snapshot currently being created, in milliseconds. */
 static int64_t current_snapshot_creation_time;
+/** The value of --unit-interval in seconds. */
+static int64_t unit_interval;
 /** The snapshot currently being removed. */
 struct snapshot *snapshot_currently_being_removed;
 /** Needed by the post-create hook. */
@@ -62,6 +88,77 @@ static char *name_of_reference_snapshot;
 enum hook_status snapshot_creation_status;
 /** \sa \ref snap.h for details. */
 enum hook_status snapshot_removal_status;
+/** The read end of the pipe connected to stdout and stderr of rsync. */
+static int rsync_fd = -1;
+/** Incomplete last line of rsync output. */
+static struct line_buffer rsync_line_buffer;
+/** Statistics of the snapshot currently being created. */
+static struct snapshot_stats snapshot_stats;
+/** The most recent progress line of rsync, if --rsync-progress was given. */
+static char *rsync_progress;
+/** Paths of files rsync failed to transfer, as reported by rsync. */
+static char **failed_files;
+/** The number of entries in \a failed_files. */
+static unsigned num_failed_files;
+/** How many follow-up passes for failed files were started so far. */
+static int failed_files_passes;
+/** rsync statistics of the current follow-up pass. */
+static struct snapshot_stats retry_stats;
+/** The ssh connection to the remote host, shared by all rsync processes. */
+static struct ssh_master ssh_master;
+/** How to talk to the remote host, as found by --tune-transport. */
+static struct transport_settings transport;
+/** Whether \a create_pid refers to the dedup process rather than to rsync. */
+static int dedup_running;
+/** Whether the snapshot being created is a thin snapshot. */
+static int creating_thin;
+/** Whether \a create_pid refers to the rsync process which lists deletions. */
+static int deletion_pass_running;
+/** Paths which the thin snapshot being created lacks, compared to its base. */
+static struct thin_info thin_info;
+/** Whether \a remove_pid refers to a process which folds a base snapshot. */
+static int fold_running;
+
+/** One of several sources of a composite snapshot, see --source. */
+struct composite_source {
+	/** Name of the subdirectory of the snapshot. */
+	char *name;
+	/** NULL for the local host. */
+	char *host;
+	/** NULL for the current user. */
+	char *user;
+	/** The source directory on \a host. */
+	char *dir;
+	/** The rsync command line for this source. */
+	char **argv;
+};
+/** The sources given by --source. */
+static struct composite_source *sources;
+/** The number of entries in \a sources. */
+static unsigned num_sources;
+/** Whether \a create_pid refers to the process which runs all sources. */
+static int sources_running;
+/** Whether \a create_pid refers to the process which unpacks a tar stream. */
+static int tar_running;
+/** Whether \a create_pid refers to the process which updates the mirrors. */
+static int mirror_running;
+/** Absolute path of the snapshot which is copied to the mirrors. */
+static char *mirror_source;
+
+/**
+ * Do not retry individual files if rsync failed to transfer more than this
+ * many. A full rsync run is cheaper than a huge --files-from list.
+ */
+#define MAX_FAILED_FILES 10000
+
+/**
+ * Partially transferred files are kept in this subdirectory of the incomplete
+ * snapshot so that a restarted rsync process can continue where the previous
+ * one stopped.
+ */
+#define PARTIAL_DIR ".dss-partial"
+/** Delay before the first restart of rsync on exit code 12 or 13. */
+#define RESTART_DELAY 60
 
 
 DEFINE_DSS_ERRLIST;
@@ -147,14 +244,29 @@ static void dump_dss_config(const char *msg)
 		);
 	if (remove_pid != 0)
 		fprintf(log, "remove_pid: %" PRId32 "\n", remove_pid);
+	if (rsync_progress)
+		fprintf(log, "rsync progress: %s\n", rsync_progress);
+	sched_client_dump(log);
+	io_token_dump(log);
+	dump_children(log);
+	dump_hooks(log);
+	coproc_dump(log);
+	if (ssh_master.pid != 0)
+		fprintf(log, "ssh master: pid %" PRId32 ", socket %s, "
+			"started %u time(s)\n", ssh_master.pid,
+			ssh_master.socket, ssh_master.num_starts);
 	if (next_snapshot_time != 0)
 		fprintf(log, "next snapshot due in %" PRId64 " seconds\n",
 			next_snapshot_time - now);
+	if (duration_model_loaded)
+		dump_duration_model(&duration_model, log,
+			next_snapshot_time? next_snapshot_time : now,
+			conf.duration_percentile_arg);
 	if (current_snapshot_creation_time != 0)
 		fprintf(log, "current_snapshot_creation_time: %"
 			PRId64 " (%" PRId64 " seconds ago)\n",
 			current_snapshot_creation_time,
-			now - current_snapshot_creation_time
+			now - current_snapshot_creation_time / 1000
 		);
 	if (next_removal_check.tv_sec != 0) {
 		fprintf(log, "next removal check: %llu (%llu seconds ago)\n",
@@ -174,6 +286,8 @@ static void dump_dss_config(const char *msg)
 	COMMAND(run) \
 	COMMAND(kill) \
 	COMMAND(reload) \
+	COMMAND(materialize) \
+	COMMAND(tune_transport) \
 
 #define COMMAND(x) static int com_ ##x(void);
 COMMANDS
@@ -291,35 +405,150 @@ static int com_reload(void)
 
 static void dss_get_snapshot_list(struct snapshot_list *sl)
 {
-	get_snapshot_list(sl, conf.unit_interval_arg, conf.num_intervals_arg);
+	get_snapshot_list(sl, unit_interval, conf.num_intervals_arg);
+}
+
+/*
+ * Without a history file, e.g. after an upgrade, the model is seeded with the
+ * complete snapshots on disk.
+ */
+static void load_duration_model(struct snapshot_list *sl)
+{
+	struct snapshot *s;
+	int i, ret;
+
+	if (duration_model_loaded)
+		return;
+	duration_model_loaded = 1;
+	ret = load_duration_history(&duration_model);
+	if (ret > 0)
+		return;
+	if (ret < 0)
+		DSS_WARNING_LOG(("can not read duration history: %s\n",
+			dss_strerror(-ret)));
+	FOR_EACH_SNAPSHOT(s, i, sl) {
+		if (s->flags != SS_COMPLETE)
+			continue;
+		add_duration_sample(&duration_model, s->creation_time,
+			s->completion_time - s->creation_time);
+	}
+	if (duration_model.num_samples > 0 && !conf.dry_run_given)
+		save_duration_history(&duration_model);
+}
+
+static void record_snapshot_duration(int64_t start, int64_t duration)
+{
+	if (!duration_model_loaded)
+		return;
+	add_duration_sample(&duration_model, start, duration);
+	save_duration_history(&duration_model);
+}
+
+/*
+ * With --aligned-schedule, time is divided into slots of u / 2^(n - 1)
+ * seconds, counted from the epoch. The level of slot j is the number of
+ * trailing zero bits of j. A snapshot of a slot of level k is meant to survive
+ * until it is older than k + 1 unit intervals, which keeps exactly the number
+ * of snapshots per interval that desired_number_of_snapshots() asks for.
+ */
+static int64_t slot_length(void)
+{
+	return unit_interval / desired_number_of_snapshots(0,
+		conf.num_intervals_arg);
+}
+
+static int64_t slot_of(int64_t t)
+{
+	return t / slot_length();
+}
+
+static int slot_level(int64_t slot)
+{
+	int level = 0;
+
+	if (slot == 0)
+		return conf.num_intervals_arg;
+	while (!(slot & 1) && level < conf.num_intervals_arg) {
+		slot >>= 1;
+		level++;
+	}
+	return level;
+}
+
+/*
+ * Start the snapshot of the first slot without a complete snapshot. Within the
+ * slot, pick the full hour for which the shortest duration is predicted, as
+ * long as the snapshot still completes before the slot ends.
+ */
+static int64_t compute_aligned_snapshot_time(struct snapshot *newest,
+		int64_t now)
+{
+	int64_t slot = slot_of(now), len = slot_length(), start, end, t, x,
+		best, best_x;
+
+	if (newest && slot_of(newest->creation_time) >= slot)
+		slot = slot_of(newest->creation_time) + 1;
+	start = slot * len;
+	end = start + len;
+	if (start < now)
+		start = now;
+	best = start;
+	best_x = predict_duration(&duration_model, start,
+		conf.duration_percentile_arg);
+	for (t = (start / 3600 + 1) * 3600; t < end; t += 3600) {
+		x = predict_duration(&duration_model, t,
+			conf.duration_percentile_arg);
+		if (t + x > end)
+			break;
+		if (x < best_x) {
+			best = t;
+			best_x = x;
+		}
+	}
+	DSS_DEBUG_LOG(("slot %" PRId64 " (level %d), predicted duration: %"
+		PRId64 " seconds\n", slot, slot_level(slot), best_x));
+	return best;
 }
 
 static int64_t compute_next_snapshot_time(void)
 {
-	int64_t x = 0, now = get_current_time(), unit_interval
-		= 24 * 3600 * conf.unit_interval_arg, ret;
-	unsigned wanted = desired_number_of_snapshots(0, conf.num_intervals_arg),
-		num_complete_snapshots = 0;
+	int64_t x, now = get_current_time(), due, ret;
+	unsigned wanted = desired_number_of_snapshots(0, conf.num_intervals_arg);
 	int i;
-	struct snapshot *s = NULL;
+	struct snapshot *s, *newest = NULL;
 	struct snapshot_list sl;
 
 	dss_get_snapshot_list(&sl);
-	FOR_EACH_SNAPSHOT(s, i, &sl) {
-		if (!(s->flags & SS_COMPLETE))
-			continue;
-		num_complete_snapshots++;
-		x += s->completion_time - s->creation_time;
+	load_duration_model(&sl);
+	FOR_EACH_SNAPSHOT_REVERSE(s, i, &sl) {
+		if (s->flags == SS_COMPLETE) {
+			newest = s;
+			break;
+		}
 	}
-	assert(x >= 0);
 
+	if (conf.aligned_schedule_given) {
+		ret = compute_aligned_snapshot_time(newest, now);
+		goto out;
+	}
 	ret = now;
-	if (num_complete_snapshots == 0)
+	if (!newest || duration_model.num_samples == 0)
 		goto out;
-	x /= num_complete_snapshots; /* avg time to create one snapshot */
+	/* when the next snapshot should be complete */
+	due = newest->completion_time + unit_interval / wanted;
+	/*
+	 * The predicted duration depends on the hour in which the snapshot is
+	 * started, which in turn depends on the predicted duration. One more
+	 * round is good enough.
+	 */
+	x = predict_duration(&duration_model, due, conf.duration_percentile_arg);
+	x = predict_duration(&duration_model, due - x,
+		conf.duration_percentile_arg);
+	DSS_DEBUG_LOG(("predicted snapshot duration: %" PRId64 " seconds\n",
+		x));
 	if (unit_interval < x * wanted) /* oops, no sleep at all */
 		goto out;
-	ret = s->completion_time + unit_interval / wanted - x;
+	ret = due - x;
 out:
 	free_snapshot_list(&sl);
 	return ret;
@@ -335,6 +564,79 @@ static inline int next_snapshot_time_is_valid(void)
 	return next_snapshot_time != 0;
 }
 
+/* Conditions which can not be predicted are checked once a minute. */
+#define CONDITION_POLL_INTERVAL 60
+
+/* Frees the reason. */
+static int wait_for_condition(int64_t until, char *why)
+{
+	DSS_INFO_LOG(("not creating snapshot: %s, checking again in %"
+		PRId64 "s\n", why, until - get_current_time()));
+	free(why);
+	next_condition_check = until;
+	return 0;
+}
+
+/*
+ * The built-in alternative to a pre-create hook which checks the environment.
+ * Unlike the hook, this needs no fork, and it knows when a time window opens.
+ */
+static int create_conditions_met(void)
+{
+	int64_t now = get_current_time(), next;
+	int ret;
+	unsigned u;
+	double load;
+	struct disk_space ds;
+
+	if (now < next_condition_check)
+		return 0;
+	if (create_windows) {
+		ret = in_time_window(create_windows, now, &next);
+		if (ret < 0)
+			return wait_for_condition(now + CONDITION_POLL_INTERVAL,
+				make_message("time window: %s",
+				dss_strerror(-ret)));
+		if (ret == 0)
+			return wait_for_condition(next,
+				dss_strdup("outside time window"));
+	}
+	next = now + CONDITION_POLL_INTERVAL;
+	/* a stale NFS mount must not let rsync write to the mountpoint */
+	for (u = 0; u < conf.require_mount_given; u++) {
+		ret = is_mountpoint(conf.require_mount_arg[u]);
+		if (ret < 0)
+			return wait_for_condition(next, make_message("%s: %s",
+				conf.require_mount_arg[u], dss_strerror(-ret)));
+		if (ret == 0)
+			return wait_for_condition(next, make_message(
+				"%s is not mounted", conf.require_mount_arg[u]));
+	}
+	if (conf.max_load_given && getloadavg(&load, 1) == 1
+			&& load > conf.max_load_arg)
+		return wait_for_condition(next, make_message("load %.2f",
+			load));
+	if (conf.max_io_pressure_given) {
+		ret = get_io_pressure(&load);
+		if (ret < 0)
+			DSS_WARNING_LOG(("io pressure: %s\n",
+				dss_strerror(-ret)));
+		else if (load > conf.max_io_pressure_arg)
+			return wait_for_condition(next, make_message(
+				"io pressure %.1f%%", load));
+	}
+	if (conf.min_source_free_mb_given) {
+		ret = get_disk_space(conf.source_dir_arg, &ds);
+		if (ret < 0)
+			return wait_for_condition(next, make_message("%s: %s",
+				conf.source_dir_arg, dss_strerror(-ret)));
+		if (ds.free_mb < conf.min_source_free_mb_arg)
+			return wait_for_condition(next, make_message(
+				"%u MB free on source", ds.free_mb));
+	}
+	return 1;
+}
+
 static int next_snapshot_is_due(void)
 {
 	int64_t now = get_current_time();
@@ -350,13 +652,25 @@ static int next_snapshot_is_due(void)
 	return 0;
 }
 
+static int handle_pre_create_hook_exit(int status);
+static int handle_remove_exit(int status);
+
 static void pre_create_hook(void)
 {
 	assert(snapshot_creation_status == HS_READY);
 	/* make sure that the next snapshot time will be recomputed */
 	invalidate_next_snapshot_time();
+	if (coproc_enabled()) {
+		snapshot_creation_status = HS_PRE_RUNNING;
+		if (coproc_request(CE_PRE_CREATE, NULL, NULL,
+				conf.pre_create_hook_timeout_arg,
+				handle_pre_create_hook_exit) <= 0)
+			handle_pre_create_hook_exit(W_EXITCODE(1, 0));
+		return;
+	}
 	DSS_DEBUG_LOG(("executing %s\n", conf.pre_create_hook_arg));
-	dss_exec_cmdline_pid(&create_pid, conf.pre_create_hook_arg);
+	run_hook(&create_pid, "pre-create hook", conf.pre_create_hook_arg,
+		conf.pre_create_hook_timeout_arg, 0);
 	snapshot_creation_status = HS_PRE_RUNNING;
 }
 
@@ -375,30 +689,132 @@ static void pre_remove_hook(struct snapshot *s, const char *why)
 	*snapshot_currently_being_removed = *s;
 	snapshot_currently_being_removed->name = dss_strdup(s->name);
 
+	if (coproc_enabled()) {
+		cmd = make_message("%s/%s", conf.dest_dir_arg, s->name);
+		snapshot_removal_status = HS_PRE_RUNNING;
+		if (coproc_request(CE_PRE_REMOVE, cmd, why,
+				conf.pre_remove_hook_timeout_arg,
+				handle_remove_exit) <= 0)
+			handle_remove_exit(W_EXITCODE(1, 0));
+		free(cmd);
+		return;
+	}
 	cmd = make_message("%s %s/%s", conf.pre_remove_hook_arg,
 		conf.dest_dir_arg, s->name);
 	DSS_DEBUG_LOG(("executing %s\n", cmd));
-	dss_exec_cmdline_pid(&remove_pid, cmd);
+	run_hook(&remove_pid, "pre-remove hook", cmd,
+		conf.pre_remove_hook_timeout_arg, 0);
 	free(cmd);
 	snapshot_removal_status = HS_PRE_RUNNING;
 }
 
+/*
+ * Collect the names of the thin snapshots of a base snapshot, oldest first.
+ * Returns the number of thin snapshots found.
+ */
+static unsigned get_thin_snapshots(struct snapshot_list *sl, const char *base,
+		char ***result)
+{
+	struct snapshot *s;
+	int i;
+	unsigned n = 0;
+
+	*result = NULL;
+	FOR_EACH_SNAPSHOT(s, i, sl) {
+		struct thin_info ti;
+
+		if (s->flags != SS_COMPLETE)
+			continue;
+		if (read_thin_info(s->name, &ti) <= 0)
+			continue;
+		if (!strcmp(ti.base, base)) {
+			*result = dss_realloc(*result, (n + 1) * sizeof(char *));
+			(*result)[n++] = dss_strdup(s->name);
+		}
+		free_thin_info(&ti);
+	}
+	return n;
+}
+
+static void free_names(char **names, unsigned num)
+{
+	unsigned u;
+
+	for (u = 0; u < num; u++)
+		free(names[u]);
+	free(names);
+}
+
+/** Arguments for the process which folds a base snapshot. */
+struct fold_data {
+	/** The base snapshot to be removed. */
+	char *base;
+	/** Its thin snapshots. */
+	char **thin_snapshots;
+	/** The number of thin snapshots. */
+	unsigned num_thin_snapshots;
+};
+
+static int fold_child(void *private_data)
+{
+	struct fold_data *fd = private_data;
+
+	return fold_base_snapshot(fd->base, fd->thin_snapshots,
+		fd->num_thin_snapshots);
+}
+
+/*
+ * A base snapshot can not simply be removed if thin snapshots depend on it.
+ * Instead it is folded into its oldest thin snapshot in a child process.
+ * Returns positive if the process was started, zero if s has no thin
+ * snapshots.
+ */
+static int fold_snapshot(struct snapshot *s)
+{
+	struct snapshot_list sl;
+	struct fold_data fd = {.base = s->name};
+
+	dss_get_snapshot_list(&sl);
+	fd.num_thin_snapshots = get_thin_snapshots(&sl, s->name,
+		&fd.thin_snapshots);
+	free_snapshot_list(&sl);
+	if (fd.num_thin_snapshots == 0)
+		return 0;
+	DSS_NOTICE_LOG(("folding %s into %s (interval = %i)\n", s->name,
+		fd.thin_snapshots[0], s->interval));
+	remove_snapshot_stats(s->name);
+	dss_fork(&remove_pid, fold_child, &fd);
+	free_names(fd.thin_snapshots, fd.num_thin_snapshots);
+	fold_running = 1;
+	snapshot_removal_status = HS_RUNNING;
+	return 1;
+}
+
 static int exec_rm(void)
 {
 	struct snapshot *s = snapshot_currently_being_removed;
-	char *new_name = being_deleted_name(s);
+	char *new_name;
 	char *argv[4];
 	int ret;
 
+	assert(snapshot_removal_status == HS_PRE_SUCCESS);
+	assert(remove_pid == 0);
+
+	if (s->flags & SS_COMPLETE) {
+		ret = fold_snapshot(s);
+		if (ret != 0)
+			return ret;
+	}
+	new_name = being_deleted_name(s);
+
 	argv[0] = "rm";
 	argv[1] = "-rf";
 	argv[2] = new_name;
 	argv[3] = NULL;
 
-	assert(snapshot_removal_status == HS_PRE_SUCCESS);
-	assert(remove_pid == 0);
-
 	DSS_NOTICE_LOG(("removing %s (interval = %i)\n", s->name, s->interval));
+	remove_snapshot_stats(s->name);
+	remove_thin_info(s->name);
 	ret = dss_rename(s->name, new_name);
 	if (ret < 0)
 		goto out;
@@ -411,7 +827,7 @@ out:
 
 static int snapshot_is_being_created(struct snapshot *s)
 {
-	return s->creation_time == current_snapshot_creation_time;
+	return s->creation_ms == current_snapshot_creation_time;
 }
 
 static struct snapshot *find_orphaned_snapshot(struct snapshot_list *sl)
@@ -455,6 +871,41 @@ static int is_reference_snapshot(struct snapshot *s)
 	return strcmp(s->name, name_of_reference_snapshot)? 0 : 1;
 }
 
+/*
+ * The snapshot of the given interval with the lowest slot level, see
+ * slot_level(). Of two snapshots in the same slot, the newer one is removed
+ * first.
+ */
+static struct snapshot *find_short_lived_snapshot(struct snapshot_list *sl,
+		unsigned interval)
+{
+	int i, level, victim_level = INT_MAX;
+	struct snapshot *s, *prev = NULL, *victim = NULL;
+
+	FOR_EACH_SNAPSHOT(s, i, sl) {
+		int64_t slot = slot_of(s->creation_time);
+
+		if (prev && slot_of(prev->creation_time) == slot)
+			level = -1;
+		else
+			level = slot_level(slot);
+		prev = s;
+		if (s->interval > interval)
+			continue;
+		if (s->interval < interval)
+			break;
+		if (snapshot_is_being_created(s))
+			continue;
+		if (is_reference_snapshot(s))
+			continue;
+		if (level < victim_level) {
+			victim = s;
+			victim_level = level;
+		}
+	}
+	return victim;
+}
+
 /*
  * return: 0: no redundant snapshots, 1: rm process started, negative: error
  */
@@ -475,6 +926,12 @@ static struct snapshot *find_redundant_snapshot(struct snapshot_list *sl)
 			missing += keep - num;
 		if (keep + missing >= num)
 			continue;
+		if (conf.aligned_schedule_given) {
+			victim = find_short_lived_snapshot(sl, interval);
+			if (victim)
+				return victim;
+			continue;
+		}
 		/* redundant snapshot in this interval, pick snapshot with lowest score */
 		FOR_EACH_SNAPSHOT(s, i, sl) {
 			int64_t this_score;
@@ -496,7 +953,7 @@ static struct snapshot *find_redundant_snapshot(struct snapshot_list *sl)
 			}
 			assert(prev);
 			/* check if s is a better victim */
-			this_score = s->creation_time - prev->creation_time;
+			this_score = s->creation_ms - prev->creation_ms;
 			assert(this_score >= 0);
 			if (this_score < score) {
 				score = this_score;
@@ -544,29 +1001,77 @@ static struct snapshot *find_oldest_removable_snapshot(struct snapshot_list *sl)
 	return NULL;
 }
 
-static int rename_incomplete_snapshot(int64_t start)
+/*
+ * Flush the file system of the destination directory or, after the rename,
+ * the directory itself. The time spent is accounted to the snapshot.
+ */
+static int sync_dest_dir(int after_rename)
+{
+	struct timeval start, end, diff;
+	int ret;
+
+	if (conf.no_sync_given)
+		return 1;
+	gettimeofday(&start, NULL);
+	ret = after_rename? dss_fsync_dir(".") : dss_syncfs(".");
+	gettimeofday(&end, NULL);
+	tv_diff(&end, &start, &diff);
+	snapshot_stats.sync_ms += tv2ms(&diff);
+	if (ret < 0)
+		DSS_ERROR_LOG(("failed to sync %s: %s\n", conf.dest_dir_arg,
+			dss_strerror(-ret)));
+	return ret;
+}
+
+static int rename_incomplete_snapshot(int64_t start_ms)
 {
 	char *old_name;
 	int ret;
-	int64_t now;
-
 	/*
-	 * We don't want the dss_rename() below to fail with EEXIST because the
-	 * last complete snapshot was created (and completed) in the same
-	 * second as this one.
+	 * Names contain the creation time in milliseconds, so the new name
+	 * can not collide with the name of the previous snapshot.
 	 */
-	while ((now = get_current_time()) == start)
-		sleep(1);
+	int64_t start = start_ms / 1000, now_ms = get_current_time_ms(),
+		duration = (now_ms - start_ms) / 1000;
+
 	free(path_to_last_complete_snapshot);
-	ret = complete_name(start, now, &path_to_last_complete_snapshot);
+	ret = complete_name(start_ms, now_ms, &path_to_last_complete_snapshot);
 	if (ret < 0)
 		return ret;
-	old_name = incomplete_name(start);
+	/*
+	 * Without its sidecar file, a thin snapshot would be mistaken for a
+	 * full one. So the sidecar must exist before the snapshot does.
+	 */
+	if (creating_thin) {
+		free(thin_info.base);
+		thin_info.base = dss_strdup(name_of_reference_snapshot);
+		ret = write_thin_info(path_to_last_complete_snapshot, &thin_info);
+		if (ret < 0)
+			return ret;
+	}
+	/* Later snapshots are hardlinked against this one. */
+	snapshot_stats.sync_ms = 0;
+	ret = sync_dest_dir(0);
+	if (ret < 0)
+		goto out_thin;
+	old_name = incomplete_name(start_ms);
 	ret = dss_rename(old_name, path_to_last_complete_snapshot);
-	if (ret >= 0)
+	if (ret >= 0) {
 		DSS_NOTICE_LOG(("%s -> %s\n", old_name,
 			path_to_last_complete_snapshot));
+		DSS_INFO_LOG(("sync took %" PRId64 " ms\n",
+			snapshot_stats.sync_ms));
+		snapshot_stats.duration = duration;
+		/* the directory sync makes both renames durable */
+		write_snapshot_stats(path_to_last_complete_snapshot,
+			&snapshot_stats);
+		sync_dest_dir(1);
+		record_snapshot_duration(start, duration);
+	}
 	free(old_name);
+out_thin:
+	if (ret < 0 && creating_thin)
+		remove_thin_info(path_to_last_complete_snapshot);
 	return ret;
 }
 
@@ -587,12 +1092,11 @@ static int try_to_free_disk_space(void)
 	if (tv_diff(&next_removal_check, &now, NULL) > 0)
 		return 0;
 	if (!low_disk_space) {
-		if (conf.keep_redundant_given)
-			return 0;
-		if (snapshot_creation_status != HS_READY)
-			return 0;
-		if (next_snapshot_is_due())
+		if (conf.keep_redundant_given || snapshot_creation_status
+				!= HS_READY || next_snapshot_is_due()) {
+			sched_cancel(SLOT_REMOVE);
 			return 0;
+		}
 	}
 	dss_get_snapshot_list(&sl);
 	ret = 0;
@@ -621,35 +1125,70 @@ static int try_to_free_disk_space(void)
 	ret = -ERRNO_TO_DSS_ERROR(ENOSPC);
 	goto out;
 remove:
-	pre_remove_hook(victim, why);
+	/* with --job, wait for the scheduler, the most urgent job first */
+	if (sched_acquire(SLOT_REMOVE, low_disk_space? 0 : sl.now))
+		pre_remove_hook(victim, why);
+	free_snapshot_list(&sl);
+	return ret;
 out:
+	sched_cancel(SLOT_REMOVE);
 	free_snapshot_list(&sl);
 	return ret;
 }
 
-static void post_create_hook(void)
+/*
+ * The exit code of the post hooks is ignored, so they run in the background
+ * and the next snapshot can be created right away. Returns the pid of the
+ * hook, for the commands which wait for it.
+ */
+static pid_t post_create_hook(void)
 {
-	char *cmd = make_message("%s %s/%s", conf.post_create_hook_arg,
+	pid_t pid;
+	char *cmd;
+
+	if (coproc_enabled()) {
+		cmd = make_message("%s/%s", conf.dest_dir_arg,
+			path_to_last_complete_snapshot);
+		coproc_notify(CE_POST_CREATE, cmd, NULL);
+		free(cmd);
+		snapshot_creation_status = HS_READY;
+		return 0;
+	}
+	cmd = make_message("%s %s/%s", conf.post_create_hook_arg,
 		conf.dest_dir_arg, path_to_last_complete_snapshot);
 	DSS_NOTICE_LOG(("executing %s\n", cmd));
-	dss_exec_cmdline_pid(&create_pid, cmd);
+	run_hook(&pid, "post-create hook", cmd,
+		conf.post_create_hook_timeout_arg, 1);
 	free(cmd);
-	snapshot_creation_status = HS_POST_RUNNING;
+	snapshot_creation_status = HS_READY;
+	return pid;
 }
 
-static void post_remove_hook(void)
+static pid_t post_remove_hook(void)
 {
 	char *cmd;
+	pid_t pid;
 	struct snapshot *s = snapshot_currently_being_removed;
 
 	assert(s);
 
-	cmd = make_message("%s %s/%s", conf.post_remove_hook_arg,
-		conf.dest_dir_arg, s->name);
-	DSS_NOTICE_LOG(("executing %s\n", cmd));
-	dss_exec_cmdline_pid(&remove_pid, cmd);
+	if (coproc_enabled()) {
+		cmd = make_message("%s/%s", conf.dest_dir_arg, s->name);
+		coproc_notify(CE_POST_REMOVE, cmd, NULL);
+		pid = 0;
+	} else {
+		cmd = make_message("%s %s/%s", conf.post_remove_hook_arg,
+			conf.dest_dir_arg, s->name);
+		DSS_NOTICE_LOG(("executing %s\n", cmd));
+		run_hook(&pid, "post-remove hook", cmd,
+			conf.post_remove_hook_timeout_arg, 1);
+	}
 	free(cmd);
-	snapshot_removal_status = HS_POST_RUNNING;
+	free(s->name);
+	free(s);
+	snapshot_currently_being_removed = NULL;
+	snapshot_removal_status = HS_READY;
+	return pid;
 }
 
 static void dss_kill(pid_t pid, int sig, const char *msg)
@@ -669,12 +1208,22 @@ static void dss_kill(pid_t pid, int sig, const char *msg)
 		process_name = "create";
 	else if (pid == remove_pid)
 		process_name = "remove";
+	else if (pid == ssh_master.pid)
+		process_name = "ssh master";
+	else if (pid == prefetch_pid)
+		process_name = "prefetch";
 	else process_name = "??????";
 
 	if (msg)
 		DSS_INFO_LOG(("%s\n", msg));
 	DSS_DEBUG_LOG(("sending signal %d (%s) to pid %d (%s process)\n",
 		sig, signame, (int)pid, process_name));
+	/* the rsync processes of a composite snapshot form a process group */
+	if (pid == create_pid && (sources_running || tar_running
+			|| mirror_running) && kill(-pid, sig) >= 0)
+		return;
+	if (pid == prefetch_pid && kill(-pid, sig) >= 0)
+		return;
 	if (kill(pid, sig) >= 0)
 		return;
 	DSS_INFO_LOG(("failed to send signal %d (%s) to pid %d (%s process)\n",
@@ -683,6 +1232,8 @@ static void dss_kill(pid_t pid, int sig, const char *msg)
 
 static void stop_create_process(void)
 {
+	/* don't block other instances while the removal goes first */
+	io_token_cancel(IO_RSYNC);
 	if (create_process_stopped)
 		return;
 	dss_kill(create_pid, SIGSTOP, "suspending create process");
@@ -712,38 +1263,175 @@ static void log_termination_msg(pid_t pid, int status)
 		DSS_WARNING_LOG(("child %i terminated abormally\n", (int)pid));
 }
 
-static int wait_for_process(pid_t pid, int *status)
+static void free_failed_files(void)
+{
+	unsigned u;
+
+	for (u = 0; u < num_failed_files; u++)
+		free(failed_files[u]);
+	free(failed_files);
+	failed_files = NULL;
+	num_failed_files = 0;
+}
+
+/*
+ * rsync error messages about individual files contain the full path of the
+ * file in double quotes. Files which vanished during the transfer are not
+ * recorded as there is no point in retrying them.
+ */
+static void record_failed_file(const char *line)
+{
+	const char *start = strchr(line, '"'), *end = strrchr(line, '"');
+
+	if (!start || end <= start + 1)
+		return;
+	if (num_failed_files > MAX_FAILED_FILES)
+		return;
+	failed_files = dss_realloc(failed_files,
+		(num_failed_files + 1) * sizeof(char *));
+	failed_files[num_failed_files] = dss_malloc(end - start);
+	memcpy(failed_files[num_failed_files], start + 1, end - start - 1);
+	failed_files[num_failed_files][end - start - 1] = '\0';
+	num_failed_files++;
+}
+
+static void handle_rsync_output_line(char *line, __a_unused void *private_data)
+{
+	struct snapshot_stats *ss = failed_files_passes && !dedup_running?
+		&retry_stats : &snapshot_stats;
+
+	if (mirror_running) {
+		DSS_INFO_LOG(("mirror: %s\n", line));
+		return;
+	}
+	if (deletion_pass_running) {
+		if (!strncmp(line, "deleting ", 9))
+			thin_info_add_deleted(&thin_info, line + 9);
+		else
+			DSS_INFO_LOG(("deletion pass: %s\n", line));
+		return;
+	}
+	/* rsync -ii itemizes every path of the source */
+	if (creating_thin && !dedup_running
+			&& thin_info_add_itemized(&thin_info, line))
+		return;
+	if (parse_rsync_stats_line(line, ss, sources_running)) {
+		DSS_DEBUG_LOG(("rsync: %s\n", line));
+		return;
+	}
+	if (!strncmp(line, "rsync", 5)) { /* error or warning message */
+		DSS_WARNING_LOG(("%s\n", line));
+		record_failed_file(line);
+		return;
+	}
+	if (conf.rsync_progress_given && strchr(line, '%')) {
+		free(rsync_progress);
+		rsync_progress = dss_strdup(line + strspn(line, " "));
+		DSS_DEBUG_LOG(("rsync progress: %s\n", rsync_progress));
+		return;
+	}
+	DSS_INFO_LOG(("rsync: %s\n", line));
+}
+
+static void close_rsync_output(void)
+{
+	if (rsync_fd < 0)
+		return;
+	event_unwatch(rsync_fd);
+	close(rsync_fd);
+	rsync_fd = -1;
+	rsync_line_buffer.len = 0;
+}
+
+/*
+ * Read what rsync has written to its stdout and stderr so far. The pipe is
+ * closed on end of file and on errors. Errors are not fatal because the
+ * output of rsync is only informational.
+ */
+static void read_rsync_output(void)
 {
 	int ret;
 
+	if (rsync_fd < 0)
+		return;
+	ret = read_lines(rsync_fd, &rsync_line_buffer,
+		handle_rsync_output_line, NULL);
+	if (ret > 0)
+		return;
+	if (ret < 0)
+		DSS_WARNING_LOG(("failed to read rsync output: %s\n",
+			dss_strerror(-ret)));
+	close_rsync_output();
+}
+
+/* rsync has exited, so everything it wrote is in the pipe already. */
+static void flush_rsync_output(void)
+{
+	read_rsync_output();
+	close_rsync_output();
+}
+
+static int wait_for_process(pid_t pid, int *status)
+{
+	int ret, pidfd = child_pidfd(pid);
+
 	DSS_DEBUG_LOG(("Waiting for process %d to terminate\n", (int)pid));
 	for (;;) {
 		fd_set rfds;
+		int max_fileno = signal_fd;
+		struct timeval tv, *tvp = NULL;
+		int64_t deadline = kill_expired_hooks();
+
+		if (deadline) {
+			tv.tv_sec = deadline - get_current_time();
+			tv.tv_usec = 0;
+			tvp = &tv;
+		}
 
 		FD_ZERO(&rfds);
-		FD_SET(signal_pipe, &rfds);
-		ret = dss_select(signal_pipe + 1, &rfds, NULL, NULL);
+		FD_SET(signal_fd, &rfds);
+		if (rsync_fd >= 0) {
+			FD_SET(rsync_fd, &rfds);
+			if (rsync_fd > max_fileno)
+				max_fileno = rsync_fd;
+		}
+		if (pidfd >= 0) {
+			FD_SET(pidfd, &rfds);
+			if (pidfd > max_fileno)
+				max_fileno = pidfd;
+		}
+		ret = dss_select(max_fileno + 1, &rfds, NULL, tvp);
 		if (ret < 0)
 			break;
+		if (rsync_fd >= 0 && FD_ISSET(rsync_fd, &rfds))
+			read_rsync_output();
+		if (pidfd >= 0 && FD_ISSET(pidfd, &rfds)) {
+			ret = dss_waitpid(pid, status, WNOHANG);
+			if (ret != 0)
+				break;
+		}
+		if (!FD_ISSET(signal_fd, &rfds))
+			continue;
 		ret = next_signal();
 		if (!ret)
 			continue;
 		if (ret == SIGCHLD) {
-			ret = waitpid(pid, status, 0);
-			if (ret >= 0)
-				break;
-			if (errno != EINTR) { /* error */
-				ret = -ERRNO_TO_DSS_ERROR(errno);
-				break;
-			}
+			/* other children, e.g. the prefetch process, may exit */
+			ret = dss_waitpid(pid, status, WNOHANG);
+			if (ret == 0)
+				continue;
+			break;
 		}
 		/* SIGINT or SIGTERM */
 		dss_kill(pid, SIGTERM, "killing child process");
 	}
-	if (ret < 0)
+	if (ret < 0) {
 		DSS_ERROR_LOG(("failed to wait for process %d\n", (int)pid));
-	else
-		log_termination_msg(pid, *status);
+		return ret;
+	}
+	log_termination_msg(pid, *status);
+	if (hook_exited(pid, *status) == HE_TIMED_OUT)
+		*status = W_EXITCODE(1, 0);
 	return ret;
 }
 
@@ -760,6 +1448,7 @@ static void handle_pre_remove_exit(int status)
 
 static int handle_rm_exit(int status)
 {
+	fold_running = 0;
 	if (!WIFEXITED(status)) {
 		snapshot_removal_status = HS_READY;
 		return -E_INVOLUNTARY_EXIT;
@@ -772,11 +1461,6 @@ static int handle_rm_exit(int status)
 	return 1;
 }
 
-static void handle_post_remove_exit(void)
-{
-	snapshot_removal_status = HS_READY;
-}
-
 static int handle_remove_exit(int status)
 {
 	int ret;
@@ -791,10 +1475,6 @@ static int handle_remove_exit(int status)
 	case HS_RUNNING:
 		ret = handle_rm_exit(status);
 		break;
-	case HS_POST_RUNNING:
-		handle_post_remove_exit();
-		ret = 1;
-		break;
 	default:
 		ret = -E_BUG;
 	}
@@ -814,8 +1494,7 @@ static int wait_for_remove_process(void)
 	assert(remove_pid);
 	assert(
 		snapshot_removal_status == HS_PRE_RUNNING ||
-		snapshot_removal_status == HS_RUNNING ||
-		snapshot_removal_status == HS_POST_RUNNING
+		snapshot_removal_status == HS_RUNNING
 	);
 	ret = wait_for_process(remove_pid, &status);
 	if (ret < 0)
@@ -823,42 +1502,859 @@ static int wait_for_remove_process(void)
 	return handle_remove_exit(status);
 }
 
-static int handle_rsync_exit(int status)
+/*
+ * We can not use rsync locally if the local user is different from the remote
+ * user or if the src dir is not on the local host (or both). Sources which are
+ * served by an rsync daemon are always accessed through the daemon.
+ */
+static int use_rsync_locally(char *logname)
+{
+	char *h = conf.remote_host_arg;
+
+	if (conf.rsync_module_given)
+		return 0;
+	if (strcmp(h, "localhost") && strcmp(h, "127.0.0.1"))
+		return 0;
+	if (conf.remote_user_given && strcmp(conf.remote_user_arg, logname))
+		return 0;
+	return 1;
+}
+
+/*
+ * The source argument for rsync: Either the given directory, or
+ * user@host:dir/ if rsync has to use ssh, or rsync://[user@]host:port/module/dir/
+ * for the rsync daemon transport. In the latter case dir is relative to the
+ * module.
+ */
+static char *rsync_source_arg(const char *dir)
+{
+	char *logname = dss_logname(), *arg;
+
+	if (conf.rsync_module_given) {
+		/* the path within the module, without leading or trailing slashes */
+		const char *path = dir + strspn(dir, "/");
+		int len = strlen(path);
+
+		while (len > 0 && path[len - 1] == '/')
+			len--;
+		arg = make_message("rsync://%s%s%s:%d/%s/%.*s%s",
+			conf.remote_user_given? conf.remote_user_arg : "",
+			conf.remote_user_given? "@" : "",
+			conf.remote_host_arg, conf.rsync_port_arg,
+			conf.rsync_module_arg, len, path, len > 0? "/" : "");
+	} else if (use_rsync_locally(logname))
+		arg = dss_strdup(dir);
+	else
+		arg = make_message("%s@%s:%s/", conf.remote_user_given?
+			conf.remote_user_arg : logname, conf.remote_host_arg, dir);
+	free(logname);
+	return arg;
+}
+
+/*
+ * Only the run command keeps an ssh master process. It is not used if rsync
+ * runs locally.
+ */
+static int use_ssh_master(void)
+{
+	char *logname;
+	int ret;
+
+	if (!conf.run_given || conf.no_ssh_master_given)
+		return 0;
+	if (conf.rsync_module_given || num_sources > 0 || conf.tar_source_given)
+		return 0;
+	logname = dss_logname();
+	ret = !use_rsync_locally(logname);
+	free(logname);
+	return ret;
+}
+
+/*
+ * A thin snapshot lacks most files, so it can not serve as a reference. This
+ * frees the name of a thin snapshot and returns the name of its base instead.
+ */
+static char *base_of(char *name)
+{
+	struct thin_info ti;
+	char *base;
+
+	if (!name || read_thin_info(name, &ti) <= 0)
+		return name;
+	free(name);
+	base = ti.base;
+	ti.base = NULL;
+	free_thin_info(&ti);
+	return base;
+}
+
+/* The directories walked by the prefetch process. */
+struct prefetch_data {
+	char **dirs;
+	unsigned num_dirs;
+};
+
+static int prefetch_child(void *private_data)
+{
+	struct prefetch_data *pd = private_data;
+
+	setpgid(0, 0);
+	prefetch_trees(pd->dirs, pd->num_dirs, conf.prefetch_arg);
+	return 1;
+}
+
+/*
+ * Start walking the snapshot which rsync is going to compare against, and, if
+ * requested, the local source directories, so that rsync finds their inodes
+ * in the cache. Like create_rsync_argv(), this uses the newest complete
+ * snapshot, or its base if it is thin.
+ */
+static void start_prefetch(void)
+{
+	struct snapshot_list sl;
+	struct prefetch_data pd;
+	char *newest;
+	unsigned u;
+
+	if (conf.prefetch_arg <= 0 || prefetch_pid)
+		return;
+	pd.dirs = dss_malloc((num_sources + 2) * sizeof(char *));
+	pd.num_dirs = 0;
+	dss_get_snapshot_list(&sl);
+	newest = base_of(name_of_newest_complete_snapshot(&sl));
+	free_snapshot_list(&sl);
+	if (newest)
+		pd.dirs[pd.num_dirs++] = newest;
+	if (conf.prefetch_source_given && conf.source_dir_given
+			&& !conf.rsync_module_given) {
+		char *logname = dss_logname();
+
+		if (use_rsync_locally(logname))
+			pd.dirs[pd.num_dirs++] = conf.source_dir_arg;
+		free(logname);
+	}
+	for (u = 0; conf.prefetch_source_given && u < num_sources; u++)
+		if (!sources[u].host)
+			pd.dirs[pd.num_dirs++] = sources[u].dir;
+	if (pd.num_dirs > 0) {
+		DSS_INFO_LOG(("prefetching %u tree(s)\n", pd.num_dirs));
+		dss_fork(&prefetch_pid, prefetch_child, &pd);
+		/* also done by the child, whichever runs first */
+		setpgid(prefetch_pid, prefetch_pid);
+	}
+	free(newest);
+	free(pd.dirs);
+}
+
+/* The cache is of no further use to rsync once it has exited. */
+static void stop_prefetch(void)
+{
+	dss_kill(prefetch_pid, SIGTERM, NULL);
+}
+
+/* Tuned settings apply to the remote host of --source-dir only. */
+static void load_transport(void)
+{
+	char *logname = dss_logname();
+	int ret, local = !conf.rsync_module_given && use_rsync_locally(logname);
+
+	free(logname);
+	free_transport_settings(&transport);
+	if (!conf.source_dir_given || local)
+		return;
+	ret = load_transport_settings(conf.remote_host_arg, &transport);
+	if (ret < 0)
+		DSS_WARNING_LOG(("can not load transport settings: %s\n",
+			dss_strerror(-ret)));
+	else if (ret > 0)
+		DSS_DEBUG_LOG(("using tuned transport settings for %s\n",
+			conf.remote_host_arg));
+}
+
+static void check_ssh_master(void)
+{
+	char *logname;
+
+	if (!use_ssh_master())
+		return;
+	logname = dss_logname();
+	ssh_master_check(&ssh_master, conf.remote_user_given?
+		conf.remote_user_arg : logname, conf.remote_host_arg,
+		transport.cipher);
+	free(logname);
+}
+
+static void free_rsync_argv(char **argv)
+{
+	int i;
+
+	if (!argv)
+		return;
+	for (i = 0; argv[i]; i++)
+		free(argv[i]);
+	free(argv);
+}
+
+/* Unchanged files are omitted from thin snapshots, and hardlinked otherwise. */
+static char *reference_arg(void)
+{
+	return make_message("--%s=../%s", creating_thin? "compare-dest" :
+		"link-dest", name_of_reference_snapshot);
+}
+
+/*
+ * rsync reports failed files by their full path on the source host. This
+ * returns the directory, with trailing slash, which these paths must be made
+ * relative to for --files-from. It is the source directory if rsync copies its
+ * contents, and the parent of the source directory otherwise, i.e. if the
+ * source directory is local and was given without trailing slash. An rsync
+ * daemon reports paths relative to the module.
+ */
+static char *get_transfer_root(void)
+{
+	char *dir = dss_strdup(conf.source_dir_arg), *logname = dss_logname(),
+		*slash, *root;
+	size_t len = strlen(dir);
+
+	if (conf.rsync_module_given) {
+		while (len > 0 && dir[len - 1] == '/')
+			dir[--len] = '\0';
+		root = make_message("/%s%s", dir + strspn(dir, "/"),
+			dir[strspn(dir, "/")]? "/" : "");
+		free(dir);
+		free(logname);
+		return root;
+	}
+	if (!use_rsync_locally(logname) || (len > 0 && dir[len - 1] == '/')) {
+		while (len > 0 && dir[len - 1] == '/')
+			dir[--len] = '\0';
+	} else if ((slash = strrchr(dir, '/')))
+		*slash = '\0';
+	else { /* relative source dir, failed paths will not match */
+		free(dir);
+		dir = dss_strdup(".");
+	}
+	root = make_message("%s/", dir);
+	free(dir);
+	free(logname);
+	return root;
+}
+
+static char *failed_files_list_name(void)
+{
+	char *name = incomplete_name(current_snapshot_creation_time),
+		*result = make_message("%s.failed", name);
+
+	free(name);
+	return result;
+}
+
+static void remove_failed_files_list(void)
+{
+	char *name = failed_files_list_name();
+
+	unlink(name);
+	free(name);
+}
+
+static void create_retry_argv(char ***argv, const char *files_from,
+		const char *root)
+{
+	int i = 0, j;
+
+	*argv = dss_malloc((15 + conf.rsync_option_given) * sizeof(char *));
+	(*argv)[i++] = dss_strdup("rsync");
+	(*argv)[i++] = dss_strdup("-a");
+	/* -a does not imply -r if --files-from is given */
+	(*argv)[i++] = dss_strdup("-r");
+	(*argv)[i++] = dss_strdup("--stats");
+	(*argv)[i++] = make_message("--files-from=%s", files_from);
+	if (creating_thin)
+		(*argv)[i++] = dss_strdup("-ii");
+	if (use_ssh_master()) {
+		(*argv)[i++] = dss_strdup("-e");
+		(*argv)[i++] = ssh_master_rsh(&ssh_master);
+	}
+	if (conf.rsync_module_given && conf.rsync_password_file_given)
+		(*argv)[i++] = make_message("--password-file=%s",
+			conf.rsync_password_file_arg);
+	for (j = 0; j < conf.rsync_option_given; j++)
+		(*argv)[i++] = dss_strdup(conf.rsync_option_arg[j]);
+	if (name_of_reference_snapshot)
+		(*argv)[i++] = reference_arg();
+	(*argv)[i++] = rsync_source_arg(root);
+	(*argv)[i++] = incomplete_name(current_snapshot_creation_time);
+	(*argv)[i++] = NULL;
+	for (j = 0; j < i; j++)
+		DSS_DEBUG_LOG(("argv[%d] = %s\n", j, (*argv)[j]));
+}
+
+/*
+ * Start a follow-up rsync pass for the files which failed to transfer, if any.
+ *
+ * Returns positive if the follow-up rsync process was started, zero if there
+ * is nothing to retry, negative on errors.
+ */
+static int retry_failed_files(void)
+{
+	char *root, *files_from, **argv;
+	size_t root_len;
+	unsigned u, n = 0;
+	FILE *f;
+	int ret;
+
+	if (num_failed_files == 0)
+		return 0;
+	/* paths can not be attributed to the sources of a composite snapshot */
+	if (num_sources > 0 || conf.tar_source_given)
+		return 0;
+	if (failed_files_passes >= conf.retry_failed_arg)
+		return 0;
+	if (num_failed_files > MAX_FAILED_FILES) {
+		DSS_NOTICE_LOG(("too many failed files, not retrying\n"));
+		return 0;
+	}
+	files_from = failed_files_list_name();
+	f = fopen(files_from, "w");
+	if (!f) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		DSS_ERROR_LOG(("can not create %s\n", files_from));
+		free(files_from);
+		return ret;
+	}
+	root = get_transfer_root();
+	root_len = strlen(root);
+	for (u = 0; u < num_failed_files; u++) {
+		const char *path = failed_files[u];
+
+		if (strncmp(path, root, root_len) || !path[root_len])
+			continue;
+		if (strchr(path, '\n'))
+			continue;
+		fprintf(f, "%s\n", path + root_len);
+		n++;
+	}
+	ret = ferror(f)? -ERRNO_TO_DSS_ERROR(EIO) : 0;
+	if (fclose(f) == EOF && ret >= 0)
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+	if (ret < 0)
+		goto out;
+	ret = 0;
+	if (n == 0) {
+		remove_failed_files_list();
+		goto out;
+	}
+	DSS_NOTICE_LOG(("retrying %u failed file(s), pass #%d\n", n,
+		failed_files_passes + 1));
+	create_retry_argv(&argv, files_from, root);
+	free_failed_files();
+	memset(&retry_stats, 0, sizeof(retry_stats));
+	assert(rsync_fd < 0);
+	ret = dss_exec_pipe(&create_pid, &rsync_fd, argv[0], argv);
+	free_rsync_argv(argv);
+	if (ret < 0)
+		goto out;
+	failed_files_passes++;
+	snapshot_stats.num_retried += n;
+	ret = 1;
+out:
+	free(root);
+	free(files_from);
+	return ret;
+}
+
+/*
+ * The partial dir of the given source of a composite snapshot, or of the only
+ * source if source_num is negative.
+ */
+static char *partial_dir_name(int source_num)
+{
+	char *name = incomplete_name(current_snapshot_creation_time), *result;
+
+	if (source_num >= 0)
+		result = make_message("%s/%s/" PARTIAL_DIR, name,
+			sources[source_num].name);
+	else
+		result = make_message("%s/" PARTIAL_DIR, name);
+	free(name);
+	return result;
+}
+
+/** Iterate over the partial dirs of all sources. */
+#define FOR_EACH_PARTIAL_DIR(i) \
+	for ((i) = num_sources > 0? 0 : -1; (i) < (int)num_sources; (i)++)
+
+/*
+ * Exponential backoff: The delay doubles with each restart until it hits
+ * --max-restart-delay. A random jitter of up to half the delay keeps several
+ * dss instances which lost their connection at the same time from restarting
+ * in lockstep.
+ */
+static int64_t restart_delay(int num_restarts)
+{
+	int64_t delay = RESTART_DELAY, max = conf.max_restart_delay_arg;
+
+	if (max < RESTART_DELAY)
+		max = RESTART_DELAY;
+	while (num_restarts-- > 0 && delay < max)
+		delay *= 2;
+	if (delay > max)
+		delay = max;
+	return delay / 2 + random() % (delay / 2 + 1);
+}
+
+/*
+ * Record how much partially transferred data the next rsync process will
+ * be able to reuse. The partial dirs persist across restarts, so files which
+ * were already accounted for at an earlier restart may still be there. Hence
+ * the statistics keep the largest amount seen at any restart, not the sum.
+ */
+static void account_partial_files(void)
+{
+	char *dir;
+	int64_t size, total = 0;
+	int i, ret;
+
+	if (conf.no_partial_dir_given)
+		return;
+	FOR_EACH_PARTIAL_DIR(i) {
+		dir = partial_dir_name(i);
+		ret = get_dir_size(dir, &size);
+		if (ret < 0)
+			DSS_WARNING_LOG(("%s: %s\n", dir, dss_strerror(-ret)));
+		else
+			total += size;
+		free(dir);
+	}
+	if (total == 0)
+		return;
+	DSS_NOTICE_LOG(("%" PRId64 " bytes of partial files can be resumed\n",
+		total));
+	if (total > snapshot_stats.partial_size)
+		snapshot_stats.partial_size = total;
+}
+
+/* Must not end up in the complete snapshot. */
+static void remove_partial_dir(void)
+{
+	int i;
+
+	FOR_EACH_PARTIAL_DIR(i) {
+		char *dir = partial_dir_name(i);
+		int ret = remove_flat_dir(dir);
+
+		if (ret < 0)
+			DSS_WARNING_LOG(("can not remove %s: %s\n", dir,
+				dss_strerror(-ret)));
+		free(dir);
+	}
+}
+
+/*
+ * The link count at which files of a new snapshot get a new inode. Zero stands
+ * for 90% of the limit of the file system of the destination directory.
+ */
+static int64_t split_link_count(void)
+{
+	long link_max;
+
+	if (conf.max_links_arg != 0)
+		return conf.max_links_arg;
+	link_max = pathconf(".", _PC_LINK_MAX);
+	if (link_max <= 0)
+		return -1;
+	return link_max - link_max / 10;
+}
+
+static int dedup_child(__a_unused void *private_data)
+{
+	char *name = incomplete_name(current_snapshot_creation_time);
+	struct dedup_params dp = {
+		.moved_min_size = conf.dedup_moved_given?
+			conf.dedup_min_size_arg * 1024LL : -1,
+		.reflink_min_size = conf.reflink_changed_given?
+			conf.reflink_min_size_arg * 1024LL * 1024LL : -1,
+		.max_links = split_link_count(),
+	};
+	int ret = dedup_snapshot(name, name_of_reference_snapshot, &dp);
+
+	free(name);
+	return ret;
+}
+
+/*
+ * Start the process which hardlinks moved files, reflinks modified files and
+ * splits chains of links which approach the link limit. Returns positive if
+ * the process was started, zero if there is nothing to do.
+ */
+static int start_dedup(void)
+{
+	int ret;
+
+	if (!conf.dedup_moved_given && !conf.reflink_changed_given
+			&& conf.max_links_arg < 0)
+		return 0;
+	if (!name_of_reference_snapshot)
+		return 0;
+	if (conf.dedup_moved_given || conf.reflink_changed_given)
+		DSS_NOTICE_LOG(("deduplicating snapshot\n"));
+	else
+		DSS_INFO_LOG(("checking link counts\n"));
+	assert(rsync_fd < 0);
+	ret = dss_fork_pipe(&create_pid, &rsync_fd, dedup_child, NULL);
+	if (ret < 0) {
+		DSS_WARNING_LOG(("can not start dedup process: %s\n",
+			dss_strerror(-ret)));
+		return 0;
+	}
+	dedup_running = 1;
+	return 1;
+}
+
+static int deletion_pass_child(__a_unused void *private_data)
+{
+	return list_deleted_paths(&thin_info, name_of_reference_snapshot);
+}
+
+/*
+ * Find the paths of the base snapshot which were not itemized by rsync. This
+ * walks the local base snapshot only. Returns positive if the process was
+ * started, zero if the snapshot is not thin.
+ */
+static int start_deletion_pass(void)
+{
+	int ret;
+
+	if (!creating_thin)
+		return 0;
+	/* rsync --delete also refrains from deleting on I/O errors */
+	if (snapshot_stats.exit_status == 23) {
+		DSS_WARNING_LOG(("file list incomplete, not recording files "
+			"deleted since %s\n", name_of_reference_snapshot));
+		return 0;
+	}
+	DSS_NOTICE_LOG(("looking for files deleted since %s\n",
+		name_of_reference_snapshot));
+	assert(rsync_fd < 0);
+	ret = dss_fork_pipe(&create_pid, &rsync_fd, deletion_pass_child, NULL);
+	if (ret < 0)
+		return ret;
+	deletion_pass_running = 1;
+	return 1;
+}
+
+/*
+ * Remove outdated, redundant and orphaned snapshots of a mirror directory,
+ * which is the working directory of the calling process.
+ */
+static void prune_mirror(const char *mirror)
+{
+	for (;;) {
+		struct snapshot_list sl;
+		struct snapshot *victim = NULL;
+		char *new_name;
+		int ret;
+
+		dss_get_snapshot_list(&sl);
+		if (sl.num_snapshots > 1) {
+			victim = find_outdated_snapshot(&sl);
+			if (!victim && !conf.keep_redundant_given)
+				victim = find_redundant_snapshot(&sl);
+			if (!victim)
+				victim = find_orphaned_snapshot(&sl);
+		}
+		if (!victim) {
+			free_snapshot_list(&sl);
+			return;
+		}
+		new_name = being_deleted_name(victim);
+		DSS_NOTICE_LOG(("%s: removing %s (interval = %i)\n", mirror,
+			victim->name, victim->interval));
+		ret = dss_rename(victim->name, new_name);
+		if (ret >= 0) {
+			remove_snapshot_stats(victim->name);
+			ret = remove_tree(new_name);
+		}
+		free(new_name);
+		free_snapshot_list(&sl);
+		if (ret < 0) {
+			DSS_WARNING_LOG(("%s: %s\n", mirror, dss_strerror(-ret)));
+			return;
+		}
+	}
+}
+
+/*
+ * Copy the new snapshot to one mirror directory, hardlinking against the
+ * newest complete snapshot of the mirror. Runs in a child process.
+ */
+static int update_mirror(void *private_data)
+{
+	const char *mirror = private_data;
+	struct snapshot_list sl;
+	char *name, *reference, *argv[7];
+	int i = 0, ret, status;
+	pid_t pid;
+
+	ret = dss_chdir(mirror);
+	if (ret < 0) {
+		DSS_ERROR_LOG(("%s: %s\n", mirror, dss_strerror(-ret)));
+		return ret;
+	}
+	dss_get_snapshot_list(&sl);
+	reference = name_of_newest_complete_snapshot(&sl);
+	free_snapshot_list(&sl);
+	name = incomplete_name(current_snapshot_creation_time);
+	argv[i++] = "rsync";
+	argv[i++] = "-aq";
+	argv[i++] = "--delete";
+	if (reference)
+		argv[i++] = make_message("--link-dest=../%s", reference);
+	argv[i++] = mirror_source;
+	argv[i++] = name;
+	argv[i] = NULL;
+	DSS_INFO_LOG(("%s: using %s as reference\n", mirror,
+		reference? reference : "(none)"));
+	dss_exec(&pid, argv[0], argv);
+	ret = dss_waitpid(pid, &status, 0);
+	if (ret < 0)
+		goto out;
+	ret = -E_BAD_EXIT_CODE;
+	if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0
+			&& WEXITSTATUS(status) != 24)) {
+		DSS_ERROR_LOG(("%s: rsync failed\n", mirror));
+		goto out;
+	}
+	ret = dss_rename(name, path_to_last_complete_snapshot);
+	if (ret < 0) {
+		DSS_ERROR_LOG(("%s: %s\n", mirror, dss_strerror(-ret)));
+		goto out;
+	}
+	DSS_NOTICE_LOG(("%s: %s -> %s\n", mirror, name,
+		path_to_last_complete_snapshot));
+	/* inherited from the parent, which has just written its copy */
+	write_snapshot_stats(path_to_last_complete_snapshot, &snapshot_stats);
+	prune_mirror(mirror);
+out:
+	if (reference)
+		free(argv[3]);
+	free(reference);
+	free(name);
+	return ret;
+}
+
+/*
+ * This runs in a child process which leads a new process group. It updates
+ * all mirror directories concurrently and fails if at least one of them could
+ * not be updated.
+ */
+static int run_mirrors(__a_unused void *private_data)
+{
+	pid_t *pids = dss_malloc(conf.mirror_dir_given * sizeof(pid_t));
+	unsigned u, num_failed = 0;
+
+	setpgid(0, 0);
+	for (u = 0; u < conf.mirror_dir_given; u++)
+		dss_fork(pids + u, update_mirror, conf.mirror_dir_arg[u]);
+	for (u = 0; u < conf.mirror_dir_given; u++) {
+		int status;
+
+		if (dss_waitpid(pids[u], &status, 0) < 0)
+			status = -1;
+		if (status < 0 || !WIFEXITED(status)
+				|| WEXITSTATUS(status) != EXIT_SUCCESS)
+			num_failed++;
+	}
+	free(pids);
+	if (num_failed == 0)
+		return 1;
+	DSS_WARNING_LOG(("%u of %u mirror(s) not updated\n", num_failed,
+		conf.mirror_dir_given));
+	return -E_BAD_EXIT_CODE;
+}
+
+/*
+ * Start the process which copies the snapshot just completed to the mirror
+ * directories. Returns positive if the process was started, zero if there is
+ * nothing to do.
+ */
+static int start_mirrors(void)
+{
+	char *cwd;
+	int ret;
+
+	if (!conf.mirror_dir_given)
+		return 0;
+	cwd = getcwd(NULL, 0);
+	if (!cwd) {
+		DSS_WARNING_LOG(("can not update mirrors: %s\n",
+			strerror(errno)));
+		return 0;
+	}
+	free(mirror_source);
+	mirror_source = make_message("%s/%s/", cwd,
+		path_to_last_complete_snapshot);
+	free(cwd);
+	DSS_NOTICE_LOG(("updating %u mirror(s)\n", conf.mirror_dir_given));
+	assert(rsync_fd < 0);
+	ret = dss_fork_pipe(&create_pid, &rsync_fd, run_mirrors, NULL);
+	if (ret < 0) {
+		DSS_WARNING_LOG(("can not start mirror process: %s\n",
+			dss_strerror(-ret)));
+		return 0;
+	}
+	/* also done by the child, whichever runs first */
+	setpgid(create_pid, create_pid);
+	mirror_running = 1;
+	return 1;
+}
+
+/* A mirror which could not be updated does not affect the snapshot. */
+static int handle_mirror_exit(pid_t pid, int status)
+{
+	mirror_running = 0;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+		DSS_WARNING_LOG(("mirror process %d failed\n", (int)pid));
+	snapshot_creation_status = HS_SUCCESS;
+	return 1;
+}
+
+static int complete_snapshot(void)
+{
+	int ret = rename_incomplete_snapshot(current_snapshot_creation_time);
+
+	if (ret < 0)
+		return ret;
+	free(name_of_reference_snapshot);
+	name_of_reference_snapshot = NULL;
+	if (start_mirrors() > 0)
+		return 1;
+	snapshot_creation_status = HS_SUCCESS;
+	return ret;
+}
+
+static int finish_snapshot(void)
+{
+	int ret = start_dedup();
+
+	if (ret > 0)
+		return ret;
+	return complete_snapshot();
+}
+
+static int handle_deletion_pass_exit(pid_t pid, int status)
+{
+	int es;
+
+	deletion_pass_running = 0;
+	if (!WIFEXITED(status)) {
+		DSS_ERROR_LOG(("rsync process %d died involuntary\n", (int)pid));
+		snapshot_creation_status = HS_READY;
+		return -E_INVOLUNTARY_EXIT;
+	}
+	es = WEXITSTATUS(status);
+	if (es != EXIT_SUCCESS) {
+		DSS_ERROR_LOG(("deletion pass %d failed\n", (int)pid));
+		snapshot_creation_status = HS_READY;
+		return -E_BAD_EXIT_CODE;
+	}
+	DSS_INFO_LOG(("%u path(s) deleted since %s\n", thin_info.num_deleted,
+		name_of_reference_snapshot));
+	return finish_snapshot();
+}
+
+/* Failure to deduplicate is not fatal, the snapshot is complete anyway. */
+static int handle_dedup_exit(pid_t pid, int status)
+{
+	dedup_running = 0;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+		DSS_WARNING_LOG(("dedup process %d failed\n", (int)pid));
+	else if (snapshot_stats.num_deduplicated > 0)
+		DSS_NOTICE_LOG(("hardlinked %" PRId64 " moved file(s), %"
+			PRId64 " bytes\n", snapshot_stats.num_deduplicated,
+			snapshot_stats.deduplicated_size));
+	if (snapshot_stats.num_reflinked > 0)
+		DSS_NOTICE_LOG(("%" PRId64 " modified file(s) share %" PRId64
+			" bytes with their previous version\n",
+			snapshot_stats.num_reflinked,
+			snapshot_stats.reflinked_size));
+	if (snapshot_stats.num_split > 0)
+		DSS_NOTICE_LOG(("copied %" PRId64 " file(s), %" PRId64 " bytes, "
+			"to stay below the link limit\n",
+			snapshot_stats.num_split, snapshot_stats.split_size));
+	return complete_snapshot();
+}
+
+static int handle_rsync_exit(pid_t pid, int status)
 {
 	int es, ret;
 
+	flush_rsync_output();
+	sources_running = 0;
+	tar_running = 0;
+	stop_prefetch();
+	if (mirror_running) {
+		ret = handle_mirror_exit(pid, status);
+		goto out;
+	}
+	if (dedup_running) {
+		ret = handle_dedup_exit(pid, status);
+		goto out;
+	}
+	if (deletion_pass_running) {
+		ret = handle_deletion_pass_exit(pid, status);
+		goto out;
+	}
+	remove_failed_files_list();
+	if (failed_files_passes) {
+		snapshot_stats.num_transferred += retry_stats.num_transferred;
+		snapshot_stats.transferred_size += retry_stats.transferred_size;
+		snapshot_stats.literal_data += retry_stats.literal_data;
+	}
 	if (!WIFEXITED(status)) {
-		DSS_ERROR_LOG(("rsync process %d died involuntary\n", (int)create_pid));
+		DSS_ERROR_LOG(("rsync process %d died involuntary\n", (int)pid));
 		ret = -E_INVOLUNTARY_EXIT;
 		snapshot_creation_status = HS_READY;
 		goto out;
 	}
 	es = WEXITSTATUS(status);
+	snapshot_stats.exit_status = es;
 	/*
 	 * Restart rsync on non-fatal errors:
 	 * 12: Error in rsync protocol data stream
 	 * 13: Errors with program diagnostics
 	 */
 	if (es == 12 || es == 13) {
-		DSS_WARNING_LOG(("rsync process %d returned %d -- restarting\n",
-			(int)create_pid, es));
+		int64_t delay = restart_delay(snapshot_stats.num_restarts++);
+
+		DSS_WARNING_LOG(("rsync process %d returned %d -- restarting "
+			"in %" PRId64 " seconds\n", (int)pid, es, delay));
+		account_partial_files();
 		snapshot_creation_status = HS_NEEDS_RESTART;
-		next_snapshot_time = get_current_time() + 60;
+		next_snapshot_time = get_current_time() + delay;
 		ret = 1;
 		goto out;
 	}
 	if (es != 0 && es != 23 && es != 24) {
-		DSS_ERROR_LOG(("rsync process %d returned %d\n", (int)create_pid, es));
+		DSS_ERROR_LOG(("rsync process %d returned %d\n", (int)pid, es));
 		ret = -E_BAD_EXIT_CODE;
 		snapshot_creation_status = HS_READY;
 		goto out;
 	}
-	ret = rename_incomplete_snapshot(current_snapshot_creation_time);
-	if (ret < 0)
+	if (es == 23) {
+		ret = retry_failed_files();
+		if (ret != 0) /* error, or follow-up pass started */
+			goto out;
+	}
+	if (num_failed_files > 0)
+		DSS_WARNING_LOG(("%u file(s) could not be transferred\n",
+			num_failed_files));
+	free_failed_files();
+	remove_partial_dir();
+	ret = start_deletion_pass();
+	if (ret != 0) /* error, or deletion pass started */
 		goto out;
-	snapshot_creation_status = HS_SUCCESS;
-	free(name_of_reference_snapshot);
-	name_of_reference_snapshot = NULL;
+	ret = finish_snapshot();
 out:
 	create_process_stopped = 0;
 	return ret;
@@ -882,6 +2378,7 @@ static int handle_pre_create_hook_exit(int status)
 			DSS_NOTICE_LOG(("deferring snapshot creation...\n"));
 			warn_count = 60; /* warn only once per hour */
 		}
+		stop_prefetch();
 		next_snapshot_time = get_current_time() + 60;
 		snapshot_creation_status = HS_READY;
 		ret = 0;
@@ -894,32 +2391,36 @@ out:
 	return ret;
 }
 
-static int handle_sigchld(void)
+static int handle_child_exit(pid_t pid, int status)
 {
-	pid_t pid;
-	int status, ret = reap_child(&pid, &status);
-
-	if (ret <= 0)
-		return ret;
+	int ret;
 
+	switch (hook_exited(pid, status)) {
+	case HE_ASYNC:
+		return 1;
+	case HE_TIMED_OUT: /* count it as a failing hook, not as a crash */
+		status = W_EXITCODE(1, 0);
+		break;
+	default:
+		break;
+	}
 	if (pid == create_pid) {
 		switch (snapshot_creation_status) {
 		case HS_PRE_RUNNING:
 			ret = handle_pre_create_hook_exit(status);
 			break;
 		case HS_RUNNING:
-			ret = handle_rsync_exit(status);
-			break;
-		case HS_POST_RUNNING:
-			snapshot_creation_status = HS_READY;
-			ret = 1;
+			create_pid = 0;
+			ret = handle_rsync_exit(pid, status);
 			break;
 		default:
 			DSS_EMERG_LOG(("BUG: create can't die in status %d\n",
 				snapshot_creation_status));
 			return -E_BUG;
 		}
-		create_pid = 0;
+		/* a follow-up rsync pass might have been started */
+		if (snapshot_creation_status != HS_RUNNING)
+			create_pid = 0;
 		return ret;
 	}
 	if (pid == remove_pid) {
@@ -928,23 +2429,289 @@ static int handle_sigchld(void)
 			return ret;
 		return ret;
 	}
+	if (pid == ssh_master.pid) {
+		ssh_master_exited(&ssh_master, status);
+		return 1;
+	}
+	if (ssh_master_check_exited(&ssh_master, pid, status))
+		return 1;
+	ret = coproc_exited(pid, status);
+	if (ret != 0)
+		return ret;
+	if (pid == prefetch_pid) {
+		DSS_DEBUG_LOG(("prefetch process %d terminated\n", (int)pid));
+		prefetch_pid = 0;
+		return 1;
+	}
 	DSS_EMERG_LOG(("BUG: unknown process %d died\n", (int)pid));
 	return -E_BUG;
 }
 
+/*
+ * Reap all children which have died. The signalfd reports several pending
+ * SIGCHLDs as one, and several pidfds may become ready at the same time. See
+ * reap_child() for the meaning of the argument.
+ */
+static int handle_sigchld(const fd_set *ready)
+{
+	for (;;) {
+		pid_t pid;
+		int status, ret = reap_child(ready, &pid, &status);
+
+		if (ret <= 0)
+			return ret;
+		ret = handle_child_exit(pid, status);
+		if (ret < 0)
+			return ret;
+	}
+}
+
+static void free_sources(void)
+{
+	unsigned u;
+
+	for (u = 0; u < num_sources; u++) {
+		free(sources[u].name);
+		free(sources[u].host);
+		free(sources[u].user);
+		free(sources[u].dir);
+		free_rsync_argv(sources[u].argv);
+	}
+	free(sources);
+	sources = NULL;
+	num_sources = 0;
+}
+
+/* The argument of --source is of the form name=[[user@]host:]dir. */
+static int parse_source(const char *arg, struct composite_source *cs)
+{
+	const char *eq = strchr(arg, '='), *spec, *colon, *slash, *at;
+
+	memset(cs, 0, sizeof(*cs));
+	if (!eq || eq == arg || !eq[1])
+		return -E_SYNTAX;
+	cs->name = dss_malloc(eq - arg + 1);
+	memcpy(cs->name, arg, eq - arg);
+	cs->name[eq - arg] = '\0';
+	if (strchr(cs->name, '/') || !strcmp(cs->name, ".")
+			|| !strcmp(cs->name, ".."))
+		return -E_SYNTAX;
+	spec = eq + 1;
+	colon = strchr(spec, ':');
+	slash = strchr(spec, '/');
+	if (colon && (!slash || colon < slash)) {
+		at = memchr(spec, '@', colon - spec);
+		if (at) {
+			cs->user = dss_malloc(at - spec + 1);
+			memcpy(cs->user, spec, at - spec);
+			cs->user[at - spec] = '\0';
+			spec = at + 1;
+		}
+		cs->host = dss_malloc(colon - spec + 1);
+		memcpy(cs->host, spec, colon - spec);
+		cs->host[colon - spec] = '\0';
+		spec = colon + 1;
+	}
+	if (!*spec || (cs->host && !*cs->host))
+		return -E_SYNTAX;
+	cs->dir = dss_strdup(spec);
+	return 1;
+}
+
+static int parse_sources(void)
+{
+	unsigned u, v;
+	int ret;
+
+	free_sources();
+	if (!conf.source_given)
+		return 1;
+	if (conf.source_dir_given || conf.rsync_module_given) {
+		DSS_ERROR_LOG(("--source excludes --source-dir and "
+			"--rsync-module\n"));
+		return -E_SYNTAX;
+	}
+	sources = dss_calloc(conf.source_given * sizeof(*sources));
+	for (u = 0; u < conf.source_given; u++) {
+		num_sources++;
+		ret = parse_source(conf.source_arg[u], sources + u);
+		if (ret < 0) {
+			DSS_ERROR_LOG(("bad source: %s\n", conf.source_arg[u]));
+			goto err;
+		}
+		for (v = 0; v < u; v++) {
+			if (strcmp(sources[u].name, sources[v].name))
+				continue;
+			DSS_ERROR_LOG(("duplicate source: %s\n",
+				sources[u].name));
+			ret = -E_SYNTAX;
+			goto err;
+		}
+	}
+	if (conf.thin_given)
+		DSS_WARNING_LOG(("--thin is ignored for composite snapshots\n"));
+	return 1;
+err:
+	free_sources();
+	return ret;
+}
+
+/*
+ * With -h, rsync prints sizes like "1.23G" in its statistics, which can not
+ * be parsed exactly. Drop -h and --human-readable from the rsync options, and
+ * the h from groups of short flags like -avh. The value of an option like
+ * --exclude is left alone.
+ */
+static void strip_human_readable(void)
+{
+	static const char * const pattern_opts[] = {"--exclude", "--include",
+		"--filter", "-f", NULL};
+	/* short options of rsync which take no argument */
+	const char *flags = "0468AbCcDEFgHhIiJKkLlmNOoPpqRrStUuvWXxz";
+	int i, j, k, n = 0;
+
+	for (i = 0; i < conf.rsync_option_given; i++) {
+		char *opt = conf.rsync_option_arg[i], *p;
+		int is_value = 0;
+
+		for (j = 0; n > 0 && pattern_opts[j]; j++)
+			if (!strcmp(conf.rsync_option_arg[n - 1],
+					pattern_opts[j]))
+				is_value = 1;
+		if (!is_value && (!strcmp(opt, "--human-readable")
+				|| !strncmp(opt, "--human-readable=", 17))) {
+			DSS_WARNING_LOG(("ignoring rsync option %s\n", opt));
+			free(opt);
+			free(conf.rsync_option_orig[i]);
+			continue;
+		}
+		if (!is_value && opt[0] == '-' && opt[1] != '-' && opt[1]
+				&& strchr(opt, 'h') && strspn(opt + 1, flags)
+				== strlen(opt + 1)) {
+			DSS_WARNING_LOG(("ignoring -h in rsync option %s\n",
+				opt));
+			for (p = opt + 1, k = 1; *p; p++)
+				if (*p != 'h')
+					opt[k++] = *p;
+			opt[k] = '\0';
+			if (k == 1) { /* nothing left */
+				free(opt);
+				free(conf.rsync_option_orig[i]);
+				continue;
+			}
+		}
+		conf.rsync_option_arg[n] = opt;
+		conf.rsync_option_orig[n] = conf.rsync_option_orig[i];
+		n++;
+	}
+	conf.rsync_option_given = n;
+}
+
 static int check_config(void)
 {
-	if (conf.unit_interval_arg <= 0) {
-		DSS_ERROR_LOG(("bad unit interval: %i\n", conf.unit_interval_arg));
+	int ret;
+	unsigned u;
+
+	strip_human_readable();
+	if (conf.rsync_port_arg <= 0 || conf.rsync_port_arg > 65535) {
+		DSS_ERROR_LOG(("bad rsync port: %i\n", conf.rsync_port_arg));
 		return -E_INVALID_NUMBER;
 	}
-	DSS_DEBUG_LOG(("unit interval: %i day(s)\n", conf.unit_interval_arg));
+	ret = parse_duration(conf.unit_interval_arg, &unit_interval);
+	if (ret < 0) {
+		DSS_ERROR_LOG(("bad unit interval: %s\n", conf.unit_interval_arg));
+		return ret;
+	}
+	DSS_DEBUG_LOG(("unit interval: %" PRId64 " seconds\n", unit_interval));
 	if (conf.num_intervals_arg <= 0 || conf.num_intervals_arg > 30) {
 		DSS_ERROR_LOG(("bad number of intervals: %i\n",
 			conf.num_intervals_arg));
 		return -E_INVALID_NUMBER;
 	}
 	DSS_DEBUG_LOG(("number of intervals: %i\n", conf.num_intervals_arg));
+	if (conf.aligned_schedule_given) {
+		/* slots must tile the interval exactly, see slot_length() */
+		int64_t wanted = desired_number_of_snapshots(0,
+			conf.num_intervals_arg);
+		if (unit_interval < wanted || unit_interval % wanted) {
+			DSS_ERROR_LOG(("--aligned-schedule: unit interval is not "
+				"a multiple of %" PRId64 " seconds\n", wanted));
+			return -E_INVALID_NUMBER;
+		}
+	}
+	if (conf.duration_percentile_arg <= 0
+			|| conf.duration_percentile_arg > 100) {
+		DSS_ERROR_LOG(("bad duration percentile: %i\n",
+			conf.duration_percentile_arg));
+		return -E_INVALID_NUMBER;
+	}
+	if (conf.pre_create_hook_timeout_arg < 0
+			|| conf.post_create_hook_timeout_arg < 0
+			|| conf.pre_remove_hook_timeout_arg < 0
+			|| conf.post_remove_hook_timeout_arg < 0) {
+		DSS_ERROR_LOG(("hook timeouts must not be negative\n"));
+		return -E_INVALID_NUMBER;
+	}
+	ret = parse_sources();
+	if (ret < 0)
+		return ret;
+	if (conf.tar_source_given) {
+		if (conf.source_dir_given || num_sources > 0
+				|| conf.rsync_module_given) {
+			DSS_ERROR_LOG(("--tar-source excludes --source-dir, "
+				"--source and --rsync-module\n"));
+			return -E_SYNTAX;
+		}
+		if (!strcmp(conf.tar_source_arg, "-") && !conf.create_given) {
+			DSS_ERROR_LOG(("tar stream on stdin requires --create\n"));
+			return -E_SYNTAX;
+		}
+	} else if (!conf.source_dir_given && num_sources == 0) {
+		DSS_ERROR_LOG(("neither --source-dir nor --source given\n"));
+		return -E_SYNTAX;
+	}
+	/*
+	 * A thin snapshot is useless without its base, and prune_mirror()
+	 * does not know which snapshots of a mirror are bases.
+	 */
+	if (conf.mirror_dir_given && conf.thin_given) {
+		DSS_ERROR_LOG(("--mirror-dir can not be combined with --thin\n"));
+		return -E_SYNTAX;
+	}
+	for (u = 0; u < conf.mirror_dir_given; u++) {
+		if (conf.mirror_dir_arg[u][0] == '/')
+			continue;
+		DSS_ERROR_LOG(("mirror dir must be absolute: %s\n",
+			conf.mirror_dir_arg[u]));
+		return -E_SYNTAX;
+	}
+	for (u = 0; u < conf.require_mount_given; u++) {
+		if (conf.require_mount_arg[u][0] == '/')
+			continue;
+		DSS_ERROR_LOG(("mountpoint must be absolute: %s\n",
+			conf.require_mount_arg[u]));
+		return -E_SYNTAX;
+	}
+	if (conf.min_source_free_mb_given) {
+		char *logname = dss_logname();
+		int local = use_rsync_locally(logname);
+
+		free(logname);
+		if (!conf.source_dir_given || !local) {
+			DSS_ERROR_LOG(("--min-source-free-mb needs a local "
+				"--source-dir\n"));
+			return -E_SYNTAX;
+		}
+	}
+	free(create_windows);
+	create_windows = NULL;
+	if (conf.create_window_given) {
+		ret = parse_time_windows(conf.create_window_arg,
+			conf.create_window_given, &create_windows);
+		if (ret < 0)
+			return ret;
+	}
+	next_condition_check = 0;
 	return 1;
 }
 
@@ -1027,15 +2794,27 @@ static int change_to_dest_dir(void)
 static int handle_sighup(void)
 {
 	int ret;
+	char *old_dest_dir = dss_strdup(conf.dest_dir_arg);
 
 	DSS_NOTICE_LOG(("SIGHUP, re-reading config\n"));
 	dump_dss_config("old");
 	ret = parse_config_file(1);
 	if (ret < 0)
-		return ret;
+		goto out;
 	dump_dss_config("reloaded");
 	invalidate_next_snapshot_time();
-	return change_to_dest_dir();
+	/* the history belongs to the old dest dir, reload it from the new one */
+	if (strcmp(old_dest_dir, conf.dest_dir_arg)) {
+		free_duration_model(&duration_model);
+		duration_model_loaded = 0;
+	}
+	/* queue again with the new limits */
+	io_token_cancel(IO_RSYNC);
+	io_token_cancel(IO_REMOVE);
+	ret = change_to_dest_dir();
+out:
+	free(old_dest_dir);
+	return ret;
 }
 
 static int handle_signal(void)
@@ -1051,13 +2830,14 @@ static int handle_signal(void)
 		restart_create_process();
 		dss_kill(create_pid, SIGTERM, NULL);
 		dss_kill(remove_pid, SIGTERM, NULL);
+		stop_prefetch();
 		ret = -E_SIGNAL;
 		break;
 	case SIGHUP:
 		ret = handle_sighup();
 		break;
 	case SIGCHLD:
-		ret = handle_sigchld();
+		ret = handle_sigchld(NULL);
 		break;
 	}
 out:
@@ -1066,19 +2846,19 @@ out:
 	return ret;
 }
 
-/*
- * We can not use rsync locally if the local user is different from the remote
- * user or if the src dir is not on the local host (or both).
- */
-static int use_rsync_locally(char *logname)
+static int is_thin_or_base(struct snapshot_list *sl, struct snapshot *s)
 {
-	char *h = conf.remote_host_arg;
+	struct thin_info ti;
+	char **names;
+	unsigned n;
 
-	if (strcmp(h, "localhost") && strcmp(h, "127.0.0.1"))
-		return 0;
-	if (conf.remote_user_given && strcmp(conf.remote_user_arg, logname))
-		return 0;
-	return 1;
+	if (read_thin_info(s->name, &ti) != 0) {
+		free_thin_info(&ti);
+		return 1;
+	}
+	n = get_thin_snapshots(sl, s->name, &names);
+	free_names(names, n);
+	return n > 0;
 }
 
 static int rename_resume_snap(int64_t creation_time)
@@ -1113,75 +2893,316 @@ static int rename_resume_snap(int64_t creation_time)
 	why = "aborted";
 	if ((s->flags & SS_COMPLETE) == 0)
 		goto out;
-	why = "outdated";
-	s = find_outdated_snapshot(&sl);
-	if (s)
+	why = "outdated";
+	s = find_outdated_snapshot(&sl);
+	if (s)
+		goto out;
+	why = "redundant";
+	s = find_redundant_snapshot(&sl);
+	if (s)
+		goto out;
+	why = "orphaned";
+	s = find_orphaned_snapshot(&sl);
+out:
+	if (s && (s->flags & SS_COMPLETE) && is_thin_or_base(&sl, s)) {
+		/* a fold might be in progress */
+		DSS_INFO_LOG(("not reusing %s snapshot %s\n", why, s->name));
+		s = NULL;
+	}
+	if (s) {
+		DSS_INFO_LOG(("reusing %s snapshot %s\n", why, s->name));
+		remove_snapshot_stats(s->name);
+		ret = dss_rename(s->name, new_name);
+	}
+	if (ret >= 0)
+		DSS_NOTICE_LOG(("creating new snapshot %s\n", new_name));
+	free(new_name);
+	free_snapshot_list(&sl);
+	return ret;
+}
+
+/*
+ * With --thin, the new snapshot becomes another thin snapshot of the base of
+ * the reference snapshot unless the base has enough of these already.
+ */
+static void select_base_snapshot(struct snapshot_list *sl)
+{
+	char **names;
+	unsigned n;
+
+	creating_thin = 0;
+	if (!name_of_reference_snapshot)
+		return;
+	name_of_reference_snapshot = base_of(name_of_reference_snapshot);
+	if (!conf.thin_given || num_sources > 0 || conf.tar_source_given)
+		return;
+	n = get_thin_snapshots(sl, name_of_reference_snapshot, &names);
+	free_names(names, n);
+	if (n >= conf.thin_base_interval_arg) {
+		DSS_NOTICE_LOG(("%s has %u thin snapshots, creating a new "
+			"base snapshot\n", name_of_reference_snapshot, n));
+		return;
+	}
+	creating_thin = 1;
+}
+
+/*
+ * Build the rsync command line for one source. If subdir is not NULL, the
+ * source is one of several of a composite snapshot and is stored in this
+ * subdirectory of the snapshot.
+ */
+static char **make_rsync_argv(char *source_arg, const char *subdir,
+		int64_t num)
+{
+	int i = 0, j;
+	char **argv = dss_malloc((19 + conf.rsync_option_given) * sizeof(char *));
+	char *name = incomplete_name(num);
+
+	argv[i++] = dss_strdup("rsync");
+	argv[i++] = dss_strdup("-a");
+	argv[i++] = dss_strdup("--delete");
+	argv[i++] = dss_strdup("--stats");
+	if (creating_thin) {
+		/* prune empty directory chains, itemize all paths */
+		argv[i++] = dss_strdup("-m");
+		argv[i++] = dss_strdup("-ii");
+	}
+	if (conf.rsync_progress_given)
+		argv[i++] = dss_strdup("--info=progress2");
+	/* a -e given as rsync option overrides this one */
+	if (!subdir && use_ssh_master()) {
+		check_ssh_master();
+		argv[i++] = dss_strdup("-e");
+		argv[i++] = ssh_master_rsh(&ssh_master);
+	}
+	if (!subdir) { /* see --tune-transport */
+		if (transport.compress)
+			argv[i++] = dss_strdup("-z");
+		if (transport.whole_file)
+			argv[i++] = dss_strdup("--whole-file");
+		if (transport.cipher && !conf.rsync_module_given
+				&& !use_ssh_master()) {
+			argv[i++] = dss_strdup("-e");
+			argv[i++] = make_message("ssh -c %s", transport.cipher);
+		}
+	}
+	if (conf.rsync_module_given && conf.rsync_password_file_given)
+		argv[i++] = make_message("--password-file=%s",
+			conf.rsync_password_file_arg);
+	if (!conf.no_partial_dir_given) {
+		char cwd[PATH_MAX];
+
+		/*
+		 * rsync uses an absolute partial dir for all files. As it is
+		 * not part of the source, it must be protected from --delete.
+		 */
+		if (getcwd(cwd, sizeof(cwd))) {
+			argv[i++] = make_message("--partial-dir=%s/%s/%s%s"
+				PARTIAL_DIR, cwd, name, subdir? subdir : "",
+				subdir? "/" : "");
+			argv[i++] = dss_strdup("--filter=P /" PARTIAL_DIR "/");
+		} else
+			DSS_WARNING_LOG(("getcwd: %s\n", strerror(errno)));
+	}
+	for (j = 0; j < conf.rsync_option_given; j++)
+		argv[i++] = dss_strdup(conf.rsync_option_arg[j]);
+	if (name_of_reference_snapshot) {
+		if (subdir)
+			argv[i++] = make_message("--link-dest=../../%s/%s",
+				name_of_reference_snapshot, subdir);
+		else
+			argv[i++] = reference_arg();
+	}
+	argv[i++] = source_arg;
+	argv[i++] = subdir? make_message("%s/%s", name, subdir) :
+		dss_strdup(name);
+	argv[i++] = NULL;
+	for (j = 0; j < i; j++)
+		DSS_DEBUG_LOG(("argv[%d] = %s\n", j, argv[j]));
+	free(name);
+	return argv;
+}
+
+static char *composite_source_arg(const struct composite_source *cs)
+{
+	char *logname, *arg;
+
+	/* copy the contents of the directory into the subdirectory */
+	if (!cs->host)
+		return make_message("%s/", cs->dir);
+	logname = dss_logname();
+	arg = make_message("%s@%s:%s/", cs->user? cs->user : logname, cs->host,
+		cs->dir);
+	free(logname);
+	return arg;
+}
+
+static void create_source_argvs(int64_t num)
+{
+	unsigned u;
+
+	for (u = 0; u < num_sources; u++) {
+		free_rsync_argv(sources[u].argv);
+		sources[u].argv = make_rsync_argv(composite_source_arg(sources + u),
+			sources[u].name, num);
+	}
+}
+
+/* Higher values are worse. */
+static int exit_status_severity(int es)
+{
+	switch (es) {
+	case 0: return 0;
+	case 24: return 1;
+	case 23: return 2;
+	case 12: case 13: return 3;
+	default: return 4;
+	}
+}
+
+/* A recycled snapshot may contain sources which were removed from the config. */
+static void remove_stale_sources(const char *snapshot_name)
+{
+	struct dirent *entry;
+	DIR *dir = opendir(snapshot_name);
+
+	if (!dir)
+		return;
+	while ((entry = readdir(dir))) {
+		char *path;
+		unsigned u;
+		int ret;
+
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+		for (u = 0; u < num_sources; u++)
+			if (!strcmp(entry->d_name, sources[u].name))
+				break;
+		if (u < num_sources)
+			continue;
+		path = make_message("%s/%s", snapshot_name, entry->d_name);
+		DSS_NOTICE_LOG(("removing stale %s\n", path));
+		ret = remove_tree(path);
+		if (ret < 0)
+			DSS_WARNING_LOG(("%s: %s\n", path, dss_strerror(-ret)));
+		free(path);
+	}
+	closedir(dir);
+}
+
+/*
+ * This runs in a child process which leads a new process group. It starts one
+ * rsync process per source, all writing to the same pipe, waits for them and
+ * exits with the most severe of their exit codes, so that the parent can treat
+ * it like a single rsync process.
+ */
+static int run_sources(__a_unused void *private_data)
+{
+	char *name = incomplete_name(current_snapshot_creation_time);
+	pid_t *pids = dss_malloc(num_sources * sizeof(pid_t));
+	unsigned u;
+	int es = 0;
+
+	setpgid(0, 0);
+	if (mkdir(name, 0777) < 0 && errno != EEXIST) {
+		DSS_ERROR_LOG(("%s: %s\n", name, strerror(errno)));
+		return -ERRNO_TO_DSS_ERROR(errno);
+	}
+	remove_stale_sources(name);
+	for (u = 0; u < num_sources; u++)
+		dss_exec(pids + u, sources[u].argv[0], sources[u].argv);
+	for (u = 0; u < num_sources; u++) {
+		int status, source_es;
+
+		if (dss_waitpid(pids[u], &status, 0) < 0)
+			status = -1;
+		/* 20: Received SIGUSR1 or SIGINT */
+		source_es = status >= 0 && WIFEXITED(status)?
+			WEXITSTATUS(status) : 20;
+		if (source_es != 0)
+			DSS_NOTICE_LOG(("source %s: rsync returned %d\n",
+				sources[u].name, source_es));
+		if (exit_status_severity(source_es) > exit_status_severity(es))
+			es = source_es;
+	}
+	fflush(NULL);
+	_exit(es);
+}
+
+/*
+ * This runs in a child process which leads a new process group. It starts the
+ * command given by --tar-source, if any, and unpacks its output into the new
+ * snapshot.
+ */
+static int run_tar_source(__a_unused void *private_data)
+{
+	char *name = incomplete_name(current_snapshot_creation_time);
+	int ret, status, fd = STDIN_FILENO;
+	pid_t pid = 0;
+
+	setpgid(0, 0);
+	/* the stream is unpacked from scratch, also when resuming */
+	ret = remove_tree(name);
+	if (ret < 0)
+		goto out;
+	if (mkdir(name, 0777) < 0) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
 		goto out;
-	why = "redundant";
-	s = find_redundant_snapshot(&sl);
-	if (s)
+	}
+	if (strcmp(conf.tar_source_arg, "-")) {
+		DSS_INFO_LOG(("executing %s\n", conf.tar_source_arg));
+		ret = dss_exec_cmdline_stdout(&pid, &fd, conf.tar_source_arg);
+		if (ret < 0)
+			goto out;
+	}
+	ret = extract_tar(fd, name, name_of_reference_snapshot);
+	if (!pid)
 		goto out;
-	why = "orphaned";
-	s = find_orphaned_snapshot(&sl);
-out:
-	if (s) {
-		DSS_INFO_LOG(("reusing %s snapshot %s\n", why, s->name));
-		ret = dss_rename(s->name, new_name);
+	close(fd);
+	if (ret < 0) /* don't wait for a writer which might block */
+		kill(pid, SIGTERM);
+	if (dss_waitpid(pid, &status, 0) < 0)
+		status = -1;
+	if (ret >= 0 && (status < 0 || !WIFEXITED(status)
+			|| WEXITSTATUS(status) != EXIT_SUCCESS)) {
+		DSS_ERROR_LOG(("%s failed\n", conf.tar_source_arg));
+		ret = -E_BAD_EXIT_CODE;
 	}
-	if (ret >= 0)
-		DSS_NOTICE_LOG(("creating new snapshot %s\n", new_name));
-	free(new_name);
-	free_snapshot_list(&sl);
+out:
+	if (ret < 0)
+		DSS_ERROR_LOG(("%s: %s\n", name, dss_strerror(-ret)));
+	free(name);
 	return ret;
 }
 
 static void create_rsync_argv(char ***argv, int64_t *num)
 {
-	char *logname;
-	int i = 0, j;
 	struct snapshot_list sl;
 
+	load_transport();
 	dss_get_snapshot_list(&sl);
 	assert(!name_of_reference_snapshot);
 	name_of_reference_snapshot = name_of_newest_complete_snapshot(&sl);
+	select_base_snapshot(&sl);
 	free_snapshot_list(&sl);
 
-	*argv = dss_malloc((15 + conf.rsync_option_given) * sizeof(char *));
-	(*argv)[i++] = dss_strdup("rsync");
-	(*argv)[i++] = dss_strdup("-aq");
-	(*argv)[i++] = dss_strdup("--delete");
-	for (j = 0; j < conf.rsync_option_given; j++)
-		(*argv)[i++] = dss_strdup(conf.rsync_option_arg[j]);
-	if (name_of_reference_snapshot) {
+	*num = get_current_time_ms();
+	if (name_of_reference_snapshot)
 		DSS_INFO_LOG(("using %s as reference\n", name_of_reference_snapshot));
-		(*argv)[i++] = make_message("--link-dest=../%s",
-			name_of_reference_snapshot);
-	} else
-		DSS_INFO_LOG(("no suitable reference snapshot found\n"));
-	logname = dss_logname();
-	if (use_rsync_locally(logname))
-		(*argv)[i++] = dss_strdup(conf.source_dir_arg);
 	else
-		(*argv)[i++] = make_message("%s@%s:%s/", conf.remote_user_given?
-			conf.remote_user_arg : logname,
-			conf.remote_host_arg, conf.source_dir_arg);
-	free(logname);
-	*num = get_current_time();
-	(*argv)[i++] = incomplete_name(*num);
-	(*argv)[i++] = NULL;
-	for (j = 0; j < i; j++)
-		DSS_DEBUG_LOG(("argv[%d] = %s\n", j, (*argv)[j]));
-}
-
-static void free_rsync_argv(char **argv)
-{
-	int i;
-
-	if (!argv)
+		DSS_INFO_LOG(("no suitable reference snapshot found\n"));
+	if (conf.source_given) {
+		create_source_argvs(*num);
+		/* only the argument vectors of the sources are used */
+		*argv = dss_calloc(sizeof(char *));
 		return;
-	for (i = 0; argv[i]; i++)
-		free(argv[i]);
-	free(argv);
+	}
+	if (conf.tar_source_given) {
+		*argv = dss_calloc(sizeof(char *));
+		return;
+	}
+	*argv = make_rsync_argv(rsync_source_arg(conf.source_dir_arg), NULL,
+		*num);
 }
 
 static int create_snapshot(char **argv)
@@ -1191,42 +3212,183 @@ static int create_snapshot(char **argv)
 	ret = rename_resume_snap(current_snapshot_creation_time);
 	if (ret < 0)
 		return ret;
-	dss_exec(&create_pid, argv[0], argv);
+	/* keep the restart count and the partial size across restarts */
+	if (snapshot_creation_status != HS_NEEDS_RESTART)
+		memset(&snapshot_stats, 0, sizeof(snapshot_stats));
+	free(rsync_progress);
+	rsync_progress = NULL;
+	free_failed_files();
+	failed_files_passes = 0;
+	dedup_running = 0;
+	deletion_pass_running = 0;
+	mirror_running = 0;
+	free_thin_info(&thin_info);
+	assert(rsync_fd < 0);
+	if (num_sources > 0) {
+		ret = dss_fork_pipe(&create_pid, &rsync_fd, run_sources, NULL);
+		if (ret < 0)
+			return ret;
+		/* also done by the child, whichever runs first */
+		setpgid(create_pid, create_pid);
+		sources_running = 1;
+	} else if (conf.tar_source_given) {
+		ret = dss_fork_pipe(&create_pid, &rsync_fd, run_tar_source, NULL);
+		if (ret < 0)
+			return ret;
+		/* also done by the child, whichever runs first */
+		setpgid(create_pid, create_pid);
+		tar_running = 1;
+	} else {
+		ret = dss_exec_pipe(&create_pid, &rsync_fd, argv[0], argv);
+		if (ret < 0)
+			return ret;
+	}
 	snapshot_creation_status = HS_RUNNING;
 	return ret;
 }
 
+/* How often to check whether an I/O token has become available. */
+#define IO_TOKEN_POLL_INTERVAL 5
+
+/*
+ * Errors of the token machinery are not fatal. Without tokens, dss behaves as
+ * if --max-fs-rsyncs and --max-fs-removals were not given.
+ */
+static int get_io_token(enum io_token t, int max)
+{
+	int ret = io_token_acquire(t, max);
+
+	if (ret >= 0)
+		return ret;
+	DSS_WARNING_LOG(("I/O token: %s\n", dss_strerror(-ret)));
+	return 1;
+}
+
+/*
+ * Disk space is checked whenever the loop wakes up. Without other events, it
+ * wakes up this often to notice if some other program fills the disk.
+ */
+#define DISK_SPACE_CHECK_INTERVAL 600
+
+/*
+ * Times which have already passed are ignored. Waiting for them is pointless
+ * because whatever was due has been handled, or is waiting for something else.
+ */
+static inline void earliest(int64_t *deadline, int64_t now, int64_t t)
+{
+	if (t > now && (*deadline == 0 || t < *deadline))
+		*deadline = t;
+}
+
+/*
+ * The next time at which the state of the select loop may change without a
+ * signal or output of a child. Zero means never.
+ */
+static int64_t next_deadline(void)
+{
+	int64_t now = get_current_time();
+	/* kill hung hooks, and wake up when the next hook times out */
+	int64_t deadline = kill_expired_hooks();
+
+	earliest(&deadline, now, coproc_next_deadline());
+	/* sleep until rm hook/process dies, or the coprocess replies */
+	if (remove_pid || snapshot_removal_status == HS_PRE_RUNNING)
+		return deadline;
+	earliest(&deadline, now, now + DISK_SPACE_CHECK_INTERVAL);
+	if (io_token_waiting())
+		earliest(&deadline, now, now + IO_TOKEN_POLL_INTERVAL);
+	/* round up, the check is due after a fraction of a second */
+	earliest(&deadline, now, next_removal_check.tv_sec + 1);
+	if (snapshot_creation_status == HS_READY
+			|| snapshot_creation_status == HS_NEEDS_RESTART) {
+		if (!next_snapshot_time_is_valid())
+			next_snapshot_time = compute_next_snapshot_time();
+		earliest(&deadline, now, next_snapshot_time);
+	}
+	if (snapshot_creation_status == HS_READY)
+		earliest(&deadline, now, next_condition_check);
+	return deadline;
+}
+
 static int select_loop(void)
 {
 	int ret;
-	/* check every 60 seconds for free disk space */
-	struct timeval tv;
 	char **rsync_argv = NULL;
 
+	ret = event_init();
+	if (ret < 0)
+		return ret;
+	ret = event_watch(signal_fd);
+	if (ret < 0)
+		return ret;
+	if (sched_client_fd() >= 0) {
+		ret = event_watch(sched_client_fd());
+		if (ret < 0)
+			return ret;
+	}
 	for (;;) {
 		fd_set rfds;
-		struct timeval *tvp;
-
-		if (remove_pid)
-			tvp = NULL; /* sleep until rm hook/process dies */
-		else { /* sleep one minute */
-			tv.tv_sec = 60;
-			tv.tv_usec = 0;
-			tvp = &tv;
+		int64_t deadline;
+
+		check_ssh_master();
+		if (snapshot_creation_status == HS_READY
+				|| snapshot_creation_status == HS_NEEDS_RESTART)
+			sched_release(SLOT_CREATE);
+		if (snapshot_removal_status == HS_READY)
+			sched_release(SLOT_REMOVE);
+		if (snapshot_creation_status != HS_RUNNING)
+			io_token_release(IO_RSYNC);
+		if (snapshot_removal_status != HS_RUNNING)
+			io_token_release(IO_REMOVE);
+		if (rsync_fd >= 0) {
+			ret = event_watch(rsync_fd);
+			if (ret < 0)
+				goto out;
 		}
-		FD_ZERO(&rfds);
-		FD_SET(signal_pipe, &rfds);
-		ret = dss_select(signal_pipe + 1, &rfds, NULL, tvp);
+		ret = watch_children(event_watch);
+		if (ret < 0)
+			goto out;
+		if (coproc_fd() >= 0) {
+			ret = event_watch(coproc_fd());
+			if (ret < 0)
+				goto out;
+		}
+		ret = coproc_expire();
+		if (ret < 0)
+			goto out;
+		deadline = next_deadline();
+		if (deadline)
+			DSS_DEBUG_LOG(("sleeping for at most %" PRId64 "s\n",
+				deadline - get_current_time()));
+		ret = event_wait(deadline, &rfds);
 		if (ret < 0)
 			goto out;
-		if (FD_ISSET(signal_pipe, &rfds)) {
+		if (rsync_fd >= 0 && FD_ISSET(rsync_fd, &rfds))
+			read_rsync_output();
+		if (sched_client_fd() >= 0
+				&& FD_ISSET(sched_client_fd(), &rfds)) {
+			ret = sched_client_read();
+			if (ret < 0)
+				goto out;
+		}
+		if (FD_ISSET(signal_fd, &rfds)) {
 			ret = handle_signal();
 			if (ret < 0)
 				goto out;
 		}
-		if (remove_pid)
+		if (coproc_fd() >= 0 && FD_ISSET(coproc_fd(), &rfds)) {
+			ret = coproc_read();
+			if (ret < 0)
+				goto out;
+		}
+		ret = handle_sigchld(&rfds);
+		if (ret < 0)
+			goto out;
+		if (remove_pid || snapshot_removal_status == HS_PRE_RUNNING)
 			continue;
 		if (snapshot_removal_status == HS_PRE_SUCCESS) {
+			if (!get_io_token(IO_REMOVE, conf.max_fs_removals_arg))
+				continue;
 			ret = exec_rm();
 			if (ret < 0)
 				goto out;
@@ -1248,13 +3410,23 @@ static int select_loop(void)
 		case HS_READY:
 			if (!next_snapshot_is_due())
 				continue;
+			/* the base of the new snapshot might be affected */
+			if (fold_running)
+				continue;
+			if (!create_conditions_met())
+				continue;
+			if (!sched_acquire(SLOT_CREATE, next_snapshot_time))
+				continue;
 			pre_create_hook();
+			if (snapshot_creation_status == HS_PRE_RUNNING)
+				start_prefetch();
 			continue;
 		case HS_PRE_RUNNING:
 		case HS_RUNNING:
-		case HS_POST_RUNNING:
 			continue;
 		case HS_PRE_SUCCESS:
+			if (!get_io_token(IO_RSYNC, conf.max_fs_rsyncs_arg))
+				continue;
 			if (!name_of_reference_snapshot) {
 				free_rsync_argv(rsync_argv);
 				create_rsync_argv(&rsync_argv, &current_snapshot_creation_time);
@@ -1266,6 +3438,10 @@ static int select_loop(void)
 		case HS_NEEDS_RESTART:
 			if (!next_snapshot_is_due())
 				continue;
+			if (!sched_acquire(SLOT_CREATE, next_snapshot_time))
+				continue;
+			if (!get_io_token(IO_RSYNC, conf.max_fs_rsyncs_arg))
+				continue;
 			ret = create_snapshot(rsync_argv);
 			if (ret < 0)
 				goto out;
@@ -1284,6 +3460,11 @@ static void exit_hook(int exit_code)
 	char *argv[3];
 	pid_t pid;
 
+	if (coproc_enabled()) {
+		coproc_notify(CE_EXIT, NULL, dss_strerror(-exit_code));
+		coproc_shutdown();
+		return;
+	}
 	argv[0] = conf.exit_hook_arg;
 	argv[1] = dss_strerror(-exit_code);
 	argv[2] = NULL;
@@ -1292,6 +3473,10 @@ static void exit_hook(int exit_code)
 	dss_exec(&pid, conf.exit_hook_arg, argv);
 }
 
+/*
+ * Only one dss instance works on a dest dir, so once the lock is held, a fold
+ * which an earlier instance left unfinished can be dealt with.
+ */
 static void lock_dss_or_die(void)
 {
 	char *config_file = get_config_file_name();
@@ -1302,6 +3487,13 @@ static void lock_dss_or_die(void)
 		DSS_EMERG_LOG(("failed to lock: %s\n", dss_strerror(-ret)));
 		exit(EXIT_FAILURE);
 	}
+	if (conf.dry_run_given)
+		return;
+	ret = recover_fold();
+	if (ret < 0) {
+		DSS_EMERG_LOG(("%s\n", dss_strerror(-ret)));
+		exit(EXIT_FAILURE);
+	}
 }
 
 static int com_run(void)
@@ -1313,19 +3505,29 @@ static int com_run(void)
 		DSS_ERROR_LOG(("dry_run not supported by this command\n"));
 		return -E_SYNTAX;
 	}
+	srandom((unsigned)get_current_time() ^ (unsigned)getpid());
+	log_spawn_fallback();
 	ret = install_sighandler(SIGHUP);
 	if (ret < 0)
 		return ret;
+	if (conf.hook_coprocess_given) {
+		ret = coproc_init(conf.hook_coprocess_arg);
+		if (ret < 0)
+			return ret;
+	}
 	ret = select_loop();
 	if (ret >= 0) /* impossible */
 		ret = -E_BUG;
+	io_token_cancel(IO_RSYNC);
+	io_token_cancel(IO_REMOVE);
+	ssh_master_stop(&ssh_master);
 	exit_hook(ret);
 	return ret;
 }
 
 static int com_prune(void)
 {
-	int ret;
+	int ret, status;
 	struct snapshot_list sl;
 	struct snapshot *victim;
 	struct disk_space ds;
@@ -1370,10 +3572,7 @@ rm:
 		goto out;
 	if (snapshot_removal_status != HS_SUCCESS)
 		goto out;
-	post_remove_hook();
-	if (snapshot_removal_status != HS_POST_RUNNING)
-		goto out;
-	ret = wait_for_remove_process();
+	ret = wait_for_process(post_remove_hook(), &status);
 	if (ret < 0)
 		goto out;
 	ret = 1;
@@ -1382,6 +3581,21 @@ out:
 	return ret;
 }
 
+static void print_argv(char **argv)
+{
+	int i;
+	char *msg = NULL;
+
+	for (i = 0; argv[i]; i++) {
+		char *tmp = msg;
+		msg = make_message("%s%s%s", tmp? tmp : "",
+			tmp? " " : "", argv[i]);
+		free(tmp);
+	}
+	dss_msg("%s\n", msg);
+	free(msg);
+}
+
 static int com_create(void)
 {
 	int ret, status;
@@ -1389,44 +3603,277 @@ static int com_create(void)
 
 	lock_dss_or_die();
 	if (conf.dry_run_given) {
-		int i;
-		char *msg = NULL;
+		unsigned u;
+
 		create_rsync_argv(&rsync_argv, &current_snapshot_creation_time);
-		for (i = 0; rsync_argv[i]; i++) {
-			char *tmp = msg;
-			msg = make_message("%s%s%s", tmp? tmp : "",
-				tmp? " " : "", rsync_argv[i]);
-			free(tmp);
-		}
+		if (conf.tar_source_given)
+			dss_msg("unpack output of %s\n", conf.tar_source_arg);
+		else if (num_sources > 0)
+			for (u = 0; u < num_sources; u++)
+				print_argv(sources[u].argv);
+		else
+			print_argv(rsync_argv);
 		free_rsync_argv(rsync_argv);
-		dss_msg("%s\n", msg);
-		free(msg);
 		return 1;
 	}
 	pre_create_hook();
+	start_prefetch();
 	if (create_pid) {
 		ret = wait_for_process(create_pid, &status);
 		if (ret < 0)
 			return ret;
 		ret = handle_pre_create_hook_exit(status);
-		if (ret <= 0) /* error, or pre-create failed */
+		if (ret <= 0) { /* error, or pre-create failed */
+			stop_prefetch();
 			return ret;
+		}
 	}
 	create_rsync_argv(&rsync_argv, &current_snapshot_creation_time);
 	ret = create_snapshot(rsync_argv);
 	if (ret < 0)
 		goto out;
-	ret = wait_for_process(create_pid, &status);
+	do { /* rsync, followed by zero or more passes for failed files */
+		ret = wait_for_process(create_pid, &status);
+		if (ret < 0)
+			goto out;
+		ret = handle_rsync_exit(create_pid, status);
+		if (ret < 0)
+			goto out;
+	} while (snapshot_creation_status == HS_RUNNING);
+	ret = wait_for_process(post_create_hook(), &status);
+out:
+	stop_prefetch();
+	free_rsync_argv(rsync_argv);
+	return ret;
+}
+
+static int com_materialize(void)
+{
+	struct thin_info ti;
+	char *name = dss_strdup(conf.materialize_arg);
+	size_t len = strlen(name);
+	int ret;
+
+	lock_dss_or_die();
+	while (len > 1 && name[len - 1] == '/')
+		name[--len] = '\0';
+	ret = read_thin_info(name, &ti);
+	if (ret <= 0) {
+		if (ret == 0)
+			ret = -E_NOT_THIN;
+		goto out;
+	}
+	if (conf.dry_run_given) {
+		dss_msg("%s: base %s, %u deleted path(s)\n", name, ti.base,
+			ti.num_deleted);
+		ret = 0;
+	} else
+		ret = materialize_snapshot(name, &ti);
+	free_thin_info(&ti);
+out:
+	free(name);
+	return ret;
+}
+
+/** Scratch directory of --tune-transport, relative to the dest dir. */
+#define TUNE_DIR ".dss-tune"
+
+/*
+ * Transfer the sample once into an empty directory, and once more with
+ * --ignore-times so that the first copy serves as the basis for the delta
+ * algorithm, as for modified files.
+ */
+static int transport_trial(const char *source,
+		const struct transport_settings *ts, struct trial_result *tr)
+{
+	char *argv[14 + conf.rsync_option_given];
+	char *rsh = NULL, *password_file = NULL;
+	struct trial_result pass;
+	int i, j, k, ret;
+
+	ret = remove_tree(TUNE_DIR "/trial");
+	if (ret < 0)
+		return ret;
+	if (ts->cipher)
+		rsh = make_message("ssh -c %s", ts->cipher);
+	if (conf.rsync_module_given && conf.rsync_password_file_given)
+		password_file = make_message("--password-file=%s",
+			conf.rsync_password_file_arg);
+	memset(tr, 0, sizeof(*tr));
+	for (k = 0; k < 2; k++) {
+		i = 0;
+		argv[i++] = "rsync";
+		argv[i++] = "-a";
+		argv[i++] = "--files-from=" TUNE_DIR "/files";
+		if (k > 0)
+			argv[i++] = "--ignore-times";
+		if (ts->compress)
+			argv[i++] = "-z";
+		if (ts->whole_file)
+			argv[i++] = "--whole-file";
+		if (rsh) {
+			argv[i++] = "-e";
+			argv[i++] = rsh;
+		}
+		if (password_file)
+			argv[i++] = password_file;
+		for (j = 0; j < conf.rsync_option_given; j++)
+			argv[i++] = conf.rsync_option_arg[j];
+		argv[i++] = (char *)source;
+		argv[i++] = TUNE_DIR "/trial/";
+		argv[i] = NULL;
+		ret = run_trial(argv, TUNE_DIR "/output", &pass);
+		if (ret < 0)
+			break;
+		tr->wall_ms += pass.wall_ms;
+		tr->cpu_ms += pass.cpu_ms;
+	}
+	free(rsh);
+	free(password_file);
+	return ret;
+}
+
+/* Less time is better. Within 5%, the settings which need less CPU win. */
+static int trial_is_better(const struct trial_result *a,
+		const struct trial_result *b)
+{
+	if (a->wall_ms * 20 < b->wall_ms * 19)
+		return 1;
+	if (b->wall_ms * 20 < a->wall_ms * 19)
+		return 0;
+	return a->cpu_ms < b->cpu_ms;
+}
+
+static void print_trial(const struct transport_settings *ts,
+		const struct trial_result *tr, int64_t sample_size)
+{
+	dss_msg("compress=%d whole_file=%d cipher=%-30s %7" PRId64 " ms, "
+		"%7" PRId64 " ms CPU, %5" PRId64 " KB/s\n", ts->compress,
+		ts->whole_file, ts->cipher? ts->cipher : "default",
+		tr->wall_ms, tr->cpu_ms, 2 * sample_size / (tr->wall_ms + 1));
+}
+
+/*
+ * Try a candidate, and adopt it as the new best settings if it is better.
+ * The candidate is freed in any case.
+ */
+static void try_candidate(const char *source, struct transport_settings *cand,
+		struct transport_settings *best, struct trial_result *best_tr,
+		int64_t sample_size)
+{
+	struct trial_result tr;
+	int ret = transport_trial(source, cand, &tr);
+
+	if (ret < 0) {
+		dss_msg("compress=%d whole_file=%d cipher=%-30s failed: %s\n",
+			cand->compress, cand->whole_file, cand->cipher?
+			cand->cipher : "default", dss_strerror(-ret));
+		free_transport_settings(cand);
+		return;
+	}
+	print_trial(cand, &tr, sample_size);
+	if (!trial_is_better(&tr, best_tr)) {
+		free_transport_settings(cand);
+		return;
+	}
+	free_transport_settings(best);
+	*best = *cand;
+	*best_tr = tr;
+}
+
+static int com_tune_transport(void)
+{
+	static const char *ciphers[] = {"aes128-gcm@openssh.com",
+		"chacha20-poly1305@openssh.com", "aes128-ctr"};
+	struct transport_settings best = {.compress = 0}, cand;
+	struct trial_result best_tr;
+	char *logname, *arg, *source, *password_file = NULL, *argv[6];
+	int64_t sample_size;
+	int i, ret, use_ssh;
+
+	if (!conf.source_dir_given) {
+		DSS_ERROR_LOG(("--tune-transport requires --source-dir\n"));
+		return -E_SYNTAX;
+	}
+	logname = dss_logname();
+	use_ssh = !conf.rsync_module_given && !use_rsync_locally(logname);
+	free(logname);
+	arg = rsync_source_arg(conf.source_dir_arg);
+	/* the file list is relative to the contents of the source dir */
+	source = arg[strlen(arg) - 1] == '/'? arg : make_message("%s/", arg);
+	if (source != arg)
+		free(arg);
+	ret = remove_tree(TUNE_DIR);
+	if (ret < 0)
+		goto out;
+	if (mkdir(TUNE_DIR, 0700) < 0) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	i = 0;
+	argv[i++] = "rsync";
+	argv[i++] = "-r";
+	argv[i++] = "--list-only";
+	if (conf.rsync_module_given && conf.rsync_password_file_given) {
+		password_file = make_message("--password-file=%s",
+			conf.rsync_password_file_arg);
+		argv[i++] = password_file;
+	}
+	argv[i++] = source;
+	argv[i] = NULL;
+	DSS_NOTICE_LOG(("listing %s\n", source));
+	ret = run_trial(argv, TUNE_DIR "/listing", &best_tr);
+	free(password_file);
+	if (ret < 0)
+		goto out;
+	ret = select_sample(TUNE_DIR "/listing", TUNE_DIR "/files",
+		conf.tune_sample_size_arg * 1024LL * 1024LL, &sample_size);
+	if (ret < 0)
+		goto out;
+	if (ret == 0) {
+		DSS_ERROR_LOG(("no files to transfer in %s\n", source));
+		ret = -E_SYNTAX;
+		goto out;
+	}
+	dss_msg("sample: %d files, %" PRId64 " KB\n", ret, sample_size / 1024);
+	/*
+	 * The defaults of rsync and ssh must work. The first pass also warms
+	 * the page cache of the source, which would otherwise favor all
+	 * candidates over the defaults. It is not timed.
+	 */
+	ret = transport_trial(source, &best, &best_tr);
 	if (ret < 0)
 		goto out;
-	ret = handle_rsync_exit(status);
+	ret = transport_trial(source, &best, &best_tr);
 	if (ret < 0)
 		goto out;
-	post_create_hook();
-	if (create_pid)
-		ret = wait_for_process(create_pid, &status);
+	print_trial(&best, &best_tr, sample_size);
+	for (i = 0; use_ssh && i < sizeof(ciphers) / sizeof(ciphers[0]); i++) {
+		cand = best;
+		cand.cipher = dss_strdup(ciphers[i]);
+		try_candidate(source, &cand, &best, &best_tr, sample_size);
+	}
+	cand = best;
+	cand.cipher = best.cipher? dss_strdup(best.cipher) : NULL;
+	cand.compress = 1;
+	try_candidate(source, &cand, &best, &best_tr, sample_size);
+	cand = best;
+	cand.cipher = best.cipher? dss_strdup(best.cipher) : NULL;
+	cand.whole_file = 1;
+	try_candidate(source, &cand, &best, &best_tr, sample_size);
+	dss_msg("best: ");
+	print_trial(&best, &best_tr, sample_size);
+	ret = 1;
+	if (conf.dry_run_given)
+		goto out;
+	ret = save_transport_settings(conf.remote_host_arg, &best);
+	if (ret >= 0)
+		DSS_NOTICE_LOG(("transport settings for %s saved\n",
+			conf.remote_host_arg));
 out:
-	free_rsync_argv(rsync_argv);
+	remove_tree(TUNE_DIR);
+	free_transport_settings(&best);
+	free(source);
 	return ret;
 }
 
@@ -1452,16 +3899,73 @@ static int setup_signal_handling(void)
 	int ret;
 
 	DSS_INFO_LOG(("setting up signal handlers\n"));
-	signal_pipe = signal_init(); /* always successful */
+	signal_fd = signal_init(); /* always successful */
 	ret = install_sighandler(SIGINT);
 	if (ret < 0)
 		return ret;
 	ret = install_sighandler(SIGTERM);
 	if (ret < 0)
 		return ret;
+	if (pidfds_supported()) /* exits are reported through pidfds */
+		return 1;
 	return install_sighandler(SIGCHLD);
 }
 
+/*
+ * Unlike the commands above, this runs without config file and dest dir of
+ * its own. Everything else is done by the jobs.
+ */
+static int com_run_jobs(void)
+{
+	struct sched_limits limits;
+	unsigned u;
+	int ret;
+
+	if (!conf.run_given) {
+		DSS_ERROR_LOG(("--job requires --run\n"));
+		return -E_SYNTAX;
+	}
+	if (conf.max_concurrent_creates_arg < 0
+			|| conf.max_concurrent_removals_arg < 0) {
+		DSS_ERROR_LOG(("bad job limits\n"));
+		return -E_INVALID_NUMBER;
+	}
+	limits.max[SLOT_CREATE] = conf.max_concurrent_creates_arg;
+	limits.max[SLOT_REMOVE] = conf.max_concurrent_removals_arg;
+	/* daemon_init() changes to the root directory */
+	for (u = 0; u < conf.job_given; u++) {
+		char *path;
+
+		ret = dss_realpath(conf.job_arg[u], &path);
+		if (ret < 0) {
+			DSS_ERROR_LOG(("job %s: %s\n", conf.job_arg[u],
+				dss_strerror(-ret)));
+			return ret;
+		}
+		free(conf.job_arg[u]);
+		conf.job_arg[u] = path;
+	}
+	if (conf.daemon_given) {
+		if (conf.logfile_given)
+			logfile = open_log(conf.logfile_arg);
+		daemon_init();
+		if (conf.logfile_given)
+			log_welcome(conf.loglevel_arg);
+	}
+	ret = setup_signal_handling();
+	if (ret < 0)
+		return ret;
+	ret = install_sighandler(SIGHUP);
+	if (ret < 0)
+		return ret;
+	/* the scheduler does not watch pidfds */
+	ret = install_sighandler(SIGCHLD);
+	if (ret < 0)
+		return ret;
+	DSS_NOTICE_LOG(("running %u jobs\n", conf.job_given));
+	return run_jobs(conf.job_arg, conf.job_given, &limits, signal_fd);
+}
+
 /**
  * The main function of dss.
  *
@@ -1480,6 +3984,10 @@ int main(int argc, char **argv)
 	params.print_errors = 1;
 
 	cmdline_parser_ext(argc, argv, &conf, &params); /* aborts on errors */
+	if (conf.job_given) {
+		ret = com_run_jobs();
+		goto out;
+	}
 	ret = parse_config_file(0);
 	if (ret < 0)
 		goto out;
@@ -1496,7 +4004,11 @@ int main(int argc, char **argv)
 		params.print_errors = 1;
 		cmdline_parser_ext(argc, argv, &conf, &params); /* aborts on errors */
 	}
-	if (conf.daemon_given)
+	ret = sched_client_init();
+	if (ret < 0)
+		goto out;
+	/* a job must stay a child of its scheduler */
+	if (conf.daemon_given && ret == 0)
 		daemon_init();
 	ret = change_to_dest_dir();
 	if (ret < 0)
@@ -55,7 +55,13 @@ static inline char *dss_strerror(int num)
 	DSS_ERROR(SIGNAL_SIG_ERR, "signal() returned SIG_ERR"), \
 	DSS_ERROR(SIGNAL, "caught terminating signal"), \
 	DSS_ERROR(BUG, "values of beta might cause dom!"), \
-	DSS_ERROR(NOT_RUNNING, "dss not running")
+	DSS_ERROR(NOT_RUNNING, "dss not running"), \
+	DSS_ERROR(THIN_INFO, "invalid thin snapshot info"), \
+	DSS_ERROR(NOT_THIN, "not a thin snapshot"), \
+	DSS_ERROR(TAR_FORMAT, "malformed tar stream"), \
+	DSS_ERROR(TAR_PATH, "unsafe path in tar stream"), \
+	DSS_ERROR(SCHEDULER, "lost connection to the job scheduler"), \
+	DSS_ERROR(TIME_WINDOW, "invalid time window")
 
 /**
  * This is temporarily defined to expand to its first argument (prefixed by
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/**
+ * \file event.c Wait for file descriptors and a deadline.
+ *
+ * The main loop of dss waits for output of rsync, for signals and for the
+ * next point in time at which something is due. This is implemented with an
+ * epoll instance which contains the watched file descriptors and a timerfd.
+ * The timerfd is armed with the next deadline before each wait, so an idle
+ * dss process sleeps until exactly this time and not longer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "gcc-compat.h"
+#include "log.h"
+#include "err.h"
+#include "event.h"
+
+/* The maximal number of events returned by one call to epoll_wait(). */
+#define MAX_EVENTS 16
+
+static int epoll_fd = -1;
+static int timer_fd = -1;
+
+/**
+ * Create the epoll instance and the timer.
+ *
+ * \return Standard.
+ */
+int event_init(void)
+{
+	int ret;
+
+	if (epoll_fd >= 0)
+		return 1;
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto err;
+	}
+	ret = event_watch(timer_fd);
+	if (ret >= 0)
+		return ret;
+	close(timer_fd);
+	timer_fd = -1;
+err:
+	close(epoll_fd);
+	epoll_fd = -1;
+	return ret;
+}
+
+/**
+ * Watch a file descriptor for reading.
+ *
+ * \param fd The file descriptor to watch.
+ *
+ * It is not an error if \a fd is already being watched.
+ *
+ * \return Standard.
+ */
+int event_watch(int fd)
+{
+	struct epoll_event ev = {.events = EPOLLIN, .data = {.fd = fd}};
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0 && errno != EEXIST)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	return 1;
+}
+
+/**
+ * Stop watching a file descriptor.
+ *
+ * \param fd The file descriptor.
+ *
+ * This must be called before \a fd is closed. Otherwise the epoll instance
+ * keeps watching the file as long as another process, e.g. a child, holds a
+ * copy of \a fd.
+ */
+void event_unwatch(int fd)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/**
+ * Wait until a watched file descriptor becomes readable or a deadline passes.
+ *
+ * \param deadline Seconds since the epoch, or zero for no deadline.
+ * \param ready The readable file descriptors are returned here.
+ *
+ * \return The number of readable file descriptors, which is zero if the
+ * deadline passed, or a negative error code.
+ */
+int event_wait(int64_t deadline, fd_set *ready)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct itimerspec its;
+	uint64_t expirations;
+	int i, n, num_ready = 0;
+
+	memset(&its, 0, sizeof(its));
+	/* a zero it_value disarms the timer, and deadlines in the past fire */
+	its.it_value.tv_sec = deadline > 0? deadline : 0;
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	do
+		n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+	while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	FD_ZERO(ready);
+	for (i = 0; i < n; i++) {
+		int fd = events[i].data.fd;
+
+		if (fd == timer_fd) {
+			if (read(timer_fd, &expirations, sizeof(expirations)) < 0)
+				assert(errno == EAGAIN);
+			continue;
+		}
+		FD_SET(fd, ready);
+		num_ready++;
+	}
+	return num_ready;
+}
@@ -0,0 +1,12 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/** \file event.h The event loop primitives, see event.c. */
+
+int event_init(void);
+int event_watch(int fd);
+void event_unwatch(int fd);
+int event_wait(int64_t deadline, fd_set *ready);
@@ -6,56 +6,638 @@
 
 /** \file exec.c Helper functions for spawning new processes. */
 
+#define _GNU_SOURCE /* environ, posix_spawn_file_actions_addclosefrom_np() */
 #include <string.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <inttypes.h>
+#include <sys/select.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 
 #include "gcc-compat.h"
 #include "log.h"
 #include "err.h"
 #include "str.h"
+#include "file.h"
+#include "sig.h"
+#include "tv.h"
 #include "exec.h"
 
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 34)
+#define HAVE_SPAWN_CLOSEFROM 1
+#else
+#define HAVE_SPAWN_CLOSEFROM 0
+#endif
+
+/** A child process which has not been reaped yet. */
+struct child {
+	/** As returned by fork() or posix_spawn(). */
+	pid_t pid;
+	/** Becomes readable when the child exits, -1 if not supported. */
+	int pidfd;
+	/** The executable, or "dss" for children which do not exec. */
+	char *name;
+	/** When the parent started to create the child. */
+	struct timeval start;
+	/** How long it took to create the child, in microseconds. */
+	int64_t spawn_usec;
+};
+
+/** Resource usage of a child which has been reaped. */
+struct child_stats {
+	/** The pid of the child. */
+	pid_t pid;
+	/** See \ref child. */
+	char *name;
+	/** As returned by wait4(). */
+	int status;
+	/** See \ref child. */
+	int64_t spawn_usec;
+	/** Time between the start and the reaping of the child. */
+	long unsigned wall_ms;
+	/** User CPU time of the child. */
+	long unsigned user_ms;
+	/** System CPU time of the child. */
+	long unsigned sys_ms;
+	/** Maximal resident set size of the child, in KiB. */
+	long max_rss;
+};
+
+static struct child *children;
+static unsigned num_children;
+
+/* The most recently reaped children, for the state dump. */
+#define NUM_RECENT_CHILDREN 8
+static struct child_stats recent_children[NUM_RECENT_CHILDREN];
+static unsigned num_reaped;
+static int64_t total_spawn_usec, max_spawn_usec;
+
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	/* The child is not reaped yet, so its pid can not have been reused. */
+	int fd = syscall(SYS_pidfd_open, pid, 0);
+
+	if (fd >= 0)
+		return fd;
+	DSS_DEBUG_LOG(("pidfd_open: %s\n", strerror(errno)));
+#endif
+	return -1;
+}
+
 /**
- * Spawn a new process using execvp().
+ * Find out whether exits of children are reported through pidfds.
  *
- * \param pid Will hold the pid of the created process upon return.
- * \param file Path of the executable to execute.
- * \param args The argument array for the command.
+ * This requires Linux 5.3 or newer. If it returns false, the caller must catch
+ * SIGCHLD to learn about the exit of a child.
+ *
+ * \return Non-zero if pidfds are supported.
+ */
+int pidfds_supported(void)
+{
+	static int supported = -1;
+
+	if (supported < 0) {
+		int fd = open_pidfd(getpid());
+
+		supported = fd >= 0;
+		if (fd >= 0)
+			close(fd);
+	}
+	return supported;
+}
+
+static void register_child(pid_t pid, const char *name,
+		const struct timeval *start)
+{
+	struct child *c;
+	struct timeval now, diff;
+
+	gettimeofday(&now, NULL);
+	children = dss_realloc(children, (num_children + 1)
+		* sizeof(struct child));
+	c = children + num_children++;
+	c->pid = pid;
+	c->pidfd = open_pidfd(pid);
+	c->name = dss_strdup(name);
+	c->start = *start;
+	tv_diff(&now, start, &diff);
+	c->spawn_usec = (int64_t)diff.tv_sec * 1000000 + diff.tv_usec;
+	total_spawn_usec += c->spawn_usec;
+	if (c->spawn_usec > max_spawn_usec)
+		max_spawn_usec = c->spawn_usec;
+	DSS_DEBUG_LOG(("started %s as pid %d in %" PRId64 "us\n", name,
+		(int)pid, c->spawn_usec));
+}
+
+static void unregister_child(unsigned n)
+{
+	struct child *c = children + n;
+
+	if (c->pidfd >= 0)
+		close(c->pidfd);
+	free(c->name);
+	memmove(c, c + 1, (--num_children - n) * sizeof(struct child));
+}
+
+/*
+ * A forked child inherits the list of children of its parent, but it can not
+ * wait for them.
+ */
+static void forget_children(void)
+{
+	while (num_children > 0)
+		unregister_child(num_children - 1);
+	num_reaped = 0;
+}
+
+static void record_exit(unsigned n, int status, const struct rusage *ru)
+{
+	struct child *c = children + n;
+	struct child_stats *cs = recent_children
+		+ num_reaped++ % NUM_RECENT_CHILDREN;
+	struct timeval now, diff;
+
+	gettimeofday(&now, NULL);
+	tv_diff(&now, &c->start, &diff);
+	free(cs->name);
+	cs->pid = c->pid;
+	cs->name = dss_strdup(c->name);
+	cs->status = status;
+	cs->spawn_usec = c->spawn_usec;
+	cs->wall_ms = tv2ms(&diff);
+	cs->user_ms = tv2ms(&ru->ru_utime);
+	cs->sys_ms = tv2ms(&ru->ru_stime);
+	cs->max_rss = ru->ru_maxrss;
+	DSS_DEBUG_LOG(("%s (pid %d): wall %lums, user %lums, sys %lums, "
+		"max rss %ldKiB\n", cs->name, (int)cs->pid, cs->wall_ms,
+		cs->user_ms, cs->sys_ms, cs->max_rss));
+	unregister_child(n);
+}
+
+static void log_exit(pid_t pid, int status)
+{
+	if (WIFEXITED(status))
+		DSS_DEBUG_LOG(("child %i exited. Exit status: %i\n", (int)pid,
+			WEXITSTATUS(status)));
+	else if (WIFSIGNALED(status))
+		DSS_DEBUG_LOG(("child %i was killed by signal %i\n", (int)pid,
+			WTERMSIG(status)));
+	else
+		DSS_WARNING_LOG(("child %i terminated abormally\n", (int)pid));
+}
+
+static int find_child(pid_t pid)
+{
+	unsigned u;
+
+	for (u = 0; u < num_children; u++)
+		if (children[u].pid == pid)
+			return u;
+	return -1;
+}
+
+/**
+ * Wait for a child process and record its resource usage.
+ *
+ * \param pid The child to wait for.
+ * \param status As for waitpid(2), may be \p NULL.
+ * \param options Zero or WNOHANG.
+ *
+ * Unlike waitpid(2), this does not fail with EINTR.
+ *
+ * \return Zero if \a options contains WNOHANG and the child has not exited
+ * yet, one if the child was reaped, negative on errors.
+ */
+int dss_waitpid(pid_t pid, int *status, int options)
+{
+	struct rusage ru;
+	pid_t ret;
+	int st, n = find_child(pid);
+
+	while ((ret = wait4(pid, &st, options, &ru)) < 0) {
+		if (errno == EINTR)
+			continue;
+		if (n >= 0)
+			unregister_child(n);
+		return -ERRNO_TO_DSS_ERROR(errno);
+	}
+	if (ret == 0)
+		return 0;
+	if (status)
+		*status = st;
+	log_exit(pid, st);
+	if (n >= 0)
+		record_exit(n, st, &ru);
+	return 1;
+}
+
+/**
+ * Reap a child which has exited.
+ *
+ * \param ready The readable file descriptors, or \p NULL.
+ * \param pid In case a child died, its pid is returned here.
+ * \param status As for waitpid(2).
+ *
+ * Only children started by the functions of this file are considered, and
+ * each of them is waited for by its pid. If \a ready is not \p NULL, only
+ * the children whose pidfd is contained in \a ready and the children without
+ * a pidfd are checked.
+ *
+ * \return A (negative) error code on errors, zero if no child died, one
+ * otherwise. If and only if the function returns one, the content of \a pid is
+ * meaningful.
+ *
+ * \sa waitpid(2).
+ */
+int reap_child(const fd_set *ready, pid_t *pid, int *status)
+{
+	unsigned u;
+
+	for (u = 0; u < num_children; u++) {
+		struct child *c = children + u;
+		int ret;
+
+		if (ready && c->pidfd >= 0 && !FD_ISSET(c->pidfd, ready))
+			continue;
+		*pid = c->pid;
+		ret = dss_waitpid(*pid, status, WNOHANG);
+		if (ret > 0)
+			return ret;
+		if (ret == -ERRNO_TO_DSS_ERROR(ECHILD)) { /* reaped elsewhere */
+			u--;
+			continue;
+		}
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+/**
+ * Pass the pidfd of each child to a function.
+ *
+ * \param watch Typically adds the pidfd to the set of watched file
+ * descriptors of the event loop.
+ *
+ * Children without a pidfd are skipped.
  *
  * \return Standard.
+ */
+int watch_children(int (*watch)(int fd))
+{
+	unsigned u;
+
+	for (u = 0; u < num_children; u++) {
+		int ret;
+
+		if (children[u].pidfd < 0)
+			continue;
+		ret = watch(children[u].pidfd);
+		if (ret < 0)
+			return ret;
+	}
+	return 1;
+}
+
+/**
+ * Get the pidfd of a child.
+ *
+ * \param pid The child.
  *
- * \sa fork(2), exec(3).
+ * \return The pidfd, or -1 if \a pid is not a child or has no pidfd.
  */
-void dss_exec(pid_t *pid, const char *file, char *const *const args)
+int child_pidfd(pid_t pid)
+{
+	int n = find_child(pid);
+
+	return n < 0? -1 : children[n].pidfd;
+}
+
+/**
+ * Print statistics about the children.
+ *
+ * \param f Where to print to.
+ */
+void dump_children(FILE *f)
+{
+	unsigned u, n = num_reaped < NUM_RECENT_CHILDREN?
+		num_reaped : NUM_RECENT_CHILDREN;
+	unsigned num_spawned = num_reaped + num_children;
+
+	fprintf(f, "children: %u running, %u reaped\n", num_children,
+		num_reaped);
+	if (num_spawned > 0)
+		fprintf(f, "spawn latency: %" PRId64 "us average, %" PRId64
+			"us max\n", total_spawn_usec / num_spawned,
+			max_spawn_usec);
+	for (u = 0; u < num_children; u++)
+		fprintf(f, "running: %s (pid %d, pidfd %d)\n",
+			children[u].name, (int)children[u].pid,
+			children[u].pidfd);
+	for (u = 0; u < n; u++) {
+		const struct child_stats *cs = recent_children
+			+ (num_reaped - 1 - u) % NUM_RECENT_CHILDREN;
+		fprintf(f, "reaped: %s (pid %d, status %#x): spawn %" PRId64
+			"us, wall %lums, user %lums, sys %lums, "
+			"max rss %ldKiB\n", cs->name, (int)cs->pid,
+			(unsigned)cs->status, cs->spawn_usec, cs->wall_ms,
+			cs->user_ms, cs->sys_ms, cs->max_rss);
+	}
+}
+
+/**
+ * Tell whether spawned children may inherit stray descriptors.
+ *
+ * Without posix_spawn_file_actions_addclosefrom_np(), which was added in glibc
+ * 2.34, children inherit every descriptor which lacks the close-on-exec flag,
+ * for example descriptors inherited from the parent of dss. This is logged
+ * once, and only if the fallback is active.
+ */
+void log_spawn_fallback(void)
 {
-	if ((*pid = fork()) < 0) {
+#if !HAVE_SPAWN_CLOSEFROM
+	DSS_NOTICE_LOG(("spawned children inherit all descriptors without "
+		"close-on-exec flag (needs glibc 2.34)\n"));
+#endif
+}
+
+/*
+ * Start a command with posix_spawnp(), which is much faster than fork() for a
+ * parent with a large address space. The child gets the default signal
+ * dispositions and an empty signal mask. If out_fd is not negative, it becomes
+ * stdout of the child, and also stderr if SPAWN_STDERR is set, and stdin if
+ * SPAWN_STDIN is set. If keep_fd is not negative, it becomes descriptor
+ * KEPT_FD of the child. SPAWN_PGROUP puts the child into a new process group.
+ * All other descriptors above stderr are closed, so that the child inherits
+ * only what it needs, even if a descriptor lacks the close-on-exec flag. This
+ * needs glibc 2.34, see \ref log_spawn_fallback().
+ *
+ * If the command can not be started, a child which exits with status one is
+ * created instead, so that callers need only one error path.
+ */
+#define SPAWN_STDERR 1
+#define SPAWN_PGROUP 2
+#define SPAWN_STDIN 4
+
+static void spawn(pid_t *pid, const char *file, char *const *const args,
+		int out_fd, int keep_fd, unsigned flags)
+{
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t set;
+	struct timeval start;
+	int ret, next_fd = STDERR_FILENO + 1;
+
+	gettimeofday(&start, NULL);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF
+		| POSIX_SPAWN_SETSIGMASK
+		| ((flags & SPAWN_PGROUP)? POSIX_SPAWN_SETPGROUP : 0));
+	sigemptyset(&set);
+	posix_spawnattr_setsigmask(&attr, &set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGCHLD);
+	posix_spawnattr_setsigdefault(&attr, &set);
+	posix_spawn_file_actions_init(&fa);
+	if (out_fd >= 0) {
+		posix_spawn_file_actions_adddup2(&fa, out_fd, STDOUT_FILENO);
+		if (flags & SPAWN_STDERR)
+			posix_spawn_file_actions_adddup2(&fa, out_fd,
+				STDERR_FILENO);
+		if (flags & SPAWN_STDIN)
+			posix_spawn_file_actions_adddup2(&fa, out_fd,
+				STDIN_FILENO);
+	}
+	if (keep_fd >= 0) {
+		posix_spawn_file_actions_adddup2(&fa, keep_fd, KEPT_FD);
+		next_fd = KEPT_FD + 1;
+	}
+#if HAVE_SPAWN_CLOSEFROM
+	posix_spawn_file_actions_addclosefrom_np(&fa, next_fd);
+#else
+	(void)next_fd; /* rely on close-on-exec */
+#endif
+	ret = posix_spawnp(pid, file, &fa, &attr, args, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	posix_spawnattr_destroy(&attr);
+	if (ret != 0) {
+		DSS_ERROR_LOG(("can not execute %s: %s\n", file,
+			strerror(ret)));
+		if ((*pid = fork()) < 0) {
+			DSS_EMERG_LOG(("fork error: %s\n", strerror(errno)));
+			exit(EXIT_FAILURE);
+		}
+		if (*pid == 0)
+			_exit(EXIT_FAILURE);
+	}
+	register_child(*pid, file, &start);
+}
+
+/*
+ * Fork, and register the child in the parent. The child forgets about the
+ * children of its parent and restores the default signal handling.
+ */
+static pid_t do_fork(void)
+{
+	struct timeval start;
+	pid_t pid;
+
+	gettimeofday(&start, NULL);
+	if ((pid = fork()) < 0) {
 		DSS_EMERG_LOG(("fork error: %s\n", strerror(errno)));
 		exit(EXIT_FAILURE);
 	}
-	if (*pid) /* parent */
+	if (pid) {
+		register_child(pid, "dss", &start);
+		return pid;
+	}
+	forget_children();
+	reset_signals();
+	return 0;
+}
+
+/**
+ * Spawn a new process using posix_spawnp().
+ *
+ * \param pid Will hold the pid of the created process upon return.
+ * \param file Path of the executable to execute.
+ * \param args The argument array for the command.
+ *
+ * \sa posix_spawn(3).
+ */
+void dss_exec(pid_t *pid, const char *file, char *const *const args)
+{
+	spawn(pid, file, args, -1, -1, 0);
+}
+
+/**
+ * Spawn a new process which inherits one file descriptor.
+ *
+ * \param pid Will hold the pid of the created process upon return.
+ * \param file Path of the executable to execute.
+ * \param args The argument array for the command.
+ * \param fd Becomes descriptor \ref KEPT_FD of the child.
+ *
+ * \sa \ref dss_exec().
+ */
+void dss_exec_keep_fd(pid_t *pid, const char *file, char *const *const args,
+		int fd)
+{
+	spawn(pid, file, args, -1, fd, 0);
+}
+
+/**
+ * Run a function in a child process.
+ *
+ * \param pid Will hold the pid of the created process upon return.
+ * \param func The function to call in the child process.
+ * \param private_data Passed verbatim to \a func.
+ *
+ * The child exits with status zero if \a func returned non-negative, and with
+ * status one otherwise.
+ *
+ * \sa \ref dss_exec().
+ */
+void dss_fork(pid_t *pid, int (*func)(void *), void *private_data)
+{
+	int ret;
+
+	if ((*pid = do_fork())) /* parent */
 		return;
-	signal(SIGINT, SIG_DFL);
-	signal(SIGTERM, SIG_DFL);
-	signal(SIGCHLD, SIG_DFL);
-	execvp(file, args);
-	DSS_EMERG_LOG(("execvp error: %s\n", strerror(errno)));
-	_exit(EXIT_FAILURE);
+	ret = func(private_data);
+	fflush(NULL);
+	_exit(ret < 0? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/*
+ * Create a pipe for the output of a child. The read end is non-blocking and
+ * marked close-on-exec so that it is not inherited by processes started later.
+ */
+static int output_pipe(int pipe_fds[2])
+{
+	int ret;
+
+	if (pipe(pipe_fds) < 0)
+		return -E_DUP_PIPE;
+	fcntl(pipe_fds[0], F_SETFD, FD_CLOEXEC);
+	ret = mark_fd_nonblocking(pipe_fds[0]);
+	if (ret >= 0)
+		return ret;
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+	return ret;
 }
 
 /**
- * Exec the command given as a command line.
+ * Spawn a new process whose stdout and stderr are connected to a pipe.
  *
  * \param pid Will hold the pid of the created process upon return.
- * \param cmdline Holds the command and its arguments, seperated by spaces.
+ * \param fd Will hold the (non-blocking) read end of the pipe upon return.
+ * \param file Path of the executable to execute.
+ * \param args The argument array for the command.
+ *
+ * \return Standard.
+ *
+ * \sa \ref dss_exec(), pipe(2).
+ */
+int dss_exec_pipe(pid_t *pid, int *fd, const char *file, char *const *const args)
+{
+	int pipe_fds[2], ret = output_pipe(pipe_fds);
+
+	if (ret < 0)
+		return ret;
+	spawn(pid, file, args, pipe_fds[1], -1, SPAWN_STDERR);
+	close(pipe_fds[1]);
+	*fd = pipe_fds[0];
+	return 1;
+}
+
+/**
+ * Run a function in a child process whose output is connected to a pipe.
+ *
+ * \param pid Will hold the pid of the created process upon return.
+ * \param fd Will hold the (non-blocking) read end of the pipe upon return.
+ * \param func The function to call in the child process.
+ * \param private_data Passed verbatim to \a func.
+ *
+ * The child exits with status zero if \a func returned non-negative, and with
+ * status one otherwise.
+ *
+ * \return Standard.
+ *
+ * \sa \ref dss_exec_pipe().
+ */
+int dss_fork_pipe(pid_t *pid, int *fd, int (*func)(void *), void *private_data)
+{
+	int pipe_fds[2], ret = output_pipe(pipe_fds);
+
+	if (ret < 0)
+		return ret;
+	if ((*pid = do_fork())) { /* parent */
+		close(pipe_fds[1]);
+		*fd = pipe_fds[0];
+		return 1;
+	}
+	close(pipe_fds[0]);
+	if (dup2(pipe_fds[1], STDOUT_FILENO) < 0 ||
+			dup2(pipe_fds[1], STDERR_FILENO) < 0)
+		_exit(EXIT_FAILURE);
+	close(pipe_fds[1]);
+	ret = func(private_data);
+	fflush(NULL);
+	_exit(ret < 0? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/**
+ * Exec a command line and connect its stdout to a pipe.
+ *
+ * \param pid Will hold the pid of the created process upon return.
+ * \param fd Will hold the read end of the pipe upon return.
+ * \param cmdline As for \ref dss_exec_cmdline_pid().
  *
- * This function uses fork/exec to create a new process.
+ * Unlike \ref dss_exec_pipe(), stderr of the command is not redirected and
+ * the pipe is left blocking, as the command may write binary data to stdout.
  *
  * \return Standard.
  */
+int dss_exec_cmdline_stdout(pid_t *pid, int *fd, const char *cmdline)
+{
+	int pipe_fds[2];
+	char **argv, *tmp;
+
+	if (pipe(pipe_fds) < 0)
+		return -E_DUP_PIPE;
+	fcntl(pipe_fds[0], F_SETFD, FD_CLOEXEC);
+	tmp = dss_strdup(cmdline);
+	split_args(tmp, &argv, " \t");
+	spawn(pid, argv[0], argv, pipe_fds[1], -1, 0);
+	free(argv);
+	free(tmp);
+	close(pipe_fds[1]);
+	*fd = pipe_fds[0];
+	return 1;
+}
+
+/**
+ * Exec the command given as a command line.
+ *
+ * \param pid Will hold the pid of the created process upon return.
+ * \param cmdline Holds the command and its arguments, seperated by spaces.
+ *
+ * \sa \ref dss_exec().
+ */
 void dss_exec_cmdline_pid(pid_t *pid, const char *cmdline)
 {
 	char **argv, *tmp = dss_strdup(cmdline);
@@ -65,3 +647,41 @@ void dss_exec_cmdline_pid(pid_t *pid, const char *cmdline)
 	free(argv);
 	free(tmp);
 }
+
+/**
+ * Exec a command line in a new process group.
+ *
+ * \param pid Will hold the pid of the created process upon return.
+ * \param cmdline As for \ref dss_exec_cmdline_pid().
+ *
+ * The id of the new process group equals \a pid, so the command and all its
+ * children can be signalled with kill(-pid, sig).
+ */
+void dss_exec_cmdline_group(pid_t *pid, const char *cmdline)
+{
+	char **argv, *tmp = dss_strdup(cmdline);
+
+	split_args(tmp, &argv, " \t");
+	spawn(pid, argv[0], argv, -1, -1, SPAWN_PGROUP);
+	free(argv);
+	free(tmp);
+}
+
+/**
+ * Exec a command line whose stdin and stdout are connected to a socket.
+ *
+ * \param pid Will hold the pid of the created process upon return.
+ * \param fd One end of a socket pair, becomes stdin and stdout of the command.
+ * \param cmdline As for \ref dss_exec_cmdline_pid().
+ *
+ * stderr of the command is inherited from dss.
+ */
+void dss_exec_cmdline_stdio(pid_t *pid, int fd, const char *cmdline)
+{
+	char **argv, *tmp = dss_strdup(cmdline);
+
+	split_args(tmp, &argv, " \t");
+	spawn(pid, argv[0], argv, fd, -1, SPAWN_STDIN);
+	free(argv);
+	free(tmp);
+}
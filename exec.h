@@ -1,2 +1,20 @@
+/** The number of the descriptor passed by \ref dss_exec_keep_fd(). */
+#define KEPT_FD 3
+
 void dss_exec(pid_t *pid, const char *file, char *const *const args);
+void dss_exec_keep_fd(pid_t *pid, const char *file, char *const *const args,
+		int fd);
 void dss_exec_cmdline_pid(pid_t *pid, const char *cmdline);
+void dss_exec_cmdline_group(pid_t *pid, const char *cmdline);
+void dss_exec_cmdline_stdio(pid_t *pid, int fd, const char *cmdline);
+int dss_exec_cmdline_stdout(pid_t *pid, int *fd, const char *cmdline);
+int dss_exec_pipe(pid_t *pid, int *fd, const char *file, char *const *const args);
+void dss_fork(pid_t *pid, int (*func)(void *), void *private_data);
+int dss_fork_pipe(pid_t *pid, int *fd, int (*func)(void *), void *private_data);
+int pidfds_supported(void);
+int dss_waitpid(pid_t pid, int *status, int options);
+int reap_child(const fd_set *ready, pid_t *pid, int *status);
+int watch_children(int (*watch)(int fd));
+int child_pidfd(pid_t pid);
+void dump_children(FILE *f);
+void log_spawn_fallback(void);
@@ -4,6 +4,7 @@
  * Licensed under the GPL v2. For licencing details see COPYING.
  */
 
+#define _GNU_SOURCE /* syncfs() */
 #include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
@@ -13,6 +14,8 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <inttypes.h>
 
 #include "gcc-compat.h"
 #include "err.h"
@@ -69,6 +72,217 @@ out:
 	closedir(dir);
 	return ret;
 }
+/**
+ * Call a function for each entry of a directory tree.
+ *
+ * \param dirname The root of the tree.
+ * \param func The function to call for each entry.
+ * \param private_data Passed verbatim to \a func.
+ *
+ * The tree is traversed depth-first. Symbolic links are not followed. \a func
+ * is called with the path of the entry (\a dirname followed by the path of the
+ * entry relative to \a dirname), the result of lstat(2) and \a private_data.
+ * Directories are passed to \a func before their contents. If \a func returns
+ * zero for a directory, this directory is not descended into.
+ *
+ * \return If \a func returns a negative value, the traversal stops and this
+ * value is returned. Otherwise the function returns positive if the whole tree
+ * was traversed, and negative if a directory could not be read.
+ */
+int for_each_file_in_tree(const char *dirname,
+		int (*func)(const char *, const struct stat *, void *),
+		void *private_data)
+{
+	struct dirent *entry;
+	int ret;
+	DIR *dir = opendir(dirname);
+
+	if (!dir)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	ret = 1;
+	while ((entry = readdir(dir))) {
+		struct stat s;
+		char *path;
+
+		if (!strcmp(entry->d_name, "."))
+			continue;
+		if (!strcmp(entry->d_name, ".."))
+			continue;
+		path = make_message("%s/%s", dirname, entry->d_name);
+		if (lstat(path, &s) < 0) { /* vanished, ignore */
+			free(path);
+			continue;
+		}
+		ret = func(path, &s, private_data);
+		if (ret > 0 && S_ISDIR(s.st_mode))
+			ret = for_each_file_in_tree(path, func, private_data);
+		free(path);
+		if (ret < 0)
+			break;
+		ret = 1;
+	}
+	closedir(dir);
+	return ret;
+}
+
+/**
+ * Write all modified data of a file system to disk.
+ *
+ * \param path Any file or directory of the file system.
+ *
+ * \return Standard.
+ *
+ * \sa syncfs(2).
+ */
+int dss_syncfs(const char *path)
+{
+	int ret, fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	ret = syncfs(fd) < 0? -ERRNO_TO_DSS_ERROR(errno) : 1;
+	close(fd);
+	return ret;
+}
+
+/**
+ * Make the entries of a directory persistent.
+ *
+ * \param path The directory to sync.
+ *
+ * After a rename(2), both the old and the new parent directory must be synced
+ * to be sure that the rename survives a crash.
+ *
+ * \return Standard.
+ */
+int dss_fsync_dir(const char *path)
+{
+	int ret, fd = open(path, O_RDONLY | O_DIRECTORY);
+
+	if (fd < 0)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	ret = fsync(fd) < 0? -ERRNO_TO_DSS_ERROR(errno) : 1;
+	close(fd);
+	return ret;
+}
+
+/**
+ * Compute the total size of the regular files in a directory.
+ *
+ * \param dirname The directory to look at.
+ * \param size Result pointer.
+ *
+ * Subdirectories are not descended into. A nonexistent directory has size
+ * zero.
+ *
+ * \return Standard.
+ */
+int get_dir_size(const char *dirname, int64_t *size)
+{
+	struct dirent *entry;
+	DIR *dir = opendir(dirname);
+
+	*size = 0;
+	if (!dir)
+		return errno == ENOENT? 0 : -ERRNO_TO_DSS_ERROR(errno);
+	while ((entry = readdir(dir))) {
+		struct stat s;
+		char *path = make_message("%s/%s", dirname, entry->d_name);
+
+		if (lstat(path, &s) == 0 && S_ISREG(s.st_mode))
+			*size += s.st_size;
+		free(path);
+	}
+	closedir(dir);
+	return 1;
+}
+
+/**
+ * Remove a directory and the files it contains.
+ *
+ * \param dirname The directory to remove.
+ *
+ * Unlike rm -rf, this does not descend into subdirectories, hence fails if
+ * \a dirname contains a directory. It is not an error if \a dirname does not
+ * exist.
+ *
+ * \return Standard.
+ */
+int remove_flat_dir(const char *dirname)
+{
+	struct dirent *entry;
+	DIR *dir = opendir(dirname);
+	int ret;
+
+	if (!dir)
+		return errno == ENOENT? 0 : -ERRNO_TO_DSS_ERROR(errno);
+	while ((entry = readdir(dir))) {
+		char *path;
+
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+		path = make_message("%s/%s", dirname, entry->d_name);
+		ret = unlink(path);
+		free(path);
+		if (ret < 0) {
+			ret = -ERRNO_TO_DSS_ERROR(errno);
+			closedir(dir);
+			return ret;
+		}
+	}
+	closedir(dir);
+	if (rmdir(dirname) < 0)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	return 1;
+}
+
+/**
+ * Remove a file or a directory tree.
+ *
+ * \param path The file or directory to remove.
+ *
+ * This is the equivalent of rm -rf. Symbolic links are removed, not followed.
+ * It is not an error if \a path does not exist.
+ *
+ * \return Standard.
+ */
+int remove_tree(const char *path)
+{
+	struct dirent *entry;
+	struct stat s;
+	DIR *dir;
+	int ret;
+
+	if (lstat(path, &s) < 0)
+		return errno == ENOENT? 0 : -ERRNO_TO_DSS_ERROR(errno);
+	if (!S_ISDIR(s.st_mode)) {
+		if (unlink(path) < 0)
+			return -ERRNO_TO_DSS_ERROR(errno);
+		return 1;
+	}
+	dir = opendir(path);
+	if (!dir)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	ret = 1;
+	while ((entry = readdir(dir))) {
+		char *sub;
+
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+		sub = make_message("%s/%s", path, entry->d_name);
+		ret = remove_tree(sub);
+		free(sub);
+		if (ret < 0)
+			break;
+	}
+	closedir(dir);
+	if (ret < 0)
+		return ret;
+	if (rmdir(path) < 0)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	return 1;
+}
+
 /**
  * Wrapper for chdir(2).
  *
@@ -131,3 +345,55 @@ int dss_select(int n, fd_set *readfds, fd_set *writefds,
 		return -ERRNO_TO_DSS_ERROR(errno);
 	return ret;
 }
+
+/**
+ * Read from a non-blocking fd and pass each complete line to a handler.
+ *
+ * \param fd The file descriptor to read from.
+ * \param lb Holds the incomplete last line between calls.
+ * \param line_handler Called with each line, without the trailing newline.
+ * \param private_data Passed verbatim to \a line_handler.
+ *
+ * Both '\n' and '\r' terminate a line. Lines which do not fit into the
+ * buffer of \a lb are split. At end of file, an incomplete last line is
+ * passed to \a line_handler as well.
+ *
+ * \return Negative on errors, zero on end of file, positive if more data may
+ * become available later.
+ */
+int read_lines(int fd, struct line_buffer *lb,
+		void (*line_handler)(char *, void *), void *private_data)
+{
+	for (;;) {
+		char *p, *end;
+		ssize_t n = read(fd, lb->buf + lb->len, sizeof(lb->buf) - 1 - lb->len);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 1;
+			return -ERRNO_TO_DSS_ERROR(errno);
+		}
+		lb->len += n;
+		lb->buf[lb->len] = '\0';
+		p = lb->buf;
+		while ((end = strpbrk(p, "\n\r"))) {
+			*end = '\0';
+			if (*p)
+				line_handler(p, private_data);
+			p = end + 1;
+		}
+		lb->len -= p - lb->buf;
+		memmove(lb->buf, p, lb->len);
+		if (n == 0 || lb->len == sizeof(lb->buf) - 1) {
+			/* EOF or buffer full, flush the partial line */
+			lb->buf[lb->len] = '\0';
+			if (lb->len > 0)
+				line_handler(lb->buf, private_data);
+			lb->len = 0;
+			if (n == 0)
+				return 0;
+		}
+	}
+}
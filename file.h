@@ -5,6 +5,15 @@
  */
 int dss_chdir(const char *path);
 int for_each_subdir(int (*func)(const char *, void *), void *private_data);
+struct stat;
+int for_each_file_in_tree(const char *dirname,
+		int (*func)(const char *, const struct stat *, void *),
+		void *private_data);
+int get_dir_size(const char *dirname, int64_t *size);
+int remove_flat_dir(const char *dirname);
+int remove_tree(const char *path);
+int dss_syncfs(const char *path);
+int dss_fsync_dir(const char *path);
 __must_check int mark_fd_nonblocking(int fd);
 /**
  * A wrapper for rename(2).
@@ -25,3 +34,14 @@ _static_inline_ int dss_rename(const char *old_path, const char *new_path)
 
 int dss_select(int n, fd_set *readfds, fd_set *writefds,
 		struct timeval *timeout_tv);
+
+/** Buffer for \ref read_lines(). */
+struct line_buffer {
+	/** Holds the incomplete last line. */
+	char buf[4096];
+	/** Number of bytes in \a buf. */
+	size_t len;
+};
+
+int read_lines(int fd, struct line_buffer *lb,
+		void (*line_handler)(char *, void *), void *private_data);
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/**
+ * \file hook.c Hook processes with timeouts.
+ *
+ * Each hook runs in a process group of its own. If it is still running when
+ * its timeout expires, the whole group is killed, so that also the processes
+ * started by the hook go away.
+ *
+ * Synchronous hooks are waited for by the state machine of dss, which decides
+ * what to do next from their exit status. Asynchronous hooks run in the
+ * background, and only their exit is logged.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+
+#include "gcc-compat.h"
+#include "log.h"
+#include "err.h"
+#include "str.h"
+#include "tv.h"
+#include "exec.h"
+#include "hook.h"
+
+/** A hook process which has not been reaped yet. */
+struct hook {
+	/** Also the id of the process group of the hook. */
+	pid_t pid;
+	/** For log messages, e.g. "pre-create hook". */
+	const char *name;
+	/** When the hook was started. */
+	int64_t start;
+	/** When the hook is killed, zero means never. */
+	int64_t deadline;
+	/** Whether the exit status matters. */
+	int async;
+	/** Whether the hook has been killed because of its timeout. */
+	int timed_out;
+};
+
+static struct hook *hooks;
+static unsigned num_hooks;
+/* Statistics for the state dump. */
+static unsigned num_timeouts, num_async;
+
+/**
+ * Start a hook in a new process group.
+ *
+ * \param pid Will hold the pid of the hook upon return.
+ * \param name The name of the hook, must stay valid.
+ * \param cmdline The command and its arguments, separated by spaces.
+ * \param timeout Seconds, zero means no timeout.
+ * \param async Whether the caller does not wait for the hook.
+ *
+ * The exit of the hook must be reported with \ref hook_exited().
+ */
+void run_hook(pid_t *pid, const char *name, const char *cmdline,
+		int timeout, int async)
+{
+	struct hook *h;
+
+	dss_exec_cmdline_group(pid, cmdline);
+	hooks = dss_realloc(hooks, (num_hooks + 1) * sizeof(struct hook));
+	h = hooks + num_hooks++;
+	h->pid = *pid;
+	h->name = name;
+	h->start = get_current_time();
+	h->deadline = timeout > 0? h->start + timeout : 0;
+	h->async = async;
+	h->timed_out = 0;
+	if (async)
+		num_async++;
+}
+
+/**
+ * Forget about a hook which has exited.
+ *
+ * \param pid The pid of a child which has been reaped.
+ * \param status Its exit status.
+ *
+ * The exit of an asynchronous hook is logged here.
+ *
+ * \return See \ref hook_exit.
+ */
+enum hook_exit hook_exited(pid_t pid, int status)
+{
+	unsigned u;
+	enum hook_exit ret;
+
+	for (u = 0; u < num_hooks; u++)
+		if (hooks[u].pid == pid)
+			break;
+	if (u == num_hooks)
+		return HE_NOT_A_HOOK;
+	if (hooks[u].async) {
+		ret = HE_ASYNC;
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			DSS_NOTICE_LOG(("%s (pid %d) failed\n", hooks[u].name,
+				(int)pid));
+	} else
+		ret = hooks[u].timed_out? HE_TIMED_OUT : HE_NORMAL;
+	memmove(hooks + u, hooks + u + 1,
+		(--num_hooks - u) * sizeof(struct hook));
+	return ret;
+}
+
+/**
+ * Kill the process group of each hook whose timeout has expired.
+ *
+ * \return The next point in time at which a hook times out, zero if no hook
+ * has a timeout.
+ */
+int64_t kill_expired_hooks(void)
+{
+	int64_t next = 0, now = get_current_time();
+	unsigned u;
+
+	for (u = 0; u < num_hooks; u++) {
+		struct hook *h = hooks + u;
+
+		if (h->timed_out || h->deadline == 0)
+			continue;
+		if (h->deadline > now) {
+			if (next == 0 || h->deadline < next)
+				next = h->deadline;
+			continue;
+		}
+		DSS_ERROR_LOG(("%s (pid %d) timed out after %" PRId64
+			"s, killing it\n", h->name, (int)h->pid,
+			now - h->start));
+		/* the group exists as long as the leader is not reaped */
+		if (kill(-h->pid, SIGKILL) < 0)
+			DSS_WARNING_LOG(("kill: %s\n", strerror(errno)));
+		h->timed_out = 1;
+		num_timeouts++;
+	}
+	return next;
+}
+
+/**
+ * Print the running hooks.
+ *
+ * \param f Where to print to.
+ */
+void dump_hooks(FILE *f)
+{
+	int64_t now = get_current_time();
+	unsigned u;
+
+	fprintf(f, "hooks: %u running, %u started in the background, "
+		"%u timed out\n", num_hooks, num_async, num_timeouts);
+	for (u = 0; u < num_hooks; u++) {
+		const struct hook *h = hooks + u;
+
+		fprintf(f, "%s: pid %d, running for %" PRId64 "s", h->name,
+			(int)h->pid, now - h->start);
+		if (h->timed_out)
+			fprintf(f, ", killed");
+		else if (h->deadline)
+			fprintf(f, ", timeout in %" PRId64 "s",
+				h->deadline - now);
+		fprintf(f, "%s\n", h->async? ", in the background" : "");
+	}
+}
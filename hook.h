@@ -0,0 +1,25 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/** \file hook.h Hook processes with timeouts, see hook.c. */
+
+/** How a process terminated, as returned by \ref hook_exited(). */
+enum hook_exit {
+	/** The process was not started by \ref run_hook(). */
+	HE_NOT_A_HOOK,
+	/** An asynchronous hook, nobody waits for its exit status. */
+	HE_ASYNC,
+	/** A synchronous hook which terminated by itself. */
+	HE_NORMAL,
+	/** A synchronous hook which was killed because of its timeout. */
+	HE_TIMED_OUT,
+};
+
+void run_hook(pid_t *pid, const char *name, const char *cmdline,
+		int timeout, int async);
+enum hook_exit hook_exited(pid_t pid, int status);
+int64_t kill_expired_hooks(void);
+void dump_hooks(FILE *f);
@@ -75,17 +75,22 @@ static uint32_t super_fast_hash(const uint8_t *data, uint32_t len, uint32_t hash
 	return hash;
 }
 
-/*
+/**
  * Return the canonical absolute name of a given file name.
  *
+ * \param name The file name to resolve.
+ * \param resolved_path Result pointer.
+ *
  * Slightly modified version of glibc's realpath, Copyright (C)
  * 1996-2002,2004,2005,2006,2008 Free Software Foundation, Inc.
  *
  * A canonical name does not contain any `.', `..' components nor any repeated
  * path separators ('/') or symlinks. All path components must exist. The
  * result is malloc'd and must be freed by the caller.
+ *
+ * \return Standard.
  */
-static int dss_realpath(const char *name, char **resolved_path)
+int dss_realpath(const char *name, char **resolved_path)
 {
 	char *rpath = NULL, *dest, *extra_buf = NULL;
 	const char *start, *end, *rpath_limit;
@@ -358,3 +363,293 @@ int get_dss_pid(char *config_file, pid_t *pid)
 		return -E_NOT_RUNNING;
 	return 1;
 }
+
+/*
+ * Per file system I/O tokens.
+ *
+ * All dss instances whose dest dir lives on the same file system share one
+ * semaphore set. Its key is derived from the device number of the file system.
+ * The set contains a mutex, a ticket counter and, for each token type, the
+ * number of tokens in use and a fixed number of queue positions.
+ *
+ * A waiting instance occupies a free queue position by setting the semaphore
+ * of the position to its ticket number. Since this is done with SEM_UNDO, the
+ * position is freed automatically if the instance dies. An instance may take
+ * a token only if no other queued instance holds an older ticket. Tokens in
+ * use are also counted with SEM_UNDO, so tokens of dead instances are
+ * returned as well. All values start at zero, so the set needs no
+ * initialization.
+ */
+
+enum io_sem {
+	IO_SEM_MUTEX,
+	IO_SEM_TICKET,
+	IO_SEM_FIRST_TOKEN,
+};
+
+/* The number of instances which can queue for each token type. */
+#define IO_QUEUE_LEN 64
+/* Ticket numbers wrap around here, which must be below SEMVMX. */
+#define IO_TICKET_MAX 30000
+#define IO_SEMS_PER_TOKEN (1 + IO_QUEUE_LEN)
+#define IO_NUM_SEMS (IO_SEM_FIRST_TOKEN + NUM_IO_TOKENS * IO_SEMS_PER_TOKEN)
+
+static const char * const io_token_names[] = {
+	[IO_RSYNC] = "rsync",
+	[IO_REMOVE] = "removal",
+};
+
+static struct {
+	int semid;
+	dev_t dev;
+	/* Queue position of this instance, or -1. */
+	int pos[NUM_IO_TOKENS];
+	int ticket[NUM_IO_TOKENS];
+	int holding[NUM_IO_TOKENS];
+} io = {.semid = -1, .pos = {-1, -1}};
+
+static inline int in_use_sem(enum io_token t)
+{
+	return IO_SEM_FIRST_TOKEN + t * IO_SEMS_PER_TOKEN;
+}
+
+static inline int queue_sem(enum io_token t, int pos)
+{
+	return in_use_sem(t) + 1 + pos;
+}
+
+/* Nonzero if ticket a was drawn before ticket b, modulo wrap-around. */
+static int ticket_before(int a, int b)
+{
+	int diff = (b - a + IO_TICKET_MAX) % IO_TICKET_MAX;
+
+	return diff != 0 && diff < IO_TICKET_MAX / 2;
+}
+
+/*
+ * The semaphore set belongs to the file system of the dest dir, which may
+ * change on SIGHUP. The set is only swapped while this instance neither holds
+ * nor waits for a token of the old one.
+ */
+static int get_io_semaphores(void)
+{
+	struct stat st;
+	char *name;
+	int ret, key, t;
+
+	if (stat(".", &st) < 0)
+		return io.semid >= 0? 1 : -ERRNO_TO_DSS_ERROR(errno);
+	if (io.semid >= 0) {
+		if (st.st_dev == io.dev)
+			return 1;
+		for (t = 0; t < NUM_IO_TOKENS; t++)
+			if (io.holding[t] || io.pos[t] >= 0)
+				return 1;
+		DSS_INFO_LOG(("dest dir moved to device %llx\n",
+			(unsigned long long)st.st_dev));
+	}
+	name = make_message("dss io tokens of device %llx",
+		(unsigned long long)st.st_dev);
+	key = super_fast_hash((uint8_t *)name, strlen(name), 0) >> 1;
+	free(name);
+	DSS_DEBUG_LOG(("getting io semaphores 0x%x\n", key));
+	ret = semget(key, IO_NUM_SEMS, IPC_CREAT | 0600);
+	if (ret < 0)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	io.semid = ret;
+	io.dev = st.st_dev;
+	return 1;
+}
+
+static int io_semop(int sem_num, int op, int flags)
+{
+	struct sembuf sop = {.sem_num = sem_num, .sem_op = op,
+		.sem_flg = flags};
+
+	return do_semop(io.semid, &sop, 1);
+}
+
+static int io_lock(void)
+{
+	struct sembuf sops[2] = {
+		{.sem_num = IO_SEM_MUTEX, .sem_op = 0, .sem_flg = SEM_UNDO},
+		{.sem_num = IO_SEM_MUTEX, .sem_op = 1, .sem_flg = SEM_UNDO},
+	};
+
+	return do_semop(io.semid, sops, 2);
+}
+
+static void io_unlock(void)
+{
+	io_semop(IO_SEM_MUTEX, -1, SEM_UNDO);
+}
+
+/* Called with the mutex held. */
+static int io_enqueue(enum io_token t)
+{
+	int pos, ticket = semctl(io.semid, IO_SEM_TICKET, GETVAL);
+
+	if (ticket < 0)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	for (pos = 0; pos < IO_QUEUE_LEN; pos++)
+		if (semctl(io.semid, queue_sem(t, pos), GETVAL) == 0)
+			break;
+	if (pos == IO_QUEUE_LEN) /* queue full, try again later */
+		return 0;
+	/* the semaphore of a queue position holds the ticket plus one */
+	if (io_semop(queue_sem(t, pos), ticket + 1, SEM_UNDO) < 0)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	if (ticket + 1 >= IO_TICKET_MAX)
+		io_semop(IO_SEM_TICKET, -ticket, 0);
+	else
+		io_semop(IO_SEM_TICKET, 1, 0);
+	io.pos[t] = pos;
+	io.ticket[t] = ticket;
+	DSS_DEBUG_LOG(("queued for %s token at position %d, ticket %d\n",
+		io_token_names[t], pos, ticket));
+	return 1;
+}
+
+/* Called with the mutex held. */
+static void io_dequeue(enum io_token t)
+{
+	if (io.pos[t] < 0)
+		return;
+	io_semop(queue_sem(t, io.pos[t]), -(io.ticket[t] + 1), SEM_UNDO);
+	io.pos[t] = -1;
+}
+
+/* Called with the mutex held. */
+static int io_is_first(enum io_token t)
+{
+	int pos, val;
+
+	for (pos = 0; pos < IO_QUEUE_LEN; pos++) {
+		if (pos == io.pos[t])
+			continue;
+		val = semctl(io.semid, queue_sem(t, pos), GETVAL);
+		if (val > 0 && ticket_before(val - 1, io.ticket[t]))
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * Try to get an I/O token of the dest file system.
+ *
+ * \param t The type of token.
+ * \param max The maximal number of tokens of this type in use.
+ *
+ * If no token is available, the caller is queued and should call this
+ * function again later. Tokens are handed out in the order of the first calls.
+ *
+ * \return Positive if the caller holds a token, zero if not, negative on
+ * errors. If \a max is not positive, this function always succeeds.
+ */
+int io_token_acquire(enum io_token t, int max)
+{
+	int ret, in_use;
+
+	if (max <= 0 || io.holding[t])
+		return 1;
+	ret = get_io_semaphores();
+	if (ret < 0)
+		return ret;
+	ret = io_lock();
+	if (ret < 0)
+		return ret;
+	if (io.pos[t] < 0) {
+		ret = io_enqueue(t);
+		if (ret <= 0)
+			goto out;
+	}
+	ret = 0;
+	in_use = semctl(io.semid, in_use_sem(t), GETVAL);
+	if (in_use < 0 || in_use >= max || !io_is_first(t))
+		goto out;
+	ret = io_semop(in_use_sem(t), 1, SEM_UNDO);
+	if (ret < 0)
+		goto out;
+	io_dequeue(t);
+	io.holding[t] = 1;
+	DSS_INFO_LOG(("got %s token (%d/%d in use)\n", io_token_names[t],
+		in_use + 1, max));
+	ret = 1;
+out:
+	io_unlock();
+	return ret;
+}
+
+/**
+ * Return an I/O token.
+ *
+ * \param t The type of token.
+ *
+ * It is not an error to call this if no token of this type is held.
+ */
+void io_token_release(enum io_token t)
+{
+	if (!io.holding[t])
+		return;
+	io_semop(in_use_sem(t), -1, SEM_UNDO);
+	io.holding[t] = 0;
+	DSS_DEBUG_LOG(("released %s token\n", io_token_names[t]));
+}
+
+/**
+ * Leave the queue for an I/O token.
+ *
+ * \param t The type of token.
+ *
+ * This is a no-op if the caller is not queued.
+ */
+void io_token_cancel(enum io_token t)
+{
+	if (io.pos[t] < 0 || io_lock() < 0)
+		return;
+	io_dequeue(t);
+	io_unlock();
+}
+
+/**
+ * Whether this instance waits for an I/O token.
+ *
+ * \return Nonzero if the caller is queued for any type of token.
+ */
+int io_token_waiting(void)
+{
+	int t;
+
+	for (t = 0; t < NUM_IO_TOKENS; t++)
+		if (io.pos[t] >= 0)
+			return 1;
+	return 0;
+}
+
+/**
+ * Print the tokens in use and the queue of waiting instances.
+ *
+ * \param f Where to print to.
+ */
+void io_token_dump(FILE *f)
+{
+	int t, pos, val;
+
+	if (io.semid < 0)
+		return;
+	for (t = 0; t < NUM_IO_TOKENS; t++) {
+		fprintf(f, "%s tokens in use on device %llx: %d%s\n",
+			io_token_names[t], (unsigned long long)io.dev,
+			semctl(io.semid, in_use_sem(t), GETVAL),
+			io.holding[t]? " (including this instance)" : "");
+		for (pos = 0; pos < IO_QUEUE_LEN; pos++) {
+			val = semctl(io.semid, queue_sem(t, pos), GETVAL);
+			if (val <= 0)
+				continue;
+			fprintf(f, "%s queue: pid %d, ticket %d%s\n",
+				io_token_names[t],
+				semctl(io.semid, queue_sem(t, pos), GETPID),
+				val - 1, pos == io.pos[t]? " (this instance)" : "");
+		}
+	}
+}
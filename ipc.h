@@ -1,2 +1,19 @@
+int dss_realpath(const char *name, char **resolved_path);
 int lock_dss(char *config_file);
 int get_dss_pid(char *config_file, pid_t *pid);
+
+/** I/O operations which are limited per dest file system. */
+enum io_token {
+	/** Running rsync and the passes which follow it. */
+	IO_RSYNC,
+	/** Removing a snapshot. */
+	IO_REMOVE,
+	/** Not a token, the number of token types. */
+	NUM_IO_TOKENS
+};
+
+int io_token_acquire(enum io_token t, int max);
+void io_token_release(enum io_token t);
+void io_token_cancel(enum io_token t);
+int io_token_waiting(void);
+void io_token_dump(FILE *f);
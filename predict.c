@@ -0,0 +1,330 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/**
+ * \file predict.c Predict how long the next snapshot will take.
+ *
+ * To create the 2^(n-1) snapshots per unit interval which the aging policy
+ * needs, dss must start each snapshot early enough for it to complete within
+ * its share of the unit interval. This requires an estimate of the duration of
+ * the next snapshot.
+ *
+ * The plain average over all snapshots is a poor estimate: the first, full
+ * snapshot usually takes much longer than all later ones, and the duration
+ * depends on the load of the source and the dest host, which follows a daily
+ * and weekly pattern. Hence the model combines three parts:
+ *
+ *	- an exponentially weighted moving average (EWMA), which forgets
+ *	old samples,
+ *
+ *	- a high percentile of the recent samples, so that a typical
+ *	snapshot completes in time, not just an average one,
+ *
+ *	- a profile which keeps an EWMA for each hour of the week. The
+ *	ratio of this EWMA and the overall EWMA tells how much slower or
+ *	faster snapshots started in this hour are. The EWMA of an hour
+ *	starts at the overall EWMA, so a single sample does not dominate
+ *	it. Each sample is divided
+ *	by the ratio of its hour before the percentile is computed, and
+ *	the percentile is multiplied by the ratio of the hour in which
+ *	the next snapshot is going to be started.
+ *
+ * The samples are stored in a history file in the dest dir. The model is
+ * rebuilt from this file at startup, and whenever the oldest sample is
+ * dropped, so the averages only reflect the retained samples.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gcc-compat.h"
+#include "log.h"
+#include "err.h"
+#include "str.h"
+#include "file.h"
+#include "predict.h"
+
+/** The history file, relative to the dest dir. */
+#define HISTORY_FILE ".dss-durations"
+
+/* Older samples are dropped from the history file. */
+#define MAX_SAMPLES 256
+
+/* The percentile is computed over this many of the most recent samples. */
+#define RECENT_SAMPLES 32
+
+/* The weight of a new sample in the moving averages. */
+#define EWMA_WEIGHT 0.2
+
+/* An hour of the week needs this many samples to affect the prediction. */
+#define MIN_HOUR_SAMPLES 2
+
+/**
+ * Free the resources of a duration model.
+ *
+ * \param dm The model to free.
+ *
+ * The model is reset to the empty model.
+ */
+void free_duration_model(struct duration_model *dm)
+{
+	free(dm->samples);
+	memset(dm, 0, sizeof(*dm));
+}
+
+static int hour_of_week(int64_t t)
+{
+	time_t t_copy = (time_t)t;
+	struct tm t_tm;
+
+	if (!localtime_r(&t_copy, &t_tm))
+		return 0;
+	return t_tm.tm_wday * 24 + t_tm.tm_hour;
+}
+
+static double update_ewma(double avg, unsigned count, int64_t x)
+{
+	if (count == 0)
+		return x;
+	return avg + EWMA_WEIGHT * (x - avg);
+}
+
+/* Feed a sample into the averages. n is the number of samples seen before. */
+static void update_averages(struct duration_model *dm, unsigned n,
+		const struct duration_sample *ds)
+{
+	int h = hour_of_week(ds->start);
+
+	if (dm->hour_count[h] == 0)
+		dm->hour_ewma[h] = n > 0? dm->ewma : ds->duration;
+	dm->hour_ewma[h] += EWMA_WEIGHT * (ds->duration - dm->hour_ewma[h]);
+	dm->hour_count[h]++;
+	dm->ewma = update_ewma(dm->ewma, n, ds->duration);
+}
+
+/**
+ * Feed the duration of one snapshot into the model.
+ *
+ * \param dm The model to update.
+ * \param start The creation time of the snapshot.
+ * \param duration The number of seconds it took to create the snapshot.
+ *
+ * Samples are expected in chronological order.
+ */
+void add_duration_sample(struct duration_model *dm, int64_t start,
+		int64_t duration)
+{
+	unsigned u;
+	int dropped = 0;
+
+	if (duration < 0)
+		duration = 0;
+	if (dm->num_samples == MAX_SAMPLES) {
+		memmove(dm->samples, dm->samples + 1,
+			(MAX_SAMPLES - 1) * sizeof(struct duration_sample));
+		dm->num_samples--;
+		dropped = 1;
+	}
+	if (!dm->samples)
+		dm->samples = dss_malloc(MAX_SAMPLES
+			* sizeof(struct duration_sample));
+	dm->samples[dm->num_samples].start = start;
+	dm->samples[dm->num_samples].duration = duration;
+	dm->num_samples++;
+	if (!dropped) {
+		update_averages(dm, dm->num_samples - 1,
+			dm->samples + dm->num_samples - 1);
+		return;
+	}
+	/* Start over so that the oldest sample no longer counts. */
+	dm->ewma = 0;
+	memset(dm->hour_ewma, 0, sizeof(dm->hour_ewma));
+	memset(dm->hour_count, 0, sizeof(dm->hour_count));
+	for (u = 0; u < dm->num_samples; u++)
+		update_averages(dm, u, dm->samples + u);
+}
+
+/**
+ * Rebuild the model from the history file.
+ *
+ * \param dm The model, which is reset first.
+ *
+ * Lines which can not be parsed are ignored.
+ *
+ * \return The number of samples read, zero if there is no history file,
+ * negative on errors.
+ */
+int load_duration_history(struct duration_model *dm)
+{
+	FILE *f = fopen(HISTORY_FILE, "r");
+	char line[100];
+
+	free_duration_model(dm);
+	if (!f)
+		return errno == ENOENT? 0 : -ERRNO_TO_DSS_ERROR(errno);
+	while (fgets(line, sizeof(line), f)) {
+		int64_t start, duration;
+
+		if (sscanf(line, "%" SCNd64 " %" SCNd64, &start,
+				&duration) != 2)
+			continue;
+		add_duration_sample(dm, start, duration);
+	}
+	fclose(f);
+	DSS_DEBUG_LOG(("%u duration samples\n", dm->num_samples));
+	return dm->num_samples;
+}
+
+/**
+ * Write the samples of a model to the history file.
+ *
+ * \param dm The model to save.
+ *
+ * The file is replaced atomically.
+ *
+ * \return Standard.
+ */
+int save_duration_history(const struct duration_model *dm)
+{
+	FILE *f = fopen(HISTORY_FILE ".tmp", "w");
+	unsigned u;
+	int ret;
+
+	if (!f) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	for (u = 0; u < dm->num_samples; u++)
+		fprintf(f, "%" PRId64 " %" PRId64 "\n", dm->samples[u].start,
+			dm->samples[u].duration);
+	if (fclose(f) == EOF) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	ret = dss_rename(HISTORY_FILE ".tmp", HISTORY_FILE);
+out:
+	if (ret < 0) {
+		unlink(HISTORY_FILE ".tmp");
+		DSS_WARNING_LOG(("can not write %s: %s\n", HISTORY_FILE,
+			dss_strerror(-ret)));
+	}
+	return ret;
+}
+
+static int compare_durations(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* How much longer than average snapshots started in this hour take. */
+static double hour_factor(const struct duration_model *dm, int h)
+{
+	if (dm->hour_count[h] < MIN_HOUR_SAMPLES || dm->ewma <= 0
+			|| dm->hour_ewma[h] <= 0)
+		return 1;
+	return dm->hour_ewma[h] / dm->ewma;
+}
+
+/*
+ * Percentile of the recent durations. If normalize is set, each duration is
+ * divided by the factor of the hour in which its snapshot was started, so that
+ * slow hours do not count twice in predict_duration().
+ */
+static double recent_percentile(const struct duration_model *dm,
+		unsigned percentile, int normalize)
+{
+	double sorted[RECENT_SAMPLES];
+	unsigned u, n = dm->num_samples, rank;
+
+	if (n == 0)
+		return 0;
+	if (n > RECENT_SAMPLES)
+		n = RECENT_SAMPLES;
+	for (u = 0; u < n; u++) {
+		const struct duration_sample *ds
+			= dm->samples + dm->num_samples - n + u;
+		sorted[u] = ds->duration;
+		if (normalize)
+			sorted[u] /= hour_factor(dm, hour_of_week(ds->start));
+	}
+	qsort(sorted, n, sizeof(double), compare_durations);
+	if (percentile > 100)
+		percentile = 100;
+	rank = (percentile * n + 99) / 100; /* nearest rank */
+	return sorted[rank > 0? rank - 1 : 0];
+}
+
+/**
+ * Compute a percentile of the recent snapshot durations.
+ *
+ * \param dm The model.
+ * \param percentile A number between 1 and 100.
+ *
+ * \return The smallest duration such that at least \a percentile percent of
+ * the recent samples are not longer, zero if there are no samples.
+ */
+int64_t duration_percentile(const struct duration_model *dm,
+		unsigned percentile)
+{
+	return recent_percentile(dm, percentile, 0);
+}
+
+/**
+ * Predict the duration of a snapshot.
+ *
+ * \param dm The model.
+ * \param start The time at which the snapshot is going to be started.
+ * \param percentile See \ref duration_percentile().
+ *
+ * \return The predicted number of seconds, zero if there are no samples.
+ */
+int64_t predict_duration(const struct duration_model *dm, int64_t start,
+		unsigned percentile)
+{
+	double p = recent_percentile(dm, percentile, 1);
+
+	return p * hour_factor(dm, hour_of_week(start)) + 0.5;
+}
+
+/**
+ * Print the state of the model.
+ *
+ * \param dm The model.
+ * \param f Where to print to.
+ * \param start Print the prediction for a snapshot started at this time.
+ * \param percentile See \ref duration_percentile().
+ */
+void dump_duration_model(const struct duration_model *dm, FILE *f,
+		int64_t start, unsigned percentile)
+{
+	int h = hour_of_week(start);
+
+	if (dm->num_samples == 0) {
+		fprintf(f, "snapshot duration: no samples\n");
+		return;
+	}
+	fprintf(f,
+		"snapshot duration samples: %u\n"
+		"snapshot duration ewma: %.0f seconds\n"
+		"snapshot duration %u%% percentile: %" PRId64 " seconds\n"
+		"hour of week %d: %u samples, factor %.2f\n"
+		"predicted snapshot duration: %" PRId64 " seconds\n"
+		,
+		dm->num_samples,
+		dm->ewma,
+		percentile, duration_percentile(dm, percentile),
+		h, dm->hour_count[h], hour_factor(dm, h),
+		predict_duration(dm, start, percentile)
+	);
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/** \file predict.h Snapshot duration prediction, see predict.c. */
+
+/** The number of hours in a week, one profile slot for each. */
+#define HOURS_PER_WEEK (7 * 24)
+
+/** The start and the duration of one snapshot, in seconds. */
+struct duration_sample {
+	/** When the snapshot was started. */
+	int64_t start;
+	/** How long it took to complete the snapshot. */
+	int64_t duration;
+};
+
+/** What we know about past snapshot durations. */
+struct duration_model {
+	/** The most recent samples, oldest first. */
+	struct duration_sample *samples;
+	/** The number of entries in \a samples. */
+	unsigned num_samples;
+	/** Exponentially weighted average over \a samples. */
+	double ewma;
+	/** The same average, separately for each hour of the week. */
+	double hour_ewma[HOURS_PER_WEEK];
+	/** The number of \a samples which went into each \a hour_ewma. */
+	unsigned hour_count[HOURS_PER_WEEK];
+};
+
+void free_duration_model(struct duration_model *dm);
+void add_duration_sample(struct duration_model *dm, int64_t start,
+		int64_t duration);
+int load_duration_history(struct duration_model *dm);
+int save_duration_history(const struct duration_model *dm);
+int64_t duration_percentile(const struct duration_model *dm,
+		unsigned percentile);
+int64_t predict_duration(const struct duration_model *dm, int64_t start,
+		unsigned percentile);
+void dump_duration_model(const struct duration_model *dm, FILE *f,
+		int64_t start, unsigned percentile);
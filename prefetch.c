@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/**
+ * \file prefetch.c Warm the dentry and inode cache for a directory tree.
+ *
+ * When rsync compares the source against the reference snapshot, it stats one
+ * file after another. On rotating disks with a cold cache, most of the time is
+ * spent waiting for these stat calls. Walking the tree by several processes at
+ * once lets the disk reorder the requests, and the subsequent stat calls of
+ * rsync are served from the cache.
+ *
+ * The top levels of the tree are walked by the calling process until enough
+ * directories have been found to keep all worker processes busy. These
+ * directories are then distributed among the workers, each of which walks its
+ * share sequentially.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "gcc-compat.h"
+#include "log.h"
+#include "err.h"
+#include "str.h"
+#include "file.h"
+#include "exec.h"
+#include "prefetch.h"
+
+/* The number of directories per worker which is considered enough work. */
+#define DIRS_PER_JOB 8
+
+struct dir_queue {
+	char **dirs;
+	/* The directories before this index have been walked already. */
+	unsigned head;
+	unsigned num_dirs;
+	unsigned array_size;
+};
+
+struct worker_data {
+	struct dir_queue *queue;
+	unsigned first;
+	unsigned step;
+};
+
+static void enqueue_dir(struct dir_queue *q, const char *path)
+{
+	if (q->num_dirs >= q->array_size) {
+		q->array_size = 2 * q->array_size + 16;
+		q->dirs = dss_realloc(q->dirs, q->array_size * sizeof(char *));
+	}
+	q->dirs[q->num_dirs++] = dss_strdup(path);
+}
+
+/* Collect the subdirectories of a directory, but do not descend. */
+static int collect_dir(const char *path, const struct stat *st, void *data)
+{
+	if (!S_ISDIR(st->st_mode))
+		return 1;
+	enqueue_dir(data, path);
+	return 0;
+}
+
+static int walk_nothing(__a_unused const char *path,
+		__a_unused const struct stat *st, __a_unused void *data)
+{
+	return 1;
+}
+
+static int walk_share(void *private_data)
+{
+	struct worker_data *wd = private_data;
+	struct dir_queue *q = wd->queue;
+	unsigned u;
+
+	for (u = q->head + wd->first; u < q->num_dirs; u += wd->step)
+		for_each_file_in_tree(q->dirs[u], walk_nothing, NULL);
+	return 1;
+}
+
+/**
+ * Stat all entries of one or more directory trees concurrently.
+ *
+ * \param dirs The roots of the trees.
+ * \param num_dirs The number of entries in \a dirs.
+ * \param num_jobs The maximal number of concurrent processes.
+ *
+ * Errors are ignored as this function only serves to speed up what follows.
+ * Directories which can not be read are skipped.
+ *
+ * \return The number of directories found before the workers were started.
+ */
+unsigned prefetch_trees(char * const *dirs, unsigned num_dirs,
+		unsigned num_jobs)
+{
+	struct dir_queue q = {.dirs = NULL};
+	struct worker_data *wd;
+	pid_t *pids;
+	unsigned u, num_found;
+
+	if (num_jobs == 0)
+		num_jobs = 1;
+	for (u = 0; u < num_dirs; u++)
+		enqueue_dir(&q, dirs[u]);
+	while (q.head < q.num_dirs
+			&& q.num_dirs - q.head < DIRS_PER_JOB * num_jobs)
+		for_each_file_in_tree(q.dirs[q.head++], collect_dir, &q);
+	num_found = q.num_dirs;
+	if (num_jobs > q.num_dirs - q.head)
+		num_jobs = q.num_dirs - q.head;
+	DSS_DEBUG_LOG(("%u directories left for %u job(s)\n",
+		q.num_dirs - q.head, num_jobs));
+	pids = dss_malloc(num_jobs * sizeof(pid_t));
+	wd = dss_malloc(num_jobs * sizeof(*wd));
+	for (u = 0; u < num_jobs; u++) {
+		wd[u].queue = &q;
+		wd[u].first = u;
+		wd[u].step = num_jobs;
+		dss_fork(pids + u, walk_share, wd + u);
+	}
+	for (u = 0; u < num_jobs; u++)
+		dss_waitpid(pids[u], NULL, 0);
+	free(wd);
+	free(pids);
+	for (u = 0; u < q.num_dirs; u++)
+		free(q.dirs[u]);
+	free(q.dirs);
+	return num_found;
+}
@@ -0,0 +1,10 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/** \file prefetch.h Cache warming, see prefetch.c. */
+
+unsigned prefetch_trees(char * const *dirs, unsigned num_dirs,
+		unsigned num_jobs);
@@ -0,0 +1,286 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/**
+ * \file reflink.c Share unchanged blocks of modified files.
+ *
+ * If a large file was modified on the source, rsync stores a complete new
+ * copy of it in the snapshot, even if only a few bytes differ from the
+ * version in the reference snapshot. On filesystems which support reflinks
+ * (btrfs, XFS), the new copy can share all unchanged blocks with the
+ * reference version instead.
+ *
+ * To achieve this, a clone of the reference version is created and only those
+ * blocks which differ from the new version are rewritten. The clone then
+ * replaces the copy written by rsync.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/xattr.h>
+#include <linux/fs.h>
+
+#include "gcc-compat.h"
+#include "log.h"
+#include "err.h"
+#include "str.h"
+#include "file.h"
+#include "reflink.h"
+
+/*
+ * Blocks are compared in units of this size. It must be a multiple of the
+ * block size of the filesystem, or unchanged data next to changed data stops
+ * being shared.
+ */
+#define REFLINK_BLOCK_SIZE (128 * 1024)
+
+/**
+ * Whether an error of \ref reflink_changed_file() means that the filesystem
+ * does not support reflinks at all.
+ *
+ * \param err The (negative) return value of \ref reflink_changed_file().
+ *
+ * FICLONE also fails with EINVAL for conditions of a single file, e.g. inline
+ * data, so this error only affects the file at hand.
+ *
+ * \return Non-zero if further attempts are pointless.
+ */
+int reflinks_unsupported(int err)
+{
+	return err == -ERRNO_TO_DSS_ERROR(EOPNOTSUPP)
+		|| err == -ERRNO_TO_DSS_ERROR(ENOTTY)
+		|| err == -ERRNO_TO_DSS_ERROR(EXDEV);
+}
+
+static int read_block(int fd, char *buf, off_t offset, size_t size,
+		ssize_t *result)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t n = pread(fd, buf + done, size - done, offset + done);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -ERRNO_TO_DSS_ERROR(errno);
+		}
+		if (n == 0)
+			break;
+		done += n;
+	}
+	*result = done;
+	return 1;
+}
+
+static int write_block(int fd, const char *buf, off_t offset, size_t size)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t n = pwrite(fd, buf + done, size - done, offset + done);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -ERRNO_TO_DSS_ERROR(errno);
+		}
+		done += n;
+	}
+	return 1;
+}
+
+/* Rewrite all blocks of the clone which differ from the new version. */
+static int patch_clone(int fd, int clone_fd, int ref_fd, off_t size,
+		int64_t *shared)
+{
+	char *buf = dss_malloc(REFLINK_BLOCK_SIZE),
+		*ref_buf = dss_malloc(REFLINK_BLOCK_SIZE);
+	off_t offset;
+	int ret = 1;
+
+	*shared = 0;
+	for (offset = 0; offset < size; offset += REFLINK_BLOCK_SIZE) {
+		ssize_t n, ref_n;
+
+		ret = read_block(fd, buf, offset, REFLINK_BLOCK_SIZE, &n);
+		if (ret < 0)
+			break;
+		ret = read_block(ref_fd, ref_buf, offset, REFLINK_BLOCK_SIZE,
+			&ref_n);
+		if (ret < 0)
+			break;
+		if (n == ref_n && !memcmp(buf, ref_buf, n)) {
+			*shared += n;
+			continue;
+		}
+		ret = write_block(clone_fd, buf, offset, n);
+		if (ret < 0)
+			break;
+	}
+	free(buf);
+	free(ref_buf);
+	return ret;
+}
+
+/**
+ * Set owner, permissions and timestamps of a file.
+ *
+ * \param fd The file to modify.
+ * \param st The metadata to apply, as returned by lstat(2).
+ *
+ * Errors are logged but otherwise ignored.
+ */
+void copy_metadata(int fd, const struct stat *st)
+{
+	struct timespec times[2] = {st->st_atim, st->st_mtim};
+
+	/* As for rsync, ownership can only be preserved if we are root. */
+	if (fchown(fd, st->st_uid, st->st_gid) < 0 && errno != EPERM)
+		DSS_WARNING_LOG(("fchown: %s\n", strerror(errno)));
+	if (fchmod(fd, st->st_mode & 07777) < 0)
+		DSS_WARNING_LOG(("fchmod: %s\n", strerror(errno)));
+	if (futimens(fd, times) < 0)
+		DSS_WARNING_LOG(("futimens: %s\n", strerror(errno)));
+}
+
+/**
+ * Copy the extended attributes of a file, including ACLs.
+ *
+ * \param fd The file to copy from.
+ * \param dst_fd The file to copy to.
+ *
+ * This should be called after \ref copy_metadata() because changing the owner
+ * of a file drops its file capabilities.
+ *
+ * \return Standard. It is not an error if the file system of \a fd does not
+ * support extended attributes.
+ */
+int copy_xattrs(int fd, int dst_fd)
+{
+	ssize_t len = flistxattr(fd, NULL, 0), val_len;
+	char *names, *name, *val = NULL;
+	int ret = 1;
+
+	if (len < 0)
+		return errno == ENOTSUP? 0 : -ERRNO_TO_DSS_ERROR(errno);
+	if (len == 0)
+		return 1;
+	names = dss_malloc(len);
+	len = flistxattr(fd, names, len);
+	if (len < 0) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	for (name = names; name < names + len; name += strlen(name) + 1) {
+		val_len = fgetxattr(fd, name, NULL, 0);
+		if (val_len >= 0) {
+			val = dss_realloc(val, val_len + 1);
+			val_len = fgetxattr(fd, name, val, val_len);
+		}
+		if (val_len < 0 || fsetxattr(dst_fd, name, val, val_len, 0) < 0) {
+			ret = -ERRNO_TO_DSS_ERROR(errno);
+			DSS_DEBUG_LOG(("xattr %s: %s\n", name, strerror(errno)));
+			break;
+		}
+	}
+out:
+	free(val);
+	free(names);
+	return ret;
+}
+
+/**
+ * Replace a modified file by a reflink of its previous version.
+ *
+ * \param path The modified file, as written by rsync.
+ * \param st The result of lstat(2) on \a path.
+ * \param ref_path The previous version, in the reference snapshot.
+ * \param shared Result: Number of bytes shared with \a ref_path.
+ *
+ * The content of \a path does not change, nor do its extended attributes and
+ * ACLs. If no block could be shared, \a path is left alone and the function
+ * returns zero.
+ *
+ * \return Positive if \a path was replaced, zero if not, negative on errors.
+ * \sa \ref reflinks_unsupported().
+ */
+int reflink_changed_file(const char *path, const struct stat *st,
+		const char *ref_path, int64_t *shared)
+{
+	char *tmp = make_message("%s.dss-reflink", path);
+	int ret, fd, ref_fd = -1, clone_fd = -1;
+
+	*shared = 0;
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	ref_fd = open(ref_path, O_RDONLY);
+	if (ref_fd < 0) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	clone_fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (clone_fd < 0) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+#ifdef FICLONE
+	ret = ioctl(clone_fd, FICLONE, ref_fd);
+#else
+	ret = -1;
+	errno = EOPNOTSUPP;
+#endif
+	if (ret < 0) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	if (ftruncate(clone_fd, st->st_size) < 0) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	ret = patch_clone(fd, clone_fd, ref_fd, st->st_size, shared);
+	if (ret < 0)
+		goto out;
+	ret = 0;
+	if (*shared == 0)
+		goto out;
+	copy_metadata(clone_fd, st);
+	ret = copy_xattrs(fd, clone_fd);
+	if (ret < 0)
+		goto out;
+	if (close(clone_fd) < 0) {
+		clone_fd = -1;
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	clone_fd = -1;
+	ret = dss_rename(tmp, path);
+	if (ret >= 0)
+		ret = 1;
+out:
+	if (clone_fd >= 0)
+		close(clone_fd);
+	if (ret <= 0)
+		unlink(tmp);
+	if (ref_fd >= 0)
+		close(ref_fd);
+	if (fd >= 0)
+		close(fd);
+	free(tmp);
+	return ret;
+}
@@ -0,0 +1,13 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/** \file reflink.h Extent-sharing copies, see reflink.c. */
+
+int reflink_changed_file(const char *path, const struct stat *st,
+		const char *ref_path, int64_t *shared);
+int reflinks_unsupported(int err);
+void copy_metadata(int fd, const struct stat *st);
+int copy_xattrs(int fd, int dst_fd);
@@ -0,0 +1,547 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/**
+ * \file sched.c Run several jobs under a common scheduler.
+ *
+ * With --job, one dss process supervises one dss process per job. Each job
+ * is a complete dss instance with its own config file, dest dir, hooks and
+ * snapshot state. Before a job starts to create or to remove a snapshot, it
+ * asks the supervisor for a slot and waits until the slot is granted. The
+ * supervisor limits the number of slots of each type which are in use at the
+ * same time and grants a free slot to the job whose snapshot has been due for
+ * the longest time.
+ *
+ * Jobs talk to the supervisor through a socket which is passed in the
+ * environment. The protocol consists of lines of text. The job sends
+ *
+ *	request <slot> <priority>
+ *	release <slot>
+ *
+ * and the supervisor answers a request with
+ *
+ *	grant <slot>
+ *
+ * where slot is either "create" or "remove". Requests with a smaller priority
+ * value are granted first. Jobs use the time at which the snapshot became due.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+
+#include "gcc-compat.h"
+#include "log.h"
+#include "err.h"
+#include "str.h"
+#include "file.h"
+#include "exec.h"
+#include "sig.h"
+#include "tv.h"
+#include "snap.h"
+#include "sched.h"
+
+/** The environment variable which tells a job about its socket. */
+#define SCHEDULER_FD_ENV "DSS_SCHEDULER_FD"
+
+/* Wait this long before restarting a job which terminated. */
+#define JOB_RESTART_DELAY 60
+
+static const char * const slot_names[] = {
+	[SLOT_CREATE] = "create",
+	[SLOT_REMOVE] = "remove",
+};
+
+/* The state of a slot, as seen by a job. */
+enum slot_state {
+	SS_IDLE,
+	SS_REQUESTED,
+	/* Granted, but the job has not started to use the slot yet. */
+	SS_GRANTED,
+	SS_IN_USE,
+};
+
+static const char * const slot_state_names[] = {
+	[SS_IDLE] = "idle",
+	[SS_REQUESTED] = "requested",
+	[SS_GRANTED] = "granted",
+	[SS_IN_USE] = "in use",
+};
+
+static int slot_by_name(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NUM_SLOTS; i++)
+		if (!strcmp(name, slot_names[i]))
+			return i;
+	return -1;
+}
+
+static int send_line(int fd, const char *line)
+{
+	size_t len = strlen(line);
+
+	if (write(fd, line, len) != len)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	return 1;
+}
+
+/* The job side. */
+
+static int client_fd = -1;
+static enum slot_state client_state[NUM_SLOTS];
+static struct line_buffer client_lb;
+
+/**
+ * Find out whether this dss process runs as a job of a scheduler.
+ *
+ * The environment variable is removed so that hooks and other child processes
+ * do not see it.
+ *
+ * \return Positive if this process runs as a job, zero if it runs alone,
+ * negative on errors.
+ */
+int sched_client_init(void)
+{
+	char *val = getenv(SCHEDULER_FD_ENV);
+	int64_t fd;
+	int ret;
+
+	if (!val)
+		return 0;
+	ret = dss_atoi64(val, &fd);
+	unsetenv(SCHEDULER_FD_ENV);
+	if (ret < 0)
+		return ret;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	ret = mark_fd_nonblocking(fd);
+	if (ret < 0)
+		return ret;
+	client_fd = fd;
+	DSS_INFO_LOG(("running as a job, scheduler fd %d\n", client_fd));
+	return 1;
+}
+
+/**
+ * The socket to the scheduler.
+ *
+ * \return The file descriptor of the socket, or -1 if there is no scheduler.
+ */
+int sched_client_fd(void)
+{
+	return client_fd;
+}
+
+/**
+ * Ask the scheduler for a slot.
+ *
+ * \param slot The type of slot to ask for.
+ * \param priority Used if more jobs want a slot than are available.
+ *
+ * The first call sends a request to the scheduler. Subsequent calls check
+ * whether the slot has been granted in the meantime. Once a granted slot has
+ * been returned, it is considered in use until \ref sched_release() is
+ * called.
+ *
+ * \return Positive if the slot may be used, zero if not (yet).
+ */
+int sched_acquire(enum sched_slot slot, int64_t priority)
+{
+	char *msg;
+
+	if (client_fd < 0)
+		return 1;
+	switch (client_state[slot]) {
+	case SS_IDLE:
+		msg = make_message("request %s %" PRId64 "\n",
+			slot_names[slot], priority);
+		if (send_line(client_fd, msg) >= 0)
+			client_state[slot] = SS_REQUESTED;
+		free(msg);
+		DSS_DEBUG_LOG(("waiting for %s slot\n", slot_names[slot]));
+		return 0;
+	case SS_REQUESTED:
+		return 0;
+	case SS_GRANTED:
+		client_state[slot] = SS_IN_USE;
+		return 1;
+	default:
+		return 1;
+	}
+}
+
+static void send_release(enum sched_slot slot)
+{
+	char *msg = make_message("release %s\n", slot_names[slot]);
+
+	send_line(client_fd, msg);
+	free(msg);
+	client_state[slot] = SS_IDLE;
+}
+
+/**
+ * Give back a slot after use.
+ *
+ * \param slot The type of slot.
+ *
+ * This only has an effect if the slot is in use. Pending requests are kept,
+ * and a slot which was granted but not used yet stays reserved.
+ */
+void sched_release(enum sched_slot slot)
+{
+	if (client_fd < 0 || client_state[slot] != SS_IN_USE)
+		return;
+	send_release(slot);
+}
+
+/**
+ * Withdraw a request for a slot which is no longer needed.
+ *
+ * \param slot The type of slot.
+ *
+ * If the slot has been granted already, it is given back unused.
+ */
+void sched_cancel(enum sched_slot slot)
+{
+	if (client_fd < 0)
+		return;
+	if (client_state[slot] != SS_REQUESTED
+			&& client_state[slot] != SS_GRANTED)
+		return;
+	send_release(slot);
+}
+
+static void handle_grant(char *line, __a_unused void *data)
+{
+	int slot = -1;
+
+	if (!strncmp(line, "grant ", 6))
+		slot = slot_by_name(line + 6);
+	if (slot < 0) {
+		DSS_WARNING_LOG(("bad message from scheduler: %s\n", line));
+		return;
+	}
+	if (client_state[slot] == SS_REQUESTED)
+		client_state[slot] = SS_GRANTED;
+	DSS_DEBUG_LOG(("got %s slot\n", slot_names[slot]));
+}
+
+/**
+ * Read the answers of the scheduler.
+ *
+ * This should be called whenever the socket to the scheduler is readable.
+ *
+ * \return Standard. It is an error if the scheduler went away.
+ */
+int sched_client_read(void)
+{
+	int ret = read_lines(client_fd, &client_lb, handle_grant, NULL);
+
+	return ret == 0? -E_SCHEDULER : ret;
+}
+
+/**
+ * Print the slot states of this job.
+ *
+ * \param f Where to print to.
+ */
+void sched_client_dump(FILE *f)
+{
+	int i;
+
+	if (client_fd < 0)
+		return;
+	for (i = 0; i < NUM_SLOTS; i++)
+		fprintf(f, "scheduler %s slot: %s\n", slot_names[i],
+			slot_state_names[client_state[i]]);
+}
+
+/* The supervisor side. */
+
+struct job {
+	const char *config_file;
+	pid_t pid;
+	int fd;
+	struct line_buffer lb;
+	/* Only SS_IDLE, SS_REQUESTED and SS_IN_USE are used here. */
+	enum slot_state state[NUM_SLOTS];
+	int64_t priority[NUM_SLOTS];
+	/* When to start the job again after it terminated. */
+	int64_t restart_time;
+};
+
+static void handle_job_line(char *line, void *data)
+{
+	struct job *j = data;
+	char *arg = strchr(line, ' '), *prio = NULL;
+	int slot = -1;
+
+	if (arg) {
+		*arg++ = '\0';
+		prio = strchr(arg, ' ');
+		if (prio)
+			*prio++ = '\0';
+		slot = slot_by_name(arg);
+	}
+	if (slot < 0)
+		goto bad;
+	if (!strcmp(line, "request") && prio) {
+		if (dss_atoi64(prio, j->priority + slot) < 0)
+			goto bad;
+		if (j->state[slot] == SS_IDLE)
+			j->state[slot] = SS_REQUESTED;
+		return;
+	}
+	if (!strcmp(line, "release")) {
+		j->state[slot] = SS_IDLE;
+		return;
+	}
+bad:
+	DSS_WARNING_LOG(("job %s: bad message\n", j->config_file));
+}
+
+static void start_job(struct job *j)
+{
+	int fds[2], ret;
+	char *val, *argv[] = {"dss", "--run", "--config-file",
+		(char *)j->config_file, NULL};
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		DSS_ERROR_LOG(("socketpair: %s\n", strerror(errno)));
+		j->restart_time = get_current_time() + JOB_RESTART_DELAY;
+		return;
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	val = make_message("%d", KEPT_FD);
+	setenv(SCHEDULER_FD_ENV, val, 1);
+	free(val);
+	DSS_NOTICE_LOG(("starting job %s\n", j->config_file));
+	dss_exec_keep_fd(&j->pid, "/proc/self/exe", argv, fds[1]);
+	unsetenv(SCHEDULER_FD_ENV);
+	close(fds[1]);
+	j->fd = fds[0];
+	j->lb.len = 0;
+	ret = mark_fd_nonblocking(j->fd);
+	if (ret < 0)
+		DSS_WARNING_LOG(("%s\n", dss_strerror(-ret)));
+}
+
+static void close_job_fd(struct job *j)
+{
+	int i;
+
+	if (j->fd >= 0)
+		close(j->fd);
+	j->fd = -1;
+	/* a job can not hold slots without a connection */
+	for (i = 0; i < NUM_SLOTS; i++)
+		j->state[i] = SS_IDLE;
+}
+
+static void job_exited(struct job *j, int status)
+{
+	if (WIFEXITED(status))
+		DSS_WARNING_LOG(("job %s exited with status %d\n",
+			j->config_file, WEXITSTATUS(status)));
+	else
+		DSS_WARNING_LOG(("job %s terminated abnormally\n",
+			j->config_file));
+	close_job_fd(j);
+	j->pid = 0;
+	j->restart_time = get_current_time() + JOB_RESTART_DELAY;
+}
+
+static void grant_slots(struct job *jobs, unsigned num_jobs,
+		const struct sched_limits *limits)
+{
+	int i;
+	unsigned u, in_use;
+
+	for (i = 0; i < NUM_SLOTS; i++) {
+		for (;;) {
+			struct job *best = NULL;
+			char *msg;
+
+			in_use = 0;
+			for (u = 0; u < num_jobs; u++) {
+				struct job *j = jobs + u;
+				if (j->state[i] == SS_IN_USE)
+					in_use++;
+				if (j->state[i] != SS_REQUESTED)
+					continue;
+				if (!best || j->priority[i] < best->priority[i])
+					best = j;
+			}
+			if (!best)
+				break;
+			if (limits->max[i] && in_use >= limits->max[i])
+				break;
+			DSS_INFO_LOG(("granting %s slot to %s\n",
+				slot_names[i], best->config_file));
+			msg = make_message("grant %s\n", slot_names[i]);
+			if (send_line(best->fd, msg) < 0)
+				close_job_fd(best);
+			else
+				best->state[i] = SS_IN_USE;
+			free(msg);
+		}
+	}
+}
+
+static void dump_jobs(struct job *jobs, unsigned num_jobs)
+{
+	unsigned u;
+	int i;
+
+	for (u = 0; u < num_jobs; u++) {
+		struct job *j = jobs + u;
+
+		if (j->pid == 0) {
+			DSS_INFO_LOG(("%s: stopped, restart in %" PRId64 "s\n",
+				j->config_file,
+				j->restart_time - get_current_time()));
+			continue;
+		}
+		for (i = 0; i < NUM_SLOTS; i++)
+			DSS_INFO_LOG(("%s (pid %d): %s slot %s\n",
+				j->config_file, (int)j->pid, slot_names[i],
+				slot_state_names[j->state[i]]));
+	}
+}
+
+static void stop_jobs(struct job *jobs, unsigned num_jobs)
+{
+	unsigned u;
+
+	for (u = 0; u < num_jobs; u++)
+		if (jobs[u].pid > 0)
+			kill(jobs[u].pid, SIGTERM);
+	for (u = 0; u < num_jobs; u++) {
+		if (jobs[u].pid <= 0)
+			continue;
+		dss_waitpid(jobs[u].pid, NULL, 0);
+		close_job_fd(jobs + u);
+	}
+}
+
+static int handle_supervisor_signal(struct job *jobs, unsigned num_jobs)
+{
+	int sig, status, ret;
+	unsigned u;
+	pid_t pid;
+
+	while ((sig = next_signal()) > 0) {
+		switch (sig) {
+		case SIGINT:
+		case SIGTERM:
+			return -E_SIGNAL;
+		case SIGHUP:
+			dump_jobs(jobs, num_jobs);
+			for (u = 0; u < num_jobs; u++)
+				if (jobs[u].pid > 0)
+					kill(jobs[u].pid, SIGHUP);
+			break;
+		case SIGCHLD:
+			while ((ret = reap_child(NULL, &pid, &status)) > 0)
+				for (u = 0; u < num_jobs; u++)
+					if (jobs[u].pid == pid)
+						job_exited(jobs + u, status);
+			break;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Supervise a number of jobs.
+ *
+ * \param config_files One config file per job.
+ * \param num_jobs The number of config files.
+ * \param limits How many slots of each type may be in use.
+ * \param signal_fd For SIGINT, SIGTERM, SIGHUP and SIGCHLD.
+ *
+ * Jobs which terminate are restarted after a minute. SIGHUP is forwarded to
+ * all jobs. On SIGINT or SIGTERM, all jobs are terminated.
+ *
+ * \return Negative on errors. This function never returns otherwise.
+ */
+int run_jobs(char * const *config_files, unsigned num_jobs,
+		const struct sched_limits *limits, int signal_fd)
+{
+	struct job *jobs = dss_calloc(num_jobs * sizeof(struct job));
+	unsigned u;
+	int ret;
+
+	for (u = 0; u < num_jobs; u++) {
+		jobs[u].config_file = config_files[u];
+		jobs[u].fd = -1;
+	}
+	for (;;) {
+		fd_set rfds;
+		struct timeval tv, *tvp = NULL;
+		int max_fileno = signal_fd;
+		int64_t now = get_current_time();
+
+		FD_ZERO(&rfds);
+		FD_SET(signal_fd, &rfds);
+		for (u = 0; u < num_jobs; u++) {
+			struct job *j = jobs + u;
+
+			if (j->pid == 0 && j->restart_time <= now)
+				start_job(j);
+			if (j->pid == 0) {
+				int64_t delay = j->restart_time - now;
+				if (!tvp || delay < tv.tv_sec) {
+					tv.tv_sec = delay;
+					tv.tv_usec = 0;
+					tvp = &tv;
+				}
+				continue;
+			}
+			if (j->fd < 0)
+				continue;
+			FD_SET(j->fd, &rfds);
+			if (j->fd > max_fileno)
+				max_fileno = j->fd;
+		}
+		ret = dss_select(max_fileno + 1, &rfds, NULL, tvp);
+		if (ret < 0)
+			break;
+		if (FD_ISSET(signal_fd, &rfds)) {
+			ret = handle_supervisor_signal(jobs, num_jobs);
+			if (ret < 0)
+				break;
+		}
+		for (u = 0; u < num_jobs; u++) {
+			struct job *j = jobs + u;
+
+			if (j->fd < 0 || !FD_ISSET(j->fd, &rfds))
+				continue;
+			ret = read_lines(j->fd, &j->lb, handle_job_line, j);
+			if (ret > 0)
+				continue;
+			if (ret < 0)
+				DSS_WARNING_LOG(("job %s: %s\n", j->config_file,
+					dss_strerror(-ret)));
+			close_job_fd(j);
+		}
+		grant_slots(jobs, num_jobs, limits);
+	}
+	stop_jobs(jobs, num_jobs);
+	free(jobs);
+	return ret;
+}
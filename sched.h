@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/** \file sched.h The job scheduler, see sched.c. */
+
+/** The resources a job must obtain from the scheduler. */
+enum sched_slot {
+	/** Creating a snapshot, from the pre-create hook to completion. */
+	SLOT_CREATE,
+	/** Removing a snapshot, from the pre-remove hook to completion. */
+	SLOT_REMOVE,
+	/** Not a slot, the number of slots. */
+	NUM_SLOTS
+};
+
+/** Limits of the scheduler, one per slot type. */
+struct sched_limits {
+	/** How many jobs may hold a slot of each type at the same time. */
+	unsigned max[NUM_SLOTS];
+};
+
+int sched_client_init(void);
+int sched_client_fd(void);
+int sched_acquire(enum sched_slot slot, int64_t priority);
+void sched_release(enum sched_slot slot);
+void sched_cancel(enum sched_slot slot);
+int sched_client_read(void);
+void sched_client_dump(FILE *f);
+int run_jobs(char * const *config_files, unsigned num_jobs,
+		const struct sched_limits *limits, int signal_pipe);
@@ -16,6 +16,7 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <sys/select.h>
+#include <sys/signalfd.h>
 
 
 #include "gcc-compat.h"
@@ -25,135 +26,110 @@
 #include "file.h"
 #include "sig.h"
 
-static int signal_pipe[2];
+static int signal_fd = -1;
+/* The signals which are delivered through signal_fd. */
+static sigset_t caught_signals;
 
 /**
  * Initialize the signal subsystem.
  *
- * This function creates a pipe, the signal pipe, to deliver pending signals to
- * the application (Bernstein's trick). It should be called during the
- * application's startup part, followed by subsequent calls to
- * install_sighandler() for each signal that should be caught.
+ * This function creates a signalfd to deliver pending signals to the
+ * application. It should be called during the application's startup part,
+ * followed by subsequent calls to install_sighandler() for each signal that
+ * should be caught.
  *
- * signal_init() installs a generic signal handler which is used for all
- * signals simultaneously. When a signal arrives, this generic signal handler
- * writes the corresponding signal number to the signal pipe so that the
- * application can test for pending signals simply by checking the signal pipe
- * for reading, e.g. by using the select(2) system call.
+ * Caught signals are blocked, so that the kernel queues them for the signalfd
+ * rather than running a signal handler. The application can test for pending
+ * signals simply by checking the returned file descriptor for reading, e.g. by
+ * using epoll(7) or select(2). Child processes must call \ref reset_signals().
  *
  * \return This function either succeeds or calls exit(2) to terminate
- * the current process. On success, the file descriptor of the signal pipe is
+ * the current process. On success, the file descriptor of the signalfd is
  * returned.
  */
 int signal_init(void)
 {
 	int ret;
-	if (pipe(signal_pipe) < 0) {
+
+	sigemptyset(&caught_signals);
+	signal_fd = signalfd(-1, &caught_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd < 0) {
 		ret = -ERRNO_TO_DSS_ERROR(errno);
 		goto err_out;
 	}
-	ret = mark_fd_nonblocking(signal_pipe[0]);
-	if (ret < 0)
-		goto err_out;
-	ret = mark_fd_nonblocking(signal_pipe[1]);
-	if (ret < 0)
-		goto err_out;
-	return signal_pipe[0];
+	return signal_fd;
 err_out:
 	DSS_EMERG_LOG(("%s\n", dss_strerror(-ret)));
 	exit(EXIT_FAILURE);
 }
 
-/*
- * just write one integer to signal pipe
- */
-static void generic_signal_handler(int s)
-{
-	write(signal_pipe[1], &s, sizeof(int));
-}
-
 /**
- * Reap one child.
+ * Undo the effect of \ref install_sighandler() in a child process.
  *
- * \param pid In case a child died, its pid is returned here.
- *
- * Call waitpid() and print a log message containing the pid and the cause of
- * the child's death.
- *
- * \return A (negative) error code on errors, zero, if no child died, one
- * otherwise. If and only if the function returns one, the content of \a pid is
- * meaningful.
- *
- * \sa waitpid(2)
+ * This restores the default action of all caught signals and unblocks them.
+ * It must be called after fork(), since the signal mask is inherited across
+ * fork(2) and execve(2).
  */
-int reap_child(pid_t *pid, int *status)
+void reset_signals(void)
 {
-	*pid = waitpid(-1, status, WNOHANG);
-
-	if (!*pid)
-		return 0;
-	if (*pid < 0)
-		return -ERRNO_TO_DSS_ERROR(errno);
-	if (WIFEXITED(*status))
-		DSS_DEBUG_LOG(("child %i exited. Exit status: %i\n", (int)*pid,
-			WEXITSTATUS(*status)));
-	else if (WIFSIGNALED(*status))
-		DSS_DEBUG_LOG(("child %i was killed by signal %i\n", (int)*pid,
-			WTERMSIG(*status)));
-	else
-		DSS_WARNING_LOG(("child %i terminated abormally\n", (int)*pid));
-	return 1;
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	sigprocmask(SIG_UNBLOCK, &caught_signals, NULL);
 }
 
 /**
- * Wrapper around signal(2)
+ * Catch a signal through the signalfd.
  *
  * \param sig The number of the signal to catch.
  *
- * This installs the generic signal handler for the given signal.
+ * This blocks the given signal and adds it to the set of signals which are
+ * reported by the signalfd.
  *
  * \return This function returns 1 on success and \p -E_SIGNAL_SIG_ERR on errors.
- * \sa signal(2)
+ * \sa signalfd(2)
  */
 int install_sighandler(int sig)
 {
 	DSS_DEBUG_LOG(("catching signal %d\n", sig));
-	if (signal(sig, &generic_signal_handler) != SIG_ERR)
-		return 1;
-	return -E_SIGNAL_SIG_ERR;
+	sigaddset(&caught_signals, sig);
+	if (sigprocmask(SIG_BLOCK, &caught_signals, NULL) < 0)
+		return -E_SIGNAL_SIG_ERR;
+	if (signalfd(signal_fd, &caught_signals, 0) < 0)
+		return -E_SIGNAL_SIG_ERR;
+	return 1;
 }
 
 /**
  * Return number of next pending signal.
  *
- * This should be called if the fd for the signal pipe is ready for reading.
+ * This should be called if the signalfd is ready for reading.
  *
  * \return On success, the number of the received signal is returned.
- * If the read was interrupted by another signal the function returns 0.
- * Otherwise a negative error code is returned.
+ * If no signal is pending, the function returns 0. Otherwise a negative error
+ * code is returned.
  */
 int next_signal(void)
 {
-	int s, err;
+	struct signalfd_siginfo ssi;
 	ssize_t r;
 
-	r = read(signal_pipe[0], &s, sizeof(s));
-	if (r == sizeof(s)) {
-		DSS_DEBUG_LOG(("next signal: %d\n", s));
-		return s;
+	r = read(signal_fd, &ssi, sizeof(ssi));
+	if (r == sizeof(ssi)) {
+		DSS_DEBUG_LOG(("next signal: %d\n", (int)ssi.ssi_signo));
+		return ssi.ssi_signo;
 	}
-	err = errno;
-	assert(r < 0);
-	if (err == EAGAIN)
+	if (r < 0 && (errno == EAGAIN || errno == EINTR))
 		return 0;
-	DSS_ERROR_LOG(("failed to read from signal pipe\n"));
-	return -ERRNO_TO_DSS_ERROR(err);
+	DSS_ERROR_LOG(("failed to read from signalfd\n"));
+	return r < 0? -ERRNO_TO_DSS_ERROR(errno) : -E_SIGNAL_SIG_ERR;
 }
 
 /**
- * Close the signal pipe.
+ * Close the signalfd.
  */
 void signal_shutdown(void)
 {
-	close(signal_pipe[1]);
+	close(signal_fd);
+	signal_fd = -1;
 }
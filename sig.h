@@ -8,4 +8,4 @@ int signal_init(void);
 int install_sighandler(int);
 int next_signal(void);
 void signal_shutdown(void);
-int reap_child(pid_t *pid, int *status);
+void reset_signals(void);
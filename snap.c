@@ -50,69 +50,151 @@ unsigned desired_number_of_snapshots(int interval_num, int num_intervals)
 	return 1 << n;
 }
 
-/* return: Whether dirname is a snapshot directory (0: no, 1: yes) */
-static int is_snapshot(const char *dirname, int64_t now, int unit_interval,
-		struct snapshot *s)
+/*
+ * Parse a time stamp as written by format_iso8601(), e.g.
+ * 2011-02-01T04-00-00.123+0100. The milliseconds are optional because names
+ * of earlier versions did not contain them. Returns the number of characters
+ * parsed, or zero if str does not start with a time stamp.
+ */
+static int parse_iso8601(const char *str, int64_t *ms)
 {
-	int i, ret;
-	char *dash, *dot, *tmp;
-	int64_t num;
+	static const char layout[] = "dddd-dd-ddTdd-dd-dd";
+	const char *p = str + sizeof(layout) - 1;
+	struct tm t_tm;
+	int i, msec = 0, offset = 0, have_offset = 1;
+	time_t t;
 
-	assert(dirname);
-	dash = strchr(dirname, '-');
-	if (!dash || !dash[1] || dash == dirname)
-		return 0;
-	for (i = 0; dirname[i] != '-'; i++)
-		if (!dss_isdigit(dirname[i]))
+	for (i = 0; layout[i]; i++) {
+		if (layout[i] == 'd'? !dss_isdigit(str[i]) : str[i] != layout[i])
 			return 0;
-	tmp = dss_strdup(dirname);
-	tmp[i] = '\0';
-	ret = dss_atoi64(tmp, &num);
-	free(tmp);
-	if (ret < 0)
+	}
+	memset(&t_tm, 0, sizeof(t_tm));
+	t_tm.tm_year = atoi(str) - 1900;
+	t_tm.tm_mon = atoi(str + 5) - 1;
+	t_tm.tm_mday = atoi(str + 8);
+	t_tm.tm_hour = atoi(str + 11);
+	t_tm.tm_min = atoi(str + 14);
+	t_tm.tm_sec = atoi(str + 17);
+	if (*p == '.') {
+		for (i = 1; i <= 3; i++) {
+			if (!dss_isdigit(p[i]))
+				return 0;
+			msec = 10 * msec + p[i] - '0';
+		}
+		p += 4;
+	}
+	if (*p == 'Z')
+		p++;
+	else if (*p == '+' || *p == '-') {
+		for (i = 1; i <= 4; i++)
+			if (!dss_isdigit(p[i]))
+				return 0;
+		offset = ((p[1] - '0') * 10 + p[2] - '0') * 3600
+			+ ((p[3] - '0') * 10 + p[4] - '0') * 60;
+		if (*p == '-')
+			offset = -offset;
+		p += 5;
+	} else
+		have_offset = 0;
+	if (have_offset)
+		t = timegm(&t_tm) - offset;
+	else {
+		t_tm.tm_isdst = -1;
+		t = mktime(&t_tm);
+	}
+	if (t == (time_t)-1)
+		return 0;
+	*ms = (int64_t)t * 1000 + msec;
+	return p - str;
+}
+
+/* Names of dss versions before 0.1.4, e.g. 1204565370-1204565371.Sun_Mar... */
+static int is_legacy_snapshot(const char *dirname, struct snapshot *s)
+{
+	char *end;
+	long long num;
+
+	if (!dss_isdigit(dirname[0]))
 		return 0;
-	assert(num >= 0);
-	if (num > now)
+	num = strtoll(dirname, &end, 10);
+	if (*end != '-')
 		return 0;
+	s->creation_ms = num * 1000;
 	s->creation_time = num;
-	s->interval = (long long) ((now - s->creation_time)
-		/ unit_interval / 24 / 3600);
-	if (!strcmp(dash + 1, "incomplete")) {
+	end++;
+	if (!strcmp(end, "incomplete") || !strcmp(end, "incomplete.being_deleted")) {
+		s->completion_time = -1;
+		s->flags = end[10]? SS_BEING_DELETED : 0;
+		return 1;
+	}
+	if (!dss_isdigit(*end))
+		return 0;
+	num = strtoll(end, &end, 10);
+	if (*end != '.' || !end[1] || num < s->creation_time)
+		return 0;
+	s->completion_time = num;
+	s->flags = SS_COMPLETE;
+	if (!strcmp(end + 1, "being_deleted"))
+		s->flags |= SS_BEING_DELETED;
+	return 1;
+}
+
+/*
+ * Return: Whether dirname is a snapshot directory (0: no, 1: yes). This is
+ * called for each entry of the dest dir, so it avoids allocating memory for
+ * entries which are not snapshots.
+ */
+static int is_snapshot(const char *dirname, int64_t now, int64_t unit_interval,
+		struct snapshot *s)
+{
+	const char *p;
+	char *end;
+	int n;
+	long long duration;
+
+	assert(dirname);
+	n = parse_iso8601(dirname, &s->creation_ms);
+	if (n == 0) {
+		if (!is_legacy_snapshot(dirname, s))
+			return 0;
+		goto success;
+	}
+	s->creation_time = s->creation_ms / 1000;
+	p = dirname + n;
+	if (strncmp(p, "--", 2))
+		return 0;
+	p += 2;
+	if (!strcmp(p, "incomplete")) {
 		s->completion_time = -1;
 		s->flags = 0; /* neither complete, nor being deleted */
 		goto success;
 	}
-	if (!strcmp(dash + 1, "incomplete.being_deleted")) {
+	if (!strcmp(p, "incomplete.being_deleted")) {
 		s->completion_time = -1;
-		s->flags = SS_BEING_DELETED; /* mot cpmplete, being deleted */
+		s->flags = SS_BEING_DELETED; /* not complete, being deleted */
 		goto success;
 	}
-	tmp = dash + 1;
-	dot = strchr(tmp, '.');
-	if (!dot || !dot[1] || dot == tmp)
-		return 0;
-	for (i = 0; tmp[i] != '.'; i++)
-		if (!dss_isdigit(tmp[i]))
-			return 0;
-	tmp = dss_strdup(dash + 1);
-	tmp[i] = '\0';
-	ret = dss_atoi64(tmp, &num);
-	free(tmp);
-	if (ret < 0)
+	if (strncmp(p, "PT", 2) || !dss_isdigit(p[2]))
 		return 0;
-	if (num > now || num < s->creation_time)
+	duration = strtoll(p + 2, &end, 10);
+	if (*end != 'S')
 		return 0;
-	s->completion_time = num;
+	s->completion_time = s->creation_time + duration;
 	s->flags = SS_COMPLETE;
-	if (!strcmp(dot + 1, "being_deleted"))
+	if (!strcmp(end + 1, ".being_deleted"))
 		s->flags |= SS_BEING_DELETED;
+	else if (end[1])
+		return 0;
 success:
+	if (s->creation_time > now || s->completion_time > now)
+		return 0;
+	s->interval = (now - s->creation_time) / unit_interval;
 	s->name = dss_strdup(dirname);
 	return 1;
 }
 
 struct add_snapshot_data {
-	int unit_interval;
+	int64_t unit_interval;
 	int num_intervals;
 	struct snapshot_list *sl;
 };
@@ -147,11 +229,18 @@ static int compare_snapshots(const void *a, const void *b)
 {
 	struct snapshot *s1 = *(struct snapshot * const *)a;
 	struct snapshot *s2 = *(struct snapshot * const *)b;
-	return NUM_COMPARE(s2->creation_time, s1->creation_time);
+	return NUM_COMPARE(s2->creation_ms, s1->creation_ms);
 }
 
 
-void get_snapshot_list(struct snapshot_list *sl, int unit_interval,
+/**
+ * Read the snapshots of the dest dir.
+ *
+ * \param sl Result pointer, sorted by creation time, oldest first.
+ * \param unit_interval The duration of a unit interval in seconds.
+ * \param num_intervals Snapshots in older intervals are counted together.
+ */
+void get_snapshot_list(struct snapshot_list *sl, int64_t unit_interval,
 		int num_intervals)
 {
 	struct add_snapshot_data asd;
@@ -184,10 +273,12 @@ void free_snapshot_list(struct snapshot_list *sl)
 	sl->num_snapshots = 0;
 }
 
-static int format_iso8601(char *str, size_t str_size, int64_t t)
+/* The time stamp of snapshot names, with milliseconds. */
+static int format_iso8601(char *str, size_t str_size, int64_t ms)
 {
-	time_t t_copy = (time_t)t;
+	time_t t_copy = (time_t)(ms / 1000);
 	struct tm t_tm;
+	size_t len;
 
 	if (!localtime_r(&t_copy, &t_tm))
 		return -E_LOCALTIME;
@@ -195,16 +286,26 @@ static int format_iso8601(char *str, size_t str_size, int64_t t)
 #ifndef DSS_TIMEZONE_FORMAT
 #  define DSS_TIMEZONE_FORMAT "%z"
 #endif
-	if (!strftime(str, str_size, "%Y-%m-%dT%H-%M-%S" DSS_TIMEZONE_FORMAT, &t_tm))
+	len = strftime(str, str_size, "%Y-%m-%dT%H-%M-%S", &t_tm);
+	if (!len || len + 5 > str_size)
+		return -E_STRFTIME;
+	len += sprintf(str + len, ".%03d", (int)(ms % 1000));
+	if (DSS_TIMEZONE_FORMAT[0] && !strftime(str + len, str_size - len,
+			DSS_TIMEZONE_FORMAT, &t_tm))
 		return -E_STRFTIME;
 
 	return 0;
 }
 
-__malloc char *incomplete_name(int64_t start)
+/**
+ * The name of a snapshot which is being created.
+ *
+ * \param start_ms The creation time in milliseconds since the epoch.
+ */
+__malloc char *incomplete_name(int64_t start_ms)
 {
 	char start_str[200];
-	int ret = format_iso8601(start_str, sizeof(start_str), start);
+	int ret = format_iso8601(start_str, sizeof(start_str), start_ms);
 	if (ret)
 		return NULL;
 
@@ -214,30 +315,38 @@ __malloc char *incomplete_name(int64_t start)
 __malloc char *being_deleted_name(struct snapshot *s)
 {
 	char start_str[200];
-	int ret = format_iso8601(start_str, sizeof(start_str), s->creation_time);
+	int ret = format_iso8601(start_str, sizeof(start_str), s->creation_ms);
 	if (ret)
 		return NULL;
 
 	if (s->flags & SS_COMPLETE)
-	{
-		int duration = (int)(difftime((time_t)s->completion_time, (time_t)s->creation_time) + 0.5);
-		return make_message("%s--PT%dS.being_deleted", start_str, duration);
-	}
+		return make_message("%s--PT%" PRId64 "S.being_deleted", start_str,
+			s->completion_time - s->creation_time);
 
 	return make_message("%s--incomplete.being_deleted", start_str);
 }
 
-int complete_name(int64_t start, int64_t end, char **result)
+/**
+ * The name of a complete snapshot.
+ *
+ * \param start_ms The creation time in milliseconds since the epoch.
+ * \param end_ms The completion time, also in milliseconds.
+ * \param result The name is returned here.
+ *
+ * The duration is truncated to seconds. Rounding it up could move the
+ * completion time past the current time, and is_snapshot() rejects such names.
+ *
+ * \return Standard.
+ */
+int complete_name(int64_t start_ms, int64_t end_ms, char **result)
 {
-	time_t start_time = (time_t)start;
-	time_t end_time = (time_t)end;
-	int duration = (int)(difftime(end_time, start_time) + 0.5);
+	int64_t duration = (end_ms - start_ms) / 1000;
 	char start_str[200];
-	int ret = format_iso8601(start_str, sizeof(start_str), start);
+	int ret = format_iso8601(start_str, sizeof(start_str), start_ms);
 	if (ret)
 		return ret;
 
-	*result = make_message("%s--PT%dS", start_str, duration);
+	*result = make_message("%s--PT%" PRId64 "S", start_str, duration);
 	return 1;
 }
 
@@ -12,8 +12,7 @@
 	HSA_ITEM(HS_PRE_SUCCESS, "pre-hook completed successfully"), \
 	HSA_ITEM(HS_RUNNING, "in progress"), \
 	HSA_ITEM(HS_SUCCESS, "process terminated successfully"), \
-	HSA_ITEM(HS_NEEDS_RESTART, "restart needed"), \
-	HSA_ITEM(HS_POST_RUNNING, "post-hook running")
+	HSA_ITEM(HS_NEEDS_RESTART, "restart needed")
 
 
 #define HSA_ITEM(x, y) x
@@ -28,10 +27,10 @@ enum hook_status {HOOK_STATUS_ARRAY};
  * The snapshot directories come in four different flavours, depending
  * on how the two status flags are set. Examples:
  *
- * Complete, not being deleted: 1204565370-1204565371.Sun_Mar_02_2008_14_33-Sun_Mar_02_2008_14_43.
- * Complete, being deleted: 1204565370-1204565371.being_deleted.
- * Incomplete, not being deleted: 1204565370-incomplete.
- * incomplete, being deleted: 1204565370-incomplete.being_deleted.
+ * Complete, not being deleted: 2011-02-01T04-00-00.123+0100--PT3600S.
+ * Complete, being deleted: 2011-02-01T04-00-00.123+0100--PT3600S.being_deleted.
+ * Incomplete, not being deleted: 2011-02-01T04-00-00.123+0100--incomplete.
+ * incomplete, being deleted: 2011-02-01T04-00-00.123+0100--incomplete.being_deleted.
  */
 enum snapshot_status_flags {
 	/** The rsync process terminated successfully. */
@@ -46,6 +45,8 @@ struct snapshot {
 	char *name;
 	/** Seconds after the epoch when this snapshot was created. */
 	int64_t creation_time;
+	/** The same in milliseconds, this identifies the snapshot. */
+	int64_t creation_ms;
 	/**
 	 * Seconds after the epoch when creation of this snapshot completed.
 	 * Only meaningful if the SS_COMPLETE bit is set.
@@ -81,12 +82,12 @@ struct snapshot_list {
 
 
 unsigned desired_number_of_snapshots(int interval_num, int num_intervals);
-void get_snapshot_list(struct snapshot_list *sl, int unit_interval,
+void get_snapshot_list(struct snapshot_list *sl, int64_t unit_interval,
 		int num_intervals);
 void free_snapshot_list(struct snapshot_list *sl);
-__malloc char *incomplete_name(int64_t start);
+__malloc char *incomplete_name(int64_t start_ms);
 __malloc char *being_deleted_name(struct snapshot *s);
-int complete_name(int64_t start, int64_t end, char **result);
+int complete_name(int64_t start_ms, int64_t end_ms, char **result);
 __malloc char *name_of_newest_complete_snapshot(struct snapshot_list *sl);
 
 /**
@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/**
+ * \file ssh.c Multiplexed ssh connections.
+ *
+ * Without help, each rsync process opens its own ssh connection to the remote
+ * host, paying for a full key exchange and authentication every time. dss
+ * instead runs an ssh master process per remote host for the lifetime of the
+ * run command. rsync connects through the control socket of the master, so
+ * starting rsync does not need a new ssh connection.
+ *
+ * If the master is not running, ssh falls back to a direct connection, so
+ * rsync works in any case.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "gcc-compat.h"
+#include "log.h"
+#include "err.h"
+#include "str.h"
+#include "exec.h"
+#include "tv.h"
+#include "ssh.h"
+
+/** Do not restart a failing master more often than this (seconds). */
+#define SSH_MASTER_RESTART_INTERVAL 60
+
+/** Ask a running master whether it is alive this often (seconds). */
+#define SSH_MASTER_CHECK_INTERVAL 60
+
+/** A master which does not answer within this time is restarted (seconds). */
+#define SSH_MASTER_CHECK_TIMEOUT 30
+
+/*
+ * (Re-)initialize an ssh master structure for the given user and host. The
+ * control socket lives in the dest dir. A relative path is used to stay below
+ * the length limit for unix socket paths. This works because rsync starts ssh
+ * before it changes its working directory.
+ */
+static void ssh_master_init(struct ssh_master *sm, const char *user,
+		const char *host, const char *cipher)
+{
+	/* a check of the previous master may still be running */
+	pid_t check_pid = sm->check_pid;
+
+	assert(!sm->pid);
+	free(sm->user);
+	free(sm->host);
+	free(sm->socket);
+	free(sm->cipher);
+	memset(sm, 0, sizeof(*sm));
+	sm->check_pid = check_pid;
+	sm->user = dss_strdup(user);
+	sm->host = dss_strdup(host);
+	sm->cipher = cipher? dss_strdup(cipher) : NULL;
+	sm->socket = make_message(".dss-ssh-%s@%s", user, host);
+}
+
+static void ssh_master_start(struct ssh_master *sm)
+{
+	char *argv[18];
+	int i = 0;
+
+	argv[i++] = "ssh";
+	argv[i++] = "-M"; /* master mode */
+	argv[i++] = "-N"; /* no remote command */
+	argv[i++] = "-n"; /* stdin from /dev/null */
+	argv[i++] = "-S";
+	argv[i++] = sm->socket;
+	argv[i++] = "-o";
+	argv[i++] = "BatchMode=yes";
+	/* terminate if the connection dies, so that it gets restarted */
+	argv[i++] = "-o";
+	argv[i++] = "ServerAliveInterval=30";
+	argv[i++] = "-o";
+	argv[i++] = "ServerAliveCountMax=3";
+	if (sm->cipher) { /* the master negotiates the cipher for all */
+		argv[i++] = "-c";
+		argv[i++] = sm->cipher;
+	}
+	argv[i++] = "-l";
+	argv[i++] = sm->user;
+	argv[i++] = sm->host;
+	argv[i++] = NULL;
+
+	/* a stale socket from a crashed master would prevent startup */
+	unlink(sm->socket);
+	DSS_NOTICE_LOG(("starting ssh master for %s@%s\n", sm->user, sm->host));
+	dss_exec(&sm->pid, argv[0], argv);
+	sm->start_time = get_current_time();
+	sm->num_starts++;
+}
+
+/*
+ * Ask the master whether it is still alive. The control socket may outlive a
+ * master which crashed, and a hung master keeps its socket, so the existence
+ * of the socket proves nothing. The answer is handled by
+ * ssh_master_check_exited().
+ */
+static void ssh_master_ping(struct ssh_master *sm)
+{
+	char *argv[9];
+	int i = 0;
+
+	argv[i++] = "ssh";
+	argv[i++] = "-q";
+	argv[i++] = "-S";
+	argv[i++] = sm->socket;
+	argv[i++] = "-O";
+	argv[i++] = "check";
+	argv[i++] = "-l";
+	argv[i++] = sm->user;
+	argv[i++] = sm->host;
+	argv[i] = NULL;
+	assert(i < 9);
+	DSS_DEBUG_LOG(("checking ssh master %d\n", (int)sm->pid));
+	dss_exec(&sm->check_pid, argv[0], argv);
+	sm->checked_pid = sm->pid;
+	sm->check_time = get_current_time();
+}
+
+/**
+ * Make sure the ssh master is running and healthy.
+ *
+ * \param sm The ssh master to check.
+ * \param user The remote user.
+ * \param host The remote host.
+ * \param cipher The ssh cipher to use, NULL for the default.
+ *
+ * A master is considered unhealthy if its control socket has disappeared, if
+ * it does not answer "ssh -O check" in time, or if it connects to a different
+ * user or host or with a different cipher than requested, e.g. because the
+ * config file was reloaded. In this case it is terminated. A master that is
+ * not running gets (re)started, but not more often than once per minute.
+ */
+void ssh_master_check(struct ssh_master *sm, const char *user,
+		const char *host, const char *cipher)
+{
+	struct stat statbuf;
+	int changed = !sm->host || strcmp(sm->host, host)
+		|| strcmp(sm->user, user) || !sm->cipher != !cipher
+		|| (cipher && strcmp(sm->cipher, cipher));
+
+	if (sm->pid) {
+		if (changed) {
+			DSS_NOTICE_LOG(("remote host or cipher changed\n"));
+			goto kill;
+		}
+		/* give a freshly started master some time to connect */
+		if (get_current_time() < sm->start_time + SSH_MASTER_RESTART_INTERVAL)
+			return;
+		if (stat(sm->socket, &statbuf) < 0 || !S_ISSOCK(statbuf.st_mode)) {
+			DSS_WARNING_LOG(("ssh master %d has no control socket\n",
+				(int)sm->pid));
+			goto kill;
+		}
+		if (sm->check_pid) {
+			if (get_current_time() < sm->check_time
+					+ SSH_MASTER_CHECK_TIMEOUT)
+				return;
+			DSS_WARNING_LOG(("ssh master %d does not answer\n",
+				(int)sm->pid));
+			kill(sm->check_pid, SIGKILL);
+			goto kill;
+		}
+		if (get_current_time() >= sm->check_time
+				+ SSH_MASTER_CHECK_INTERVAL)
+			ssh_master_ping(sm);
+		return;
+	}
+	if (changed)
+		ssh_master_init(sm, user, host, cipher);
+	else if (sm->num_starts > 0 && get_current_time()
+			< sm->start_time + SSH_MASTER_RESTART_INTERVAL)
+		return;
+	ssh_master_start(sm);
+	return;
+kill:
+	kill(sm->pid, SIGTERM); /* restarted after it died */
+}
+
+/**
+ * Handle the termination of the ssh master process.
+ *
+ * \param sm The ssh master which has terminated.
+ * \param status As returned by waitpid().
+ *
+ * The master is restarted by the next call to \ref ssh_master_check(), but
+ * not earlier than one minute after it was started last.
+ */
+void ssh_master_exited(struct ssh_master *sm, int status)
+{
+	if (WIFEXITED(status))
+		DSS_WARNING_LOG(("ssh master for %s exited with status %d\n",
+			sm->host, WEXITSTATUS(status)));
+	else
+		DSS_WARNING_LOG(("ssh master for %s terminated\n", sm->host));
+	sm->pid = 0;
+}
+
+/**
+ * Handle the termination of an "ssh -O check" process.
+ *
+ * \param sm The ssh master which was checked.
+ * \param pid The process which has terminated.
+ * \param status As returned by waitpid().
+ *
+ * If the check failed, the master is terminated, and restarted by the next
+ * call to \ref ssh_master_check().
+ *
+ * \return Zero if \a pid is not the check process of \a sm, positive
+ * otherwise.
+ */
+int ssh_master_check_exited(struct ssh_master *sm, pid_t pid, int status)
+{
+	if (pid == 0 || pid != sm->check_pid)
+		return 0;
+	sm->check_pid = 0;
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		return 1;
+	/* the master might have been replaced in the meantime */
+	if (!sm->pid || sm->pid != sm->checked_pid)
+		return 1;
+	DSS_WARNING_LOG(("ssh master %d failed the check\n", (int)sm->pid));
+	kill(sm->pid, SIGTERM); /* restarted after it died */
+	return 1;
+}
+
+/**
+ * Terminate the ssh master.
+ *
+ * \param sm The ssh master to stop.
+ *
+ * This does not wait for the master process to terminate.
+ */
+void ssh_master_stop(struct ssh_master *sm)
+{
+	if (!sm->pid)
+		return;
+	DSS_INFO_LOG(("stopping ssh master %d\n", (int)sm->pid));
+	kill(sm->pid, SIGTERM);
+}
+
+/**
+ * Get the remote shell command for rsync.
+ *
+ * \param sm The ssh master to connect through.
+ *
+ * \return A string suitable as the argument of rsync's -e option.
+ */
+__malloc char *ssh_master_rsh(struct ssh_master *sm)
+{
+	return make_message("ssh -S %s", sm->socket);
+}
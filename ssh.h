@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/** \file ssh.h Multiplexed ssh connections, see ssh.c. */
+
+/** An ssh master process and its control socket. */
+struct ssh_master {
+	/** Remote user name. */
+	char *user;
+	/** Remote host. */
+	char *host;
+	/** Path of the control socket, relative to the dest dir. */
+	char *socket;
+	/** The ssh cipher, NULL for the default. */
+	char *cipher;
+	/** Process id of the master, zero if it is not running. */
+	pid_t pid;
+	/** When the master was started last. */
+	int64_t start_time;
+	/** How many times the master was started. */
+	unsigned num_starts;
+	/** The running "ssh -O check" process, zero if none. */
+	pid_t check_pid;
+	/** The master which is being checked. */
+	pid_t checked_pid;
+	/** When the last check was started. */
+	int64_t check_time;
+};
+
+void ssh_master_check(struct ssh_master *sm, const char *user,
+		const char *host, const char *cipher);
+void ssh_master_exited(struct ssh_master *sm, int status);
+int ssh_master_check_exited(struct ssh_master *sm, pid_t pid, int status);
+void ssh_master_stop(struct ssh_master *sm);
+__malloc char *ssh_master_rsh(struct ssh_master *sm);
@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/** \file stats.c Parse rsync statistics and store them next to a snapshot. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "gcc-compat.h"
+#include "log.h"
+#include "err.h"
+#include "str.h"
+#include "file.h"
+#include "stats.h"
+
+/*
+ * The lines of rsync's --stats output we care about. Older rsync versions
+ * (before 3.1) say "Number of files transferred" instead of "Number of
+ * regular files transferred".
+ */
+static const struct {
+	const char *prefix;
+	size_t offset;
+} rsync_stats_keys[] = {
+	{"Number of files:", offsetof(struct snapshot_stats, num_files)},
+	{"Number of regular files transferred:",
+		offsetof(struct snapshot_stats, num_transferred)},
+	{"Number of files transferred:",
+		offsetof(struct snapshot_stats, num_transferred)},
+	{"Total file size:", offsetof(struct snapshot_stats, total_size)},
+	{"Total transferred file size:",
+		offsetof(struct snapshot_stats, transferred_size)},
+	{"Literal data:", offsetof(struct snapshot_stats, literal_data)},
+	/* printed by the dedup process, see dedup.c */
+	{"Deduplicated files:",
+		offsetof(struct snapshot_stats, num_deduplicated)},
+	{"Deduplicated file size:",
+		offsetof(struct snapshot_stats, deduplicated_size)},
+	{"Reflinked files:", offsetof(struct snapshot_stats, num_reflinked)},
+	{"Reflinked shared size:",
+		offsetof(struct snapshot_stats, reflinked_size)},
+	{"Split link chains:", offsetof(struct snapshot_stats, num_split)},
+	{"Split link chain size:",
+		offsetof(struct snapshot_stats, split_size)},
+	{"Maximal link count:",
+		offsetof(struct snapshot_stats, max_link_count)},
+};
+
+/*
+ * Parse a number as printed by rsync. Since version 3.1, rsync groups digits
+ * with the thousands separator of the current locale, which we simply skip. A
+ * dot is a separator only if three digits follow, as in "1.234.567". With -h,
+ * rsync prints numbers like "1.23G", which are rejected (dss removes -h from
+ * the rsync options, but rsync might be wrapped by something else).
+ */
+static int parse_rsync_number(const char *p, int64_t *result)
+{
+	int64_t val = 0;
+	int num_digits = 0;
+
+	p += strspn(p, " \t");
+	for (; *p; p++) {
+		if (*p >= '0' && *p <= '9') {
+			val = 10 * val + *p - '0';
+			num_digits++;
+			continue;
+		}
+		if (*p == '.' && (strspn(p + 1, "0123456789") != 3
+				|| !num_digits))
+			break;
+		if (*p != ',' && *p != '.' && *p != '\'')
+			break;
+	}
+	if (!num_digits)
+		return -E_ATOI_NO_DIGITS;
+	/* a fraction or a unit suffix */
+	if (*p == '.' || (*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z'))
+		return -E_ATOI_JUNK_AT_END;
+	*result = val;
+	return 1;
+}
+
+/**
+ * Extract a value from one line of rsync's --stats output.
+ *
+ * \param line The line to parse.
+ * \param ss The matching field of this structure is updated.
+ * \param add Whether to add the value to the field rather than replacing it.
+ *
+ * Adding is needed if several rsync processes contribute to one snapshot.
+ *
+ * \return Positive if \a line was recognized as a statistics line, zero
+ * otherwise.
+ */
+int parse_rsync_stats_line(const char *line, struct snapshot_stats *ss,
+		int add)
+{
+	int i;
+
+	for (i = 0; i < sizeof(rsync_stats_keys) / sizeof(rsync_stats_keys[0]); i++) {
+		const char *prefix = rsync_stats_keys[i].prefix;
+		size_t len = strlen(prefix);
+		int64_t *field, val;
+
+		if (strncmp(line, prefix, len))
+			continue;
+		field = (int64_t *)((char *)ss + rsync_stats_keys[i].offset);
+		if (parse_rsync_number(line + len, &val) < 0) {
+			DSS_WARNING_LOG(("can not parse rsync statistics: %s\n",
+				line));
+			return 0;
+		}
+		*field = add? *field + val : val;
+		return 1;
+	}
+	return 0;
+}
+
+static char *stats_file_name(const char *snapshot_name)
+{
+	return make_message("%s.stats", snapshot_name);
+}
+
+/**
+ * Write the statistics of a snapshot to its sidecar file.
+ *
+ * \param snapshot_name The name of the snapshot directory.
+ * \param ss The statistics to write.
+ *
+ * The sidecar file lives next to the snapshot directory. Its name is the name
+ * of the snapshot with ".stats" appended. It contains one "key: value" pair
+ * per line. The file is written to a temporary file, which is flushed to disk
+ * and then renamed, so the sidecar is either complete or missing. The caller
+ * must sync the directory.
+ *
+ * \return Standard.
+ */
+int write_snapshot_stats(const char *snapshot_name,
+		const struct snapshot_stats *ss)
+{
+	char *name = stats_file_name(snapshot_name),
+		*tmp = make_message("%s.tmp", name);
+	FILE *f = fopen(tmp, "w");
+	int ret;
+
+	if (!f) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	fprintf(f,
+		"files: %" PRId64 "\n"
+		"files_transferred: %" PRId64 "\n"
+		"total_bytes: %" PRId64 "\n"
+		"bytes_transferred: %" PRId64 "\n"
+		"bytes_linked: %" PRId64 "\n"
+		"literal_bytes: %" PRId64 "\n"
+		"files_retried: %" PRId64 "\n"
+		"restarts: %" PRId64 "\n"
+		"partial_bytes_resumed: %" PRId64 "\n"
+		"files_deduplicated: %" PRId64 "\n"
+		"bytes_deduplicated: %" PRId64 "\n"
+		"files_reflinked: %" PRId64 "\n"
+		"bytes_reflink_shared: %" PRId64 "\n"
+		"files_split: %" PRId64 "\n"
+		"bytes_split: %" PRId64 "\n"
+		"max_link_count: %" PRId64 "\n"
+		"duration: %" PRId64 "\n"
+		"sync_ms: %" PRId64 "\n"
+		"exit_status: %d\n"
+		,
+		ss->num_files,
+		ss->num_transferred,
+		ss->total_size,
+		ss->transferred_size,
+		linked_size(ss),
+		ss->literal_data,
+		ss->num_retried,
+		ss->num_restarts,
+		ss->partial_size,
+		ss->num_deduplicated,
+		ss->deduplicated_size,
+		ss->num_reflinked,
+		ss->reflinked_size,
+		ss->num_split,
+		ss->split_size,
+		ss->max_link_count,
+		ss->duration,
+		ss->sync_ms,
+		ss->exit_status
+	);
+	ret = 1;
+	if (fflush(f) == EOF || fsync(fileno(f)) < 0)
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+	if (fclose(f) == EOF && ret >= 0)
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+	if (ret >= 0)
+		ret = dss_rename(tmp, name);
+out:
+	if (ret < 0) {
+		unlink(tmp);
+		DSS_WARNING_LOG(("can not write %s: %s\n", name,
+			dss_strerror(-ret)));
+	}
+	free(tmp);
+	free(name);
+	return ret;
+}
+
+/**
+ * Remove the statistics file of a snapshot.
+ *
+ * \param snapshot_name The name of the snapshot directory.
+ *
+ * It is not an error if the snapshot has no statistics file.
+ */
+void remove_snapshot_stats(const char *snapshot_name)
+{
+	char *name = stats_file_name(snapshot_name);
+
+	if (unlink(name) < 0 && errno != ENOENT)
+		DSS_WARNING_LOG(("can not remove %s: %s\n", name,
+			strerror(errno)));
+	free(name);
+}
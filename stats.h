@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/** \file stats.h Per-snapshot statistics, see stats.c. */
+
+/** What we know about the creation of one snapshot. */
+struct snapshot_stats {
+	/** Number of files in the snapshot, as reported by rsync. */
+	int64_t num_files;
+	/** Number of regular files rsync had to transfer. */
+	int64_t num_transferred;
+	/** Total size of all files in the snapshot, in bytes. */
+	int64_t total_size;
+	/** Size of the transferred files, in bytes. */
+	int64_t transferred_size;
+	/** Number of bytes which were actually sent over the wire. */
+	int64_t literal_data;
+	/** Number of files passed to follow-up rsync passes. */
+	int64_t num_retried;
+	/** How often rsync was restarted due to exit code 12 or 13. */
+	int64_t num_restarts;
+	/** Most bytes of partial files which survived any single restart. */
+	int64_t partial_size;
+	/** Number of moved files which were hardlinked after the transfer. */
+	int64_t num_deduplicated;
+	/** Total size of these files, in bytes. */
+	int64_t deduplicated_size;
+	/** Number of modified files which were replaced by reflinks. */
+	int64_t num_reflinked;
+	/** Bytes these files share with their previous version. */
+	int64_t reflinked_size;
+	/** Number of files which got a new inode due to the link limit. */
+	int64_t num_split;
+	/** Total size of these files, in bytes. */
+	int64_t split_size;
+	/** The maximal link count among the files of the snapshot. */
+	int64_t max_link_count;
+	/** Seconds between creation and completion of the snapshot. */
+	int64_t duration;
+	/** Milliseconds spent flushing the snapshot to disk. */
+	int64_t sync_ms;
+	/** Exit status of the (last) rsync process. */
+	int exit_status;
+};
+
+/**
+ * Bytes of unchanged files.
+ *
+ * These were hardlinked against the reference snapshot rather than copied.
+ */
+_static_inline_ int64_t linked_size(const struct snapshot_stats *ss)
+{
+	if (ss->total_size < ss->transferred_size)
+		return 0;
+	return ss->total_size - ss->transferred_size;
+}
+
+int parse_rsync_stats_line(const char *line, struct snapshot_stats *ss,
+		int add);
+int write_snapshot_stats(const char *snapshot_name,
+		const struct snapshot_stats *ss);
+void remove_snapshot_stats(const char *snapshot_name);
@@ -0,0 +1,831 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/**
+ * \file tar.c Unpack a tar stream into a snapshot.
+ *
+ * Some sources can neither run rsync nor be reached by ssh, but are able to
+ * produce a tar archive. This file implements an extractor for such archives
+ * which reads the archive sequentially from a file descriptor, typically a
+ * pipe, and never looks back. It understands the ustar format and the GNU and
+ * pax extensions for long names.
+ *
+ * A regular file whose path, size, modification time and permissions match
+ * the file under the same path in the reference snapshot is hardlinked
+ * against this file, and its contents in the stream are skipped. Otherwise the
+ * contents are moved from the pipe to the new file with splice(2), without
+ * copying them to user space.
+ */
+
+#define _GNU_SOURCE /* splice() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "gcc-compat.h"
+#include "log.h"
+#include "err.h"
+#include "str.h"
+#include "file.h"
+#include "tar.h"
+
+#define TAR_BLOCK_SIZE 512
+/* Upper bound for the size of long names and pax headers. */
+#define TAR_MAX_BLOB_SIZE (1024 * 1024)
+#define TAR_BUFSIZE (64 * 1024)
+
+/* The ustar header, padded to TAR_BLOCK_SIZE. */
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+/** One member of the archive. */
+struct tar_entry {
+	/** Path relative to the root of the archive. */
+	char *path;
+	/** Target of symbolic and hard links. */
+	char *linkname;
+	/** The typeflag of the header. */
+	char type;
+	/** Permission bits. */
+	mode_t mode;
+	/** Numeric owner. */
+	uid_t uid;
+	/** Numeric group. */
+	gid_t gid;
+	/** Size of the data which follows the header. */
+	int64_t size;
+	/** Modification time. */
+	struct timespec mtime;
+	/** For device files. */
+	unsigned devmajor, devminor;
+};
+
+/* Directories whose metadata is applied after their contents were written. */
+struct tar_dir {
+	char *path;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	struct timespec mtime;
+	/* Created as the parent of an entry, not listed in the archive (yet). */
+	int implicit;
+};
+
+struct tar_data {
+	/** The archive. */
+	int fd;
+	/** Where the archive is unpacked. */
+	const char *dest;
+	/** NULL if there is no reference snapshot. */
+	const char *reference;
+	/** Cleared once splice(2) failed for the input. */
+	int can_splice;
+	/** Where skipped data is spliced to. */
+	int null_fd;
+	/** Whether ownership can be restored. */
+	int is_root;
+	/** Overrides from GNU long name and pax headers, for the next entry. */
+	char *long_name, *long_link;
+	/** Size from a pax header, negative if unset. */
+	int64_t pax_size;
+	/** Whether the pax header contained an mtime. */
+	int have_pax_mtime;
+	/** The mtime of the pax header. */
+	struct timespec pax_mtime;
+	struct tar_dir *dirs;
+	unsigned num_dirs, dirs_array_size;
+	/** Statistics, in the format of rsync. */
+	int64_t num_files, num_written, total_size, written_size;
+};
+
+/* Returns 1 if n bytes were read, 0 on EOF before the first byte. */
+static int read_full(int fd, char *buf, size_t n)
+{
+	size_t done = 0;
+
+	while (done < n) {
+		ssize_t ret = read(fd, buf + done, n - done);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -ERRNO_TO_DSS_ERROR(errno);
+		}
+		if (ret == 0)
+			return done == 0? 0 : -E_TAR_FORMAT;
+		done += ret;
+	}
+	return 1;
+}
+
+static int write_full(int fd, const char *buf, size_t n)
+{
+	size_t done = 0;
+
+	while (done < n) {
+		ssize_t ret = write(fd, buf + done, n - done);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -ERRNO_TO_DSS_ERROR(errno);
+		}
+		done += ret;
+	}
+	return 1;
+}
+
+/*
+ * Move exactly size bytes of the archive to out_fd, or drop them if out_fd is
+ * negative.
+ */
+static int copy_data(struct tar_data *td, int out_fd, int64_t size)
+{
+	char *buf = NULL;
+	int ret = 1;
+
+	while (size > 0) {
+		size_t n = size > TAR_BUFSIZE? TAR_BUFSIZE : size;
+
+		if (td->can_splice) {
+			ssize_t spliced = splice(td->fd, NULL, out_fd >= 0?
+				out_fd : td->null_fd, NULL, n, SPLICE_F_MOVE);
+
+			if (spliced > 0) {
+				size -= spliced;
+				continue;
+			}
+			if (spliced == 0) {
+				ret = -E_TAR_FORMAT;
+				break;
+			}
+			if (errno == EINTR)
+				continue;
+			if (errno != EINVAL && errno != ESPIPE) {
+				ret = -ERRNO_TO_DSS_ERROR(errno);
+				break;
+			}
+			/* input is not a pipe */
+			td->can_splice = 0;
+		}
+		if (!buf)
+			buf = dss_malloc(TAR_BUFSIZE);
+		ret = read_full(td->fd, buf, n);
+		if (ret == 0)
+			ret = -E_TAR_FORMAT;
+		if (ret < 0)
+			break;
+		if (out_fd >= 0) {
+			ret = write_full(out_fd, buf, n);
+			if (ret < 0)
+				break;
+		}
+		size -= n;
+	}
+	free(buf);
+	return ret;
+}
+
+/* Data is padded to a multiple of the block size. */
+static int skip_padding(struct tar_data *td, int64_t size)
+{
+	char buf[TAR_BLOCK_SIZE];
+	size_t pad = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+	int ret;
+
+	if (pad == 0)
+		return 1;
+	ret = read_full(td->fd, buf, pad);
+	return ret == 0? -E_TAR_FORMAT : ret;
+}
+
+static int skip_data(struct tar_data *td, int64_t size)
+{
+	int ret = copy_data(td, -1, size);
+
+	if (ret < 0)
+		return ret;
+	return skip_padding(td, size);
+}
+
+/* Read the data of a long name or pax header into a string. */
+static int read_blob(struct tar_data *td, int64_t size, char **result)
+{
+	int ret;
+
+	*result = NULL;
+	if (size < 0 || size > TAR_MAX_BLOB_SIZE)
+		return -E_TAR_FORMAT;
+	*result = dss_malloc(size + 1);
+	ret = read_full(td->fd, *result, size);
+	if (ret == 0 && size > 0)
+		ret = -E_TAR_FORMAT;
+	if (ret >= 0)
+		ret = skip_padding(td, size);
+	if (ret < 0) {
+		free(*result);
+		*result = NULL;
+		return ret;
+	}
+	(*result)[size] = '\0';
+	return 1;
+}
+
+/* Numeric fields are octal, or base-256 if the high bit is set. */
+static int64_t parse_number(const char *field, size_t len)
+{
+	int64_t val = 0;
+	size_t i;
+
+	if (field[0] & 0x80) { /* negative values are not supported */
+		val = field[0] & 0x7f;
+		for (i = 1; i < len; i++)
+			val = (val << 8) | (unsigned char)field[i];
+		return val;
+	}
+	for (i = 0; i < len && (field[i] == ' ' || field[i] == '\0'); i++)
+		;
+	for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+		val = val * 8 + field[i] - '0';
+	return val;
+}
+
+static int checksum_ok(const struct tar_header *h)
+{
+	const unsigned char *p = (const unsigned char *)h;
+	int64_t expected = parse_number(h->chksum, sizeof(h->chksum));
+	unsigned sum = 0;
+	int ssum = 0, i;
+
+	for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+		int in_chksum = i >= offsetof(struct tar_header, chksum)
+			&& i < offsetof(struct tar_header, typeflag);
+		unsigned char c = in_chksum? ' ' : p[i];
+
+		sum += c;
+		ssum += (signed char)c;
+	}
+	/* some old implementations used signed chars */
+	return expected == sum || expected == ssum;
+}
+
+static int is_zero_block(const char *buf)
+{
+	int i;
+
+	for (i = 0; i < TAR_BLOCK_SIZE; i++)
+		if (buf[i])
+			return 0;
+	return 1;
+}
+
+/* Copy a header field which is not necessarily terminated. */
+static char *field_string(const char *field, size_t len)
+{
+	char *s = dss_malloc(len + 1);
+
+	memcpy(s, field, len);
+	s[len] = '\0';
+	return s;
+}
+
+/*
+ * Strip leading slashes and "./" components. Returns NULL if the path leaves
+ * the archive root, and the empty string for the root itself.
+ */
+static char *sanitize_path(char *path)
+{
+	char *p, *comp;
+	size_t len;
+
+	for (;;) {
+		if (path[0] == '/')
+			path++;
+		else if (path[0] == '.' && path[1] == '/')
+			path += 2;
+		else if (path[0] == '.' && path[1] == '\0')
+			path++;
+		else
+			break;
+	}
+	len = strlen(path);
+	while (len > 0 && path[len - 1] == '/')
+		path[--len] = '\0';
+	for (p = path; p; p = strchr(p, '/')) {
+		comp = p == path? p : ++p;
+		if (comp[0] == '.' && comp[1] == '.'
+				&& (comp[2] == '/' || comp[2] == '\0'))
+			return NULL;
+	}
+	return path;
+}
+
+/* Parse "<len> <key>=<value>\n" records. Only a few keys are of interest. */
+static int parse_pax_header(struct tar_data *td, char *buf, size_t size)
+{
+	char *p = buf, *end = buf + size;
+
+	while (p < end) {
+		char *space, *eq, *val, *rec_end;
+		long len = strtol(p, &space, 10);
+
+		if (len <= 0 || *space != ' ' || len > end - p)
+			return -E_TAR_FORMAT;
+		rec_end = p + len - 1;
+		if (*rec_end != '\n')
+			return -E_TAR_FORMAT;
+		*rec_end = '\0';
+		eq = strchr(space + 1, '=');
+		if (!eq)
+			return -E_TAR_FORMAT;
+		*eq = '\0';
+		val = eq + 1;
+		if (!strcmp(space + 1, "path")) {
+			free(td->long_name);
+			td->long_name = dss_strdup(val);
+		} else if (!strcmp(space + 1, "linkpath")) {
+			free(td->long_link);
+			td->long_link = dss_strdup(val);
+		} else if (!strcmp(space + 1, "size")) {
+			td->pax_size = strtoll(val, NULL, 10);
+		} else if (!strcmp(space + 1, "mtime")) {
+			char *dot;
+
+			td->pax_mtime.tv_sec = strtoll(val, &dot, 10);
+			td->pax_mtime.tv_nsec = 0;
+			if (*dot == '.') {
+				const char *q = dot + 1;
+				long nsec = 0;
+				int i;
+
+				/* at most nine digits, missing ones are zero */
+				for (i = 0; i < 9; i++) {
+					nsec *= 10;
+					if (*q >= '0' && *q <= '9')
+						nsec += *q++ - '0';
+				}
+				td->pax_mtime.tv_nsec = nsec;
+			}
+			td->have_pax_mtime = 1;
+		}
+		p = rec_end + 1;
+	}
+	return 1;
+}
+
+static void clear_overrides(struct tar_data *td)
+{
+	free(td->long_name);
+	td->long_name = NULL;
+	free(td->long_link);
+	td->long_link = NULL;
+	td->pax_size = -1;
+	td->have_pax_mtime = 0;
+}
+
+static void set_metadata(struct tar_data *td, const char *path, char type,
+		mode_t mode, uid_t uid, gid_t gid, const struct timespec *mtime)
+{
+	struct timespec times[2] = {*mtime, *mtime};
+
+	if (td->is_root && lchown(path, uid, gid) < 0)
+		DSS_WARNING_LOG(("lchown %s: %s\n", path, strerror(errno)));
+	if (type != '2' && chmod(path, mode & 07777) < 0)
+		DSS_WARNING_LOG(("chmod %s: %s\n", path, strerror(errno)));
+	if (utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW) < 0)
+		DSS_WARNING_LOG(("utimensat %s: %s\n", path, strerror(errno)));
+}
+
+static void add_dir(struct tar_data *td, const char *path, mode_t mode,
+		uid_t uid, gid_t gid, const struct timespec *mtime, int implicit)
+{
+	struct tar_dir *d;
+
+	if (td->num_dirs >= td->dirs_array_size) {
+		td->dirs_array_size = 2 * td->dirs_array_size + 16;
+		td->dirs = dss_realloc(td->dirs,
+			td->dirs_array_size * sizeof(*td->dirs));
+	}
+	d = td->dirs + td->num_dirs++;
+	d->path = dss_strdup(path);
+	d->mode = mode;
+	d->uid = uid;
+	d->gid = gid;
+	d->mtime = *mtime;
+	d->implicit = implicit;
+}
+
+/*
+ * Check that no parent directory of rel under root is a symbolic link. An
+ * archive could otherwise replace a directory by a link to some other place,
+ * and later entries would be written through this link. Returns zero if a
+ * parent does not exist.
+ */
+static int check_parents(const char *root, const char *rel)
+{
+	char *tmp = make_message("%s/%s", root, rel), *p;
+	struct stat st;
+	int ret = 1;
+
+	for (p = strchr(tmp + strlen(root) + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (lstat(tmp, &st) < 0)
+			ret = errno == ENOENT? 0 : -ERRNO_TO_DSS_ERROR(errno);
+		else if (!S_ISDIR(st.st_mode))
+			ret = S_ISLNK(st.st_mode)? -E_TAR_PATH : 0;
+		*p = '/';
+		if (ret <= 0)
+			break;
+	}
+	free(tmp);
+	return ret;
+}
+
+/*
+ * Create missing parent directories of an entry. Symbolic links are not
+ * followed, see check_parents(). Other files in the way are removed. New
+ * directories get mode 0700 until all entries were extracted.
+ */
+static int make_parents(struct tar_data *td, const struct tar_entry *e)
+{
+	char *tmp = make_message("%s/%s", td->dest, e->path), *p;
+	struct stat st;
+	int ret = 1;
+
+	for (p = strchr(tmp + strlen(td->dest) + 1, '/'); p;
+			p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (lstat(tmp, &st) == 0) {
+			if (S_ISLNK(st.st_mode))
+				ret = -E_TAR_PATH;
+			else if (!S_ISDIR(st.st_mode) && unlink(tmp) < 0)
+				ret = -ERRNO_TO_DSS_ERROR(errno);
+			else if (S_ISDIR(st.st_mode)) {
+				*p = '/';
+				continue;
+			}
+		} else if (errno != ENOENT)
+			ret = -ERRNO_TO_DSS_ERROR(errno);
+		if (ret >= 0) {
+			if (mkdir(tmp, 0700) < 0)
+				ret = -ERRNO_TO_DSS_ERROR(errno);
+			else
+				add_dir(td, tmp, 0755, getuid(), getgid(),
+					&e->mtime, 1);
+		}
+		if (ret < 0) {
+			DSS_ERROR_LOG(("%s: %s\n", tmp, dss_strerror(-ret)));
+			break;
+		}
+		*p = '/';
+	}
+	free(tmp);
+	return ret;
+}
+
+/* Remove whatever is in the way of a new entry. */
+static int clear_path(const char *path, char type)
+{
+	struct stat st;
+
+	if (lstat(path, &st) < 0)
+		return 1;
+	if (S_ISDIR(st.st_mode)) {
+		if (type == '5')
+			return 1;
+		return remove_tree(path);
+	}
+	if (unlink(path) < 0)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	return 1;
+}
+
+/* Returns positive if the file could be hardlinked against the reference. */
+static int link_reference_file(struct tar_data *td, const struct tar_entry *e,
+		const char *path)
+{
+	char *ref_path;
+	struct stat st;
+	int ret = 0;
+
+	if (!td->reference)
+		return 0;
+	if (check_parents(td->reference, e->path) <= 0)
+		return 0;
+	ref_path = make_message("%s/%s", td->reference, e->path);
+	if (lstat(ref_path, &st) < 0 || !S_ISREG(st.st_mode))
+		goto out;
+	if (st.st_size != e->size || st.st_mtime != e->mtime.tv_sec)
+		goto out;
+	if ((st.st_mode & 07777) != (e->mode & 07777))
+		goto out;
+	if (td->is_root && (st.st_uid != e->uid || st.st_gid != e->gid))
+		goto out;
+	if (link(ref_path, path) < 0) { /* e.g. EMLINK, copy instead */
+		DSS_DEBUG_LOG(("link %s: %s\n", ref_path, strerror(errno)));
+		goto out;
+	}
+	ret = 1;
+out:
+	free(ref_path);
+	return ret;
+}
+
+static int extract_regular_file(struct tar_data *td, const struct tar_entry *e,
+		const char *path)
+{
+	int ret, fd;
+
+	td->total_size += e->size;
+	if (link_reference_file(td, e, path) > 0)
+		return skip_data(td, e->size);
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		DSS_ERROR_LOG(("%s: %s\n", path, dss_strerror(-ret)));
+		return ret;
+	}
+	ret = copy_data(td, fd, e->size);
+	if (close(fd) < 0 && ret >= 0)
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+	if (ret < 0)
+		return ret;
+	set_metadata(td, path, e->type, e->mode, e->uid, e->gid, &e->mtime);
+	td->num_written++;
+	td->written_size += e->size;
+	return skip_padding(td, e->size);
+}
+
+static void remember_dir(struct tar_data *td, const struct tar_entry *e,
+		const char *path)
+{
+	add_dir(td, path, e->mode, e->uid, e->gid, &e->mtime, 0);
+}
+
+static int extract_entry(struct tar_data *td, struct tar_entry *e)
+{
+	char *path, *target;
+	int ret;
+
+	if (!e->path[0]) { /* the root directory */
+		if (e->type == '5') {
+			remember_dir(td, e, td->dest);
+			return skip_data(td, e->size);
+		}
+		return -E_TAR_PATH;
+	}
+	path = make_message("%s/%s", td->dest, e->path);
+	ret = make_parents(td, e);
+	if (ret < 0)
+		goto out;
+	ret = clear_path(path, e->type);
+	if (ret < 0)
+		goto out;
+	td->num_files++;
+	switch (e->type) {
+	case '0': case '\0': case '7':
+		ret = extract_regular_file(td, e, path);
+		goto out;
+	case '1':
+		target = sanitize_path(e->linkname);
+		if (!target || !target[0] || check_parents(td->dest, target) <= 0) {
+			DSS_ERROR_LOG(("%s: bad link target %s\n", e->path,
+				e->linkname));
+			ret = -E_TAR_PATH;
+			goto out;
+		}
+		target = make_message("%s/%s", td->dest, target);
+		ret = link(target, path) < 0? -ERRNO_TO_DSS_ERROR(errno) : 1;
+		if (ret < 0)
+			DSS_ERROR_LOG(("link %s: %s\n", path, dss_strerror(-ret)));
+		free(target);
+		if (ret < 0)
+			goto out;
+		break;
+	case '2':
+		if (symlink(e->linkname, path) < 0)
+			DSS_WARNING_LOG(("symlink %s: %s\n", path,
+				strerror(errno)));
+		else
+			set_metadata(td, path, e->type, e->mode, e->uid, e->gid,
+				&e->mtime);
+		break;
+	case '5':
+		if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+			ret = -ERRNO_TO_DSS_ERROR(errno);
+			goto out;
+		}
+		remember_dir(td, e, path);
+		break;
+	case '3': case '4': case '6': {
+		mode_t fmt = e->type == '3'? S_IFCHR : e->type == '4'?
+			S_IFBLK : S_IFIFO;
+
+		if (mknod(path, fmt | (e->mode & 07777),
+				makedev(e->devmajor, e->devminor)) < 0)
+			DSS_WARNING_LOG(("mknod %s: %s\n", path,
+				strerror(errno)));
+		else
+			set_metadata(td, path, e->type, e->mode, e->uid, e->gid,
+				&e->mtime);
+		break;
+	}
+	default:
+		DSS_WARNING_LOG(("%s: unsupported type %c\n", e->path,
+			e->type));
+		td->num_files--;
+	}
+	ret = skip_data(td, e->size);
+out:
+	free(path);
+	return ret;
+}
+
+static void parse_header(struct tar_data *td, const struct tar_header *h,
+		struct tar_entry *e)
+{
+	if (td->long_name)
+		e->path = dss_strdup(td->long_name);
+	else if (!memcmp(h->magic, "ustar", 5) && h->prefix[0]) {
+		char *prefix = field_string(h->prefix, sizeof(h->prefix)),
+			*name = field_string(h->name, sizeof(h->name));
+
+		e->path = make_message("%s/%s", prefix, name);
+		free(prefix);
+		free(name);
+	} else
+		e->path = field_string(h->name, sizeof(h->name));
+	e->linkname = td->long_link? dss_strdup(td->long_link) :
+		field_string(h->linkname, sizeof(h->linkname));
+	e->type = h->typeflag;
+	e->mode = parse_number(h->mode, sizeof(h->mode));
+	e->uid = parse_number(h->uid, sizeof(h->uid));
+	e->gid = parse_number(h->gid, sizeof(h->gid));
+	e->size = td->pax_size >= 0? td->pax_size :
+		parse_number(h->size, sizeof(h->size));
+	if (td->have_pax_mtime)
+		e->mtime = td->pax_mtime;
+	else {
+		e->mtime.tv_sec = parse_number(h->mtime, sizeof(h->mtime));
+		e->mtime.tv_nsec = 0;
+	}
+	e->devmajor = parse_number(h->devmajor, sizeof(h->devmajor));
+	e->devminor = parse_number(h->devminor, sizeof(h->devminor));
+}
+
+static int process_header(struct tar_data *td, const struct tar_header *h)
+{
+	struct tar_entry e;
+	char *blob, *path;
+	int64_t size = parse_number(h->size, sizeof(h->size));
+	int ret;
+
+	switch (h->typeflag) {
+	case 'L': /* GNU long name */
+	case 'K': /* GNU long link name */
+		ret = read_blob(td, size, &blob);
+		if (ret < 0)
+			return ret;
+		if (h->typeflag == 'L') {
+			free(td->long_name);
+			td->long_name = blob;
+		} else {
+			free(td->long_link);
+			td->long_link = blob;
+		}
+		return 1;
+	case 'x': /* pax extended header */
+		ret = read_blob(td, size, &blob);
+		if (ret < 0)
+			return ret;
+		ret = parse_pax_header(td, blob, size);
+		free(blob);
+		return ret;
+	case 'g': /* pax global header */
+		return skip_data(td, size);
+	}
+	memset(&e, 0, sizeof(e));
+	parse_header(td, h, &e);
+	clear_overrides(td);
+	path = sanitize_path(e.path);
+	if (!path) {
+		DSS_ERROR_LOG(("refusing to extract %s\n", e.path));
+		ret = -E_TAR_PATH;
+		goto out;
+	}
+	memmove(e.path, path, strlen(path) + 1);
+	ret = extract_entry(td, &e);
+out:
+	free(e.path);
+	free(e.linkname);
+	return ret;
+}
+
+/**
+ * Unpack a tar archive.
+ *
+ * \param fd The archive is read from this file descriptor.
+ * \param dest Existing directory to unpack the archive into.
+ * \param reference Regular files are hardlinked against this snapshot if
+ * possible. May be \p NULL.
+ *
+ * On success, statistics about the extracted files are written to stdout, in
+ * the same format as the statistics of rsync.
+ *
+ * \return Standard.
+ */
+int extract_tar(int fd, const char *dest, const char *reference)
+{
+	struct tar_data td;
+	char buf[TAR_BLOCK_SIZE];
+	unsigned u;
+	int ret, pass;
+
+	memset(&td, 0, sizeof(td));
+	td.fd = fd;
+	td.dest = dest;
+	td.reference = reference;
+	td.can_splice = 1;
+	td.pax_size = -1;
+	td.is_root = geteuid() == 0;
+	td.null_fd = open("/dev/null", O_WRONLY);
+	if (td.null_fd < 0)
+		return -E_NULL_OPEN;
+	for (;;) {
+		ret = read_full(fd, buf, TAR_BLOCK_SIZE);
+		if (ret == 0) /* no end-of-archive marker, tolerated */
+			break;
+		if (ret < 0)
+			goto out;
+		if (is_zero_block(buf))
+			break;
+		if (!checksum_ok((struct tar_header *)buf)) {
+			ret = -E_TAR_FORMAT;
+			goto out;
+		}
+		ret = process_header(&td, (struct tar_header *)buf);
+		if (ret < 0)
+			goto out;
+	}
+	/*
+	 * Innermost directories first. Implicitly created directories go
+	 * first, so that the metadata from the archive wins if a directory
+	 * is listed after its contents.
+	 */
+	for (pass = 1; pass >= 0; pass--) {
+		for (u = td.num_dirs; u > 0; u--) {
+			struct tar_dir *d = td.dirs + u - 1;
+
+			if (d->implicit != pass)
+				continue;
+			set_metadata(&td, d->path, '5', d->mode, d->uid,
+				d->gid, &d->mtime);
+		}
+	}
+	printf("Number of files: %" PRId64 "\n", td.num_files);
+	printf("Number of regular files transferred: %" PRId64 "\n",
+		td.num_written);
+	printf("Total file size: %" PRId64 " bytes\n", td.total_size);
+	printf("Total transferred file size: %" PRId64 " bytes\n",
+		td.written_size);
+	printf("Literal data: %" PRId64 " bytes\n", td.written_size);
+	ret = 1;
+out:
+	clear_overrides(&td);
+	for (u = 0; u < td.num_dirs; u++)
+		free(td.dirs[u].path);
+	free(td.dirs);
+	close(td.null_fd);
+	if (ret < 0)
+		DSS_ERROR_LOG(("%s\n", dss_strerror(-ret)));
+	return ret;
+}
@@ -0,0 +1,9 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/** \file tar.h Tar stream extraction, see tar.c. */
+
+int extract_tar(int fd, const char *dest, const char *reference);
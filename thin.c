@@ -0,0 +1,1066 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/**
+ * \file thin.c Thin snapshots.
+ *
+ * A thin snapshot only contains the files which were changed or added since
+ * its base snapshot was created, and the directories leading to them (rsync
+ * -m). Empty directories are therefore not kept. The base snapshot is
+ * an ordinary (full) snapshot. Files which were removed since then are listed
+ * in a sidecar file next to the snapshot directory whose name is the name of
+ * the snapshot with ".thin" appended. Its first line names the base snapshot,
+ * each of the remaining lines contains one deleted path:
+ *
+ *	base: 2011-02-01T04-00-00+0100--PT3600S
+ *	deleted: some/dir
+ *	deleted: some/file
+ *
+ * Paths are stored as printed by rsync, i.e. with non-printable characters
+ * escaped as \#ooo. A deleted directory implies all of its contents.
+ *
+ * rsync does not tell which files of the --compare-dest directory are missing
+ * on the source. Instead, the main rsync run itemizes every path of the source
+ * (-ii), and the paths of the base snapshot which were not itemized are
+ * deleted. This needs only a local walk of the base snapshot.
+ *
+ * All thin snapshots of a base snapshot are based directly on it, never on
+ * another thin snapshot. The contents of a thin snapshot are therefore given
+ * by the contents of its base, minus the deleted paths, overlaid with the
+ * files of the thin snapshot.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "gcc-compat.h"
+#include "log.h"
+#include "err.h"
+#include "str.h"
+#include "file.h"
+#include "thin.h"
+
+static char *thin_info_name(const char *snapshot_name)
+{
+	return make_message("%s.thin", snapshot_name);
+}
+
+/* Append path without trailing slashes, ignoring the top directory. */
+static void add_path(char ***paths, unsigned *num, unsigned *size,
+		const char *path)
+{
+	size_t len = strlen(path);
+
+	while (len > 0 && path[len - 1] == '/')
+		len--;
+	if (len == 0 || (len == 1 && path[0] == '.'))
+		return;
+	if (*num >= *size) {
+		*size = 2 * *size + 1;
+		*paths = dss_realloc(*paths, *size * sizeof(char *));
+	}
+	(*paths)[*num] = dss_malloc(len + 1);
+	memcpy((*paths)[*num], path, len);
+	(*paths)[*num][len] = '\0';
+	(*num)++;
+}
+
+static void add_deleted(struct thin_info *ti, const char *path)
+{
+	add_path(&ti->deleted, &ti->num_deleted, &ti->array_size, path);
+	ti->sorted = 0;
+}
+
+/* Undo rsync's escaping of non-printable characters as \#ooo. */
+static void unescape_path(char *path)
+{
+	char *in, *out;
+
+	for (in = out = path; *in; in++, out++) {
+		if (in[0] == '\\' && in[1] == '#' && in[2] >= '0' && in[2] <= '3'
+				&& in[3] >= '0' && in[3] <= '7'
+				&& in[4] >= '0' && in[4] <= '7') {
+			*out = (in[2] - '0') * 64 + (in[3] - '0') * 8 + in[4] - '0';
+			in += 4;
+			continue;
+		}
+		*out = *in;
+	}
+	*out = '\0';
+}
+
+static void write_escaped_path(FILE *f, const char *path)
+{
+	const char *p;
+
+	for (p = path; *p; p++) {
+		unsigned char c = *p;
+
+		if (c < 32 || c == 127 || (c == '\\' && p[1] == '#'))
+			fprintf(f, "\\#%03o", c);
+		else
+			fputc(c, f);
+	}
+	fputc('\n', f);
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * Record that a path of the base snapshot was deleted.
+ *
+ * \param ti The deletion list of this structure is extended.
+ * \param rsync_path The path as printed by rsync, relative to the snapshot.
+ */
+void thin_info_add_deleted(struct thin_info *ti, const char *rsync_path)
+{
+	char *path = dss_strdup(rsync_path);
+
+	unescape_path(path);
+	add_deleted(ti, path);
+	free(path);
+}
+
+/**
+ * Record a path of the source from the --itemize-changes output of rsync.
+ *
+ * \param ti The list of present paths of this structure is extended.
+ * \param line One line of output of rsync -ii, without the newline.
+ *
+ * \return Non-zero if \a line was itemized output, zero otherwise.
+ */
+int thin_info_add_itemized(struct thin_info *ti, const char *line)
+{
+	char *path, *p;
+
+	/* YXcstpoguax, a space, the path */
+	if (strlen(line) < 13 || line[11] != ' ')
+		return 0;
+	if (!strchr("<>ch.*", line[0]))
+		return 0;
+	if (line[0] == '*') /* *deleting: the path is not in the source */
+		return !strncmp(line, "*deleting", 9);
+	if (!strchr("fdLDS", line[1]))
+		return 0;
+	path = dss_strdup(line + 12);
+	/* %L: symlink target, or hardlink target with -H */
+	if (line[1] == 'L')
+		p = strstr(path, " -> ");
+	else if (line[0] == 'h')
+		p = strstr(path, " => ");
+	else
+		p = NULL;
+	if (p)
+		*p = '\0';
+	unescape_path(path);
+	add_path(&ti->present, &ti->num_present, &ti->present_size, path);
+	free(path);
+	return 1;
+}
+
+struct deleted_paths_data {
+	const char *base;
+	struct thin_info *ti;
+};
+
+static int print_deleted_path(const char *path, const struct stat *st,
+		void *private)
+{
+	struct deleted_paths_data *dpd = private;
+	const char *rel = path + strlen(dpd->base) + 1;
+
+	if (bsearch(&rel, dpd->ti->present, dpd->ti->num_present,
+			sizeof(char *), compare_paths))
+		return S_ISDIR(st->st_mode);
+	/* contents of a deleted directory are implied */
+	printf("deleting ");
+	write_escaped_path(stdout, rel);
+	return 0;
+}
+
+/**
+ * Print the paths of the base snapshot which are missing on the source.
+ *
+ * \param ti Contains the paths itemized by rsync.
+ * \param base The base snapshot.
+ *
+ * Each path is written to stdout in the format of rsync --info=del, so that
+ * it can be passed to \ref thin_info_add_deleted().
+ *
+ * \return Standard.
+ */
+int list_deleted_paths(struct thin_info *ti, const char *base)
+{
+	struct deleted_paths_data dpd = {.base = base, .ti = ti};
+	int ret;
+
+	qsort(ti->present, ti->num_present, sizeof(char *), compare_paths);
+	ret = for_each_file_in_tree(base, print_deleted_path, &dpd);
+	if (ret < 0)
+		DSS_ERROR_LOG(("%s: %s\n", base, dss_strerror(-ret)));
+	return ret;
+}
+
+/**
+ * Deallocate the members of a thin_info structure.
+ *
+ * \param ti The structure to clear.
+ */
+void free_thin_info(struct thin_info *ti)
+{
+	unsigned u;
+
+	for (u = 0; u < ti->num_deleted; u++)
+		free(ti->deleted[u]);
+	free(ti->deleted);
+	for (u = 0; u < ti->num_present; u++)
+		free(ti->present[u]);
+	free(ti->present);
+	free(ti->base);
+	memset(ti, 0, sizeof(*ti));
+}
+
+/**
+ * Read the sidecar file of a snapshot.
+ *
+ * \param snapshot_name The name of the snapshot directory.
+ * \param ti Result pointer.
+ *
+ * \return Positive if the snapshot is thin, zero if it is a full snapshot,
+ * negative on errors.
+ */
+int read_thin_info(const char *snapshot_name, struct thin_info *ti)
+{
+	char *name = thin_info_name(snapshot_name), *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	FILE *f;
+	int ret;
+
+	memset(ti, 0, sizeof(*ti));
+	f = fopen(name, "r");
+	if (!f) {
+		ret = errno == ENOENT? 0 : -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	while ((len = getline(&line, &size, f)) > 0) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		if (!strncmp(line, "base: ", 6)) {
+			free(ti->base);
+			ti->base = dss_strdup(line + 6);
+		} else if (!strncmp(line, "deleted: ", 9))
+			thin_info_add_deleted(ti, line + 9);
+	}
+	ret = ferror(f)? -ERRNO_TO_DSS_ERROR(EIO) : 1;
+	fclose(f);
+	if (ret > 0 && !ti->base)
+		ret = -E_THIN_INFO;
+out:
+	if (ret < 0) {
+		DSS_ERROR_LOG(("%s: %s\n", name, dss_strerror(-ret)));
+		free_thin_info(ti);
+	}
+	free(line);
+	free(name);
+	return ret;
+}
+
+/**
+ * Write the sidecar file of a thin snapshot.
+ *
+ * \param snapshot_name The name of the snapshot directory.
+ * \param ti The information to store.
+ *
+ * The file is replaced atomically.
+ *
+ * \return Standard.
+ */
+int write_thin_info(const char *snapshot_name, struct thin_info *ti)
+{
+	char *name = thin_info_name(snapshot_name),
+		*tmp = make_message("%s.tmp", name);
+	FILE *f = fopen(tmp, "w");
+	unsigned u;
+	int ret;
+
+	if (!f) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	fprintf(f, "base: %s\n", ti->base);
+	for (u = 0; u < ti->num_deleted; u++) {
+		fprintf(f, "deleted: ");
+		write_escaped_path(f, ti->deleted[u]);
+	}
+	ret = ferror(f)? -ERRNO_TO_DSS_ERROR(EIO) : 1;
+	if (fclose(f) == EOF && ret >= 0)
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+	if (ret >= 0)
+		ret = dss_rename(tmp, name);
+	if (ret < 0)
+		unlink(tmp);
+out:
+	if (ret < 0)
+		DSS_ERROR_LOG(("can not write %s: %s\n", name,
+			dss_strerror(-ret)));
+	free(tmp);
+	free(name);
+	return ret;
+}
+
+/**
+ * Remove the sidecar file of a snapshot, if any.
+ *
+ * \param snapshot_name The name of the snapshot directory.
+ */
+void remove_thin_info(const char *snapshot_name)
+{
+	char *name = thin_info_name(snapshot_name);
+
+	if (unlink(name) < 0 && errno != ENOENT)
+		DSS_WARNING_LOG(("can not remove %s: %s\n", name,
+			strerror(errno)));
+	free(name);
+}
+
+/* Whether path, or one of its parent directories, is in the deletion list. */
+static int is_deleted(struct thin_info *ti, const char *path)
+{
+	char *p, *slash;
+	int ret = 0;
+
+	if (ti->num_deleted == 0)
+		return 0;
+	if (!ti->sorted) {
+		qsort(ti->deleted, ti->num_deleted, sizeof(char *),
+			compare_paths);
+		ti->sorted = 1;
+	}
+	p = dss_strdup(path);
+	for (;;) {
+		if (bsearch(&p, ti->deleted, ti->num_deleted, sizeof(char *),
+				compare_paths)) {
+			ret = 1;
+			break;
+		}
+		slash = strrchr(p, '/');
+		if (!slash)
+			break;
+		*slash = '\0';
+	}
+	free(p);
+	return ret;
+}
+
+static int exists(const char *path, struct stat *st)
+{
+	struct stat dummy;
+
+	return lstat(path, st? st : &dummy) == 0;
+}
+
+static void copy_dir_metadata(const char *path, const struct stat *st)
+{
+	struct timespec times[2] = {st->st_atim, st->st_mtim};
+
+	/* Ownership can only be preserved if we are root. */
+	if (lchown(path, st->st_uid, st->st_gid) < 0 && errno != EPERM)
+		DSS_WARNING_LOG(("%s: %s\n", path, strerror(errno)));
+	if (chmod(path, st->st_mode & 07777) < 0)
+		DSS_WARNING_LOG(("%s: %s\n", path, strerror(errno)));
+	if (utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW) < 0)
+		DSS_WARNING_LOG(("%s: %s\n", path, strerror(errno)));
+}
+
+static int make_dir(const char *path)
+{
+	if (mkdir(path, 0700) < 0 && errno != EEXIST)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	return 1;
+}
+
+/* Hardlink a non-directory, replacing whatever is in the way. */
+static int link_entry(const char *src, const char *dst)
+{
+	int ret = remove_tree(dst);
+
+	if (ret < 0)
+		return ret;
+	if (linkat(AT_FDCWD, src, AT_FDCWD, dst, 0) < 0)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	return 1;
+}
+
+struct link_tree_data {
+	/** The tree to be linked. */
+	const char *src;
+	/** Where to create the links. */
+	const char *dst;
+	/** Entries for which this returns non-zero are skipped. */
+	int (*skip)(const char *rel, const struct stat *st, void *data);
+	/** Passed to \a skip. */
+	void *skip_data;
+};
+
+static int link_tree_entry(const char *path, const struct stat *st,
+		void *private)
+{
+	struct link_tree_data *ltd = private;
+	const char *rel = path + strlen(ltd->src) + 1;
+	char *dst;
+	int ret;
+
+	if (ltd->skip && ltd->skip(rel, st, ltd->skip_data))
+		return 0;
+	dst = make_message("%s/%s", ltd->dst, rel);
+	if (S_ISDIR(st->st_mode))
+		ret = make_dir(dst);
+	else
+		ret = link_entry(path, dst);
+	if (ret < 0)
+		DSS_ERROR_LOG(("%s: %s\n", dst, dss_strerror(-ret)));
+	free(dst);
+	return ret;
+}
+
+/*
+ * Recreate the tree src under dst, hardlinking all files. Directories are
+ * created with mode 0700, see fix_dir_metadata().
+ */
+static int link_tree(const char *src, const char *dst,
+		int (*skip)(const char *, const struct stat *, void *),
+		void *skip_data)
+{
+	struct link_tree_data ltd = {
+		.src = src,
+		.dst = dst,
+		.skip = skip,
+		.skip_data = skip_data
+	};
+	struct stat st;
+	int ret;
+
+	if (lstat(src, &st) < 0)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	if (!S_ISDIR(st.st_mode))
+		return link_entry(src, dst);
+	ret = make_dir(dst);
+	if (ret < 0)
+		return ret;
+	return for_each_file_in_tree(src, link_tree_entry, &ltd);
+}
+
+struct fix_dir_data {
+	const char *dst;
+	/* Metadata is taken from the first of these which has the directory. */
+	const char *src[2];
+};
+
+static void fix_dir(const char *path, const char *rel, struct fix_dir_data *fdd)
+{
+	int i;
+
+	for (i = 0; i < 2 && fdd->src[i]; i++) {
+		char *src = make_message("%s%s%s", fdd->src[i], *rel? "/" : "",
+			rel);
+		struct stat st;
+		int ok = exists(src, &st) && S_ISDIR(st.st_mode);
+
+		free(src);
+		if (!ok)
+			continue;
+		copy_dir_metadata(path, &st);
+		return;
+	}
+}
+
+static int fix_dir_entry(const char *path, const struct stat *st,
+		void *private)
+{
+	struct fix_dir_data *fdd = private;
+
+	if (S_ISDIR(st->st_mode))
+		fix_dir(path, path + strlen(fdd->dst) + 1, fdd);
+	return 1;
+}
+
+/*
+ * Directories are modified when entries are linked into them, so their
+ * metadata has to be set after all links were created.
+ */
+static int fix_dir_metadata(const char *dst, const char *src1, const char *src2)
+{
+	struct fix_dir_data fdd = {.dst = dst, .src = {src1, src2}};
+	struct stat st;
+	int ret;
+
+	if (!exists(dst, &st) || !S_ISDIR(st.st_mode))
+		return 1;
+	ret = for_each_file_in_tree(dst, fix_dir_entry, &fdd);
+	fix_dir(dst, "", &fdd);
+	return ret;
+}
+
+struct materialize_data {
+	const char *snapshot;
+	struct thin_info *ti;
+};
+
+/* Skip entries of the base which are deleted or replaced in the snapshot. */
+static int skip_base_entry(const char *rel, const struct stat *st, void *data)
+{
+	struct materialize_data *md = data;
+	char *path;
+	struct stat thin_st;
+	int ret;
+
+	if (is_deleted(md->ti, rel))
+		return 1;
+	path = make_message("%s/%s", md->snapshot, rel);
+	ret = exists(path, &thin_st) && (!S_ISDIR(thin_st.st_mode)
+		|| !S_ISDIR(st->st_mode));
+	free(path);
+	return ret;
+}
+
+/*
+ * Create the full version of a thin snapshot under the name tmp, hardlinking
+ * all files from the base snapshot and the thin snapshot. Neither of the two
+ * is modified.
+ */
+static int build_full_tree(const char *snapshot, struct thin_info *ti,
+		const char *tmp)
+{
+	struct materialize_data md = {.snapshot = snapshot, .ti = ti};
+	int ret = remove_tree(tmp); /* left over from an earlier attempt */
+
+	if (ret < 0)
+		return ret;
+	ret = link_tree(ti->base, tmp, skip_base_entry, &md);
+	if (ret < 0)
+		return ret;
+	ret = link_tree(snapshot, tmp, NULL, NULL);
+	if (ret < 0)
+		return ret;
+	return fix_dir_metadata(tmp, snapshot, ti->base);
+}
+
+/**
+ * Convert a thin snapshot into a full snapshot.
+ *
+ * \param snapshot_name The thin snapshot.
+ * \param ti As obtained from \ref read_thin_info().
+ *
+ * The full tree is created next to the thin snapshot, with all files
+ * hardlinked from the base snapshot and the thin snapshot. It replaces the
+ * thin snapshot only when it is complete. The base snapshot is not modified.
+ *
+ * \return Standard.
+ */
+int materialize_snapshot(const char *snapshot_name, struct thin_info *ti)
+{
+	char *tmp = make_message("%s.materializing", snapshot_name),
+		*old = make_message("%s.thin-old", snapshot_name);
+	int ret;
+
+	DSS_NOTICE_LOG(("materializing %s (base: %s)\n", snapshot_name,
+		ti->base));
+	ret = build_full_tree(snapshot_name, ti, tmp);
+	if (ret < 0)
+		goto out;
+	ret = dss_rename(snapshot_name, old);
+	if (ret < 0)
+		goto out;
+	ret = dss_rename(tmp, snapshot_name);
+	if (ret < 0) {
+		dss_rename(old, snapshot_name);
+		goto out;
+	}
+	remove_thin_info(snapshot_name);
+	ret = remove_tree(old);
+out:
+	if (ret < 0)
+		DSS_ERROR_LOG(("can not materialize %s: %s\n", snapshot_name,
+			dss_strerror(-ret)));
+	free(tmp);
+	free(old);
+	return ret;
+}
+
+/* Create the parent directories of rel under dst, as found under src. */
+static int make_parents(const char *dst, const char *src, const char *rel)
+{
+	char *p = dss_strdup(rel), *slash;
+	int ret = 1;
+
+	for (slash = strchr(p, '/'); slash; slash = strchr(slash + 1, '/')) {
+		char *d, *s;
+		struct stat st;
+
+		*slash = '\0';
+		d = make_message("%s/%s", dst, p);
+		s = make_message("%s/%s", src, p);
+		if (!exists(d, NULL)) {
+			ret = make_dir(d);
+			if (ret >= 0 && exists(s, &st))
+				copy_dir_metadata(d, &st);
+		}
+		free(d);
+		free(s);
+		*slash = '/';
+		if (ret < 0)
+			break;
+	}
+	free(p);
+	return ret;
+}
+
+/*
+ * Give snapshot the version of rel from base, which it shares implicitly
+ * until its base changes.
+ */
+static int take_from_base(const char *snapshot, const char *base,
+		const char *rel)
+{
+	char *src = make_message("%s/%s", base, rel),
+		*dst = make_message("%s/%s", snapshot, rel);
+	int ret = make_parents(snapshot, base, rel);
+
+	if (ret >= 0)
+		ret = link_tree(src, dst, NULL, NULL);
+	if (ret >= 0)
+		ret = fix_dir_metadata(dst, src, NULL);
+	free(src);
+	free(dst);
+	return ret;
+}
+
+struct rebase_data {
+	/** The thin snapshot to rebase. */
+	const char *snapshot;
+	struct thin_info *ti;
+	/** The current base. */
+	const char *base;
+	/** The new base, a thin snapshot of the current base. */
+	const char *new_base;
+	/** Paths to be added to the deletion list of \a ti. */
+	struct thin_info new_deleted;
+};
+
+static int rebase_entry(const char *path, const struct stat *st, void *private)
+{
+	struct rebase_data *rd = private;
+	const char *rel = path + strlen(rd->new_base) + 1;
+	char *p = make_message("%s/%s", rd->snapshot, rel);
+	struct stat snap_st;
+	int ret = 0;
+
+	if (exists(p, &snap_st)) { /* the snapshot has its own version */
+		ret = S_ISDIR(snap_st.st_mode) && S_ISDIR(st->st_mode);
+		goto out;
+	}
+	if (is_deleted(rd->ti, rel))
+		goto out;
+	free(p);
+	p = make_message("%s/%s", rd->base, rel);
+	if (exists(p, NULL))
+		ret = take_from_base(rd->snapshot, rd->base, rel);
+	else /* added in the new base, but not present in the snapshot */
+		add_deleted(&rd->new_deleted, rel);
+	if (ret > 0)
+		ret = 0;
+out:
+	free(p);
+	return ret;
+}
+
+/*
+ * Make a thin snapshot of base a thin snapshot of new_base, which is itself a
+ * thin snapshot of base. Only the entries in which the two differ have to be
+ * looked at: The files of new_base, and the paths it deletes.
+ */
+static int rebase_thin_snapshot(const char *snapshot, struct thin_info *ti,
+		const char *new_base, struct thin_info *new_base_ti)
+{
+	struct rebase_data rd = {
+		.snapshot = snapshot,
+		.ti = ti,
+		.base = ti->base,
+		.new_base = new_base
+	};
+	unsigned u;
+	int ret;
+
+	DSS_INFO_LOG(("rebasing %s onto %s\n", snapshot, new_base));
+	ret = for_each_file_in_tree(new_base, rebase_entry, &rd);
+	if (ret < 0)
+		goto out;
+	for (u = 0; u < new_base_ti->num_deleted; u++) {
+		const char *rel = new_base_ti->deleted[u];
+		char *p = make_message("%s/%s", snapshot, rel);
+		int skip = exists(p, NULL) || is_deleted(ti, rel);
+
+		free(p);
+		if (skip)
+			continue;
+		p = make_message("%s/%s", ti->base, rel);
+		skip = !exists(p, NULL);
+		free(p);
+		if (skip)
+			continue;
+		ret = take_from_base(snapshot, ti->base, rel);
+		if (ret < 0)
+			goto out;
+	}
+	for (u = 0; u < rd.new_deleted.num_deleted; u++)
+		add_deleted(ti, rd.new_deleted.deleted[u]);
+	free(ti->base);
+	ti->base = dss_strdup(new_base);
+	ret = 1;
+out:
+	free_thin_info(&rd.new_deleted);
+	return ret;
+}
+
+/*
+ * Folding a base snapshot touches several snapshots, so it is recorded in a
+ * journal in the dest dir:
+ *
+ *	state: prepare
+ *	base: <the base snapshot>
+ *	first: <its oldest thin snapshot>
+ *	dependent: <each other thin snapshot>
+ *
+ * While the state is "prepare", nothing visible has changed yet: The full
+ * version of the first thin snapshot is built under a temporary name, and the
+ * new sidecar files of the other dependents are written to temporary names as
+ * well. Rebasing adds files of the base to the dependents, which does not
+ * change their contents as long as the base exists. Such a fold is rolled
+ * back.
+ *
+ * Once everything is on disk, the state is changed to "commit", and the
+ * results are published by renames. Each step can be repeated, so a committed
+ * fold is finished by running the remaining steps. Until the base is removed
+ * as the last step, every snapshot is consistent.
+ */
+#define FOLD_JOURNAL ".dss-fold"
+
+/** The snapshots of a fold, as recorded in the journal. */
+struct fold_journal {
+	/** Whether the fold was committed. */
+	int committed;
+	/** The base snapshot which is removed. */
+	char *base;
+	/** The thin snapshot which becomes a full snapshot. */
+	char *first;
+	/** The other thin snapshots, which are rebased onto \a first. */
+	char **dependents;
+	/** The number of entries in \a dependents. */
+	unsigned num_dependents;
+};
+
+/* The full version of the first thin snapshot, until it is published. */
+static char *folded_name(const char *first)
+{
+	return make_message("%s.folding", first);
+}
+
+/* Where the thin version of the first snapshot is moved aside. */
+static char *fold_old_name(const char *first)
+{
+	return make_message("%s.fold-old", first);
+}
+
+/* The new sidecar of a dependent is written as the sidecar of this name. */
+static char *rebased_name(const char *dependent)
+{
+	return make_message("%s.folded", dependent);
+}
+
+static void free_fold_journal(struct fold_journal *fj)
+{
+	unsigned u;
+
+	free(fj->base);
+	free(fj->first);
+	for (u = 0; u < fj->num_dependents; u++)
+		free(fj->dependents[u]);
+	free(fj->dependents);
+	memset(fj, 0, sizeof(*fj));
+}
+
+static int write_fold_journal(const struct fold_journal *fj)
+{
+	FILE *f = fopen(FOLD_JOURNAL ".tmp", "w");
+	unsigned u;
+	int ret;
+
+	if (!f) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	fprintf(f, "state: %s\nbase: %s\nfirst: %s\n",
+		fj->committed? "commit" : "prepare", fj->base, fj->first);
+	for (u = 0; u < fj->num_dependents; u++)
+		fprintf(f, "dependent: %s\n", fj->dependents[u]);
+	ret = ferror(f)? -ERRNO_TO_DSS_ERROR(EIO) : 1;
+	if (fflush(f) == EOF || fsync(fileno(f)) < 0)
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+	if (fclose(f) == EOF && ret >= 0)
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+	if (ret >= 0)
+		ret = dss_rename(FOLD_JOURNAL ".tmp", FOLD_JOURNAL);
+	if (ret >= 0)
+		ret = dss_fsync_dir(".");
+out:
+	if (ret < 0) {
+		unlink(FOLD_JOURNAL ".tmp");
+		DSS_ERROR_LOG(("can not write %s: %s\n", FOLD_JOURNAL,
+			dss_strerror(-ret)));
+	}
+	return ret;
+}
+
+/* Returns zero if there is no journal. */
+static int read_fold_journal(struct fold_journal *fj)
+{
+	FILE *f = fopen(FOLD_JOURNAL, "r");
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int ret;
+
+	memset(fj, 0, sizeof(*fj));
+	if (!f)
+		return errno == ENOENT? 0 : -ERRNO_TO_DSS_ERROR(errno);
+	while ((len = getline(&line, &size, f)) > 0) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		if (!strcmp(line, "state: commit"))
+			fj->committed = 1;
+		else if (!strncmp(line, "base: ", 6)) {
+			free(fj->base);
+			fj->base = dss_strdup(line + 6);
+		} else if (!strncmp(line, "first: ", 7)) {
+			free(fj->first);
+			fj->first = dss_strdup(line + 7);
+		} else if (!strncmp(line, "dependent: ", 11)) {
+			fj->dependents = dss_realloc(fj->dependents,
+				(fj->num_dependents + 1) * sizeof(char *));
+			fj->dependents[fj->num_dependents++]
+				= dss_strdup(line + 11);
+		}
+	}
+	ret = ferror(f)? -ERRNO_TO_DSS_ERROR(EIO) : 1;
+	fclose(f);
+	free(line);
+	if (ret > 0 && (!fj->base || !fj->first))
+		ret = -E_THIN_INFO;
+	if (ret < 0) {
+		DSS_ERROR_LOG(("%s: %s\n", FOLD_JOURNAL, dss_strerror(-ret)));
+		free_fold_journal(fj);
+	}
+	return ret;
+}
+
+/* Remove everything a fold created before it was committed. */
+static int roll_back_fold(const struct fold_journal *fj)
+{
+	char *tmp = folded_name(fj->first);
+	unsigned u;
+	int ret;
+
+	DSS_NOTICE_LOG(("rolling back fold of %s\n", fj->base));
+	ret = remove_tree(tmp);
+	free(tmp);
+	if (ret < 0)
+		return ret;
+	for (u = 0; u < fj->num_dependents; u++) {
+		char *name = rebased_name(fj->dependents[u]);
+
+		remove_thin_info(name);
+		tmp = make_message("%s.thin.tmp", name); /* see write_thin_info() */
+		unlink(tmp);
+		free(tmp);
+		free(name);
+	}
+	if (unlink(FOLD_JOURNAL) < 0 && errno != ENOENT)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	return 1;
+}
+
+/* Publish the results of a committed fold. Each step may have been done. */
+static int finish_fold(const struct fold_journal *fj)
+{
+	char *tmp = folded_name(fj->first), *old = fold_old_name(fj->first),
+		*src, *dst;
+	unsigned u;
+	int ret = 1;
+
+	if (exists(tmp, NULL)) {
+		if (exists(fj->first, NULL)) {
+			ret = dss_rename(fj->first, old);
+			if (ret < 0)
+				goto out;
+		}
+		ret = dss_rename(tmp, fj->first);
+		if (ret < 0)
+			goto out;
+	}
+	remove_thin_info(fj->first);
+	for (u = 0; u < fj->num_dependents; u++) {
+		char *name = rebased_name(fj->dependents[u]);
+
+		src = thin_info_name(name);
+		dst = thin_info_name(fj->dependents[u]);
+		free(name);
+		ret = exists(src, NULL)? dss_rename(src, dst) : 1;
+		free(src);
+		free(dst);
+		if (ret < 0)
+			goto out;
+	}
+	ret = dss_fsync_dir(".");
+	if (ret < 0)
+		goto out;
+	ret = remove_tree(old);
+	if (ret < 0)
+		goto out;
+	ret = remove_tree(fj->base);
+	if (ret < 0)
+		goto out;
+	if (unlink(FOLD_JOURNAL) < 0 && errno != ENOENT)
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+out:
+	free(tmp);
+	free(old);
+	return ret;
+}
+
+/**
+ * Complete or undo a fold which was interrupted.
+ *
+ * Must be called in the dest dir, before any snapshot is modified.
+ *
+ * \return Positive if an interrupted fold was found and dealt with, zero if
+ * there was none, negative on errors.
+ */
+int recover_fold(void)
+{
+	struct fold_journal fj;
+	int ret;
+
+	unlink(FOLD_JOURNAL ".tmp");
+	ret = read_fold_journal(&fj);
+	if (ret <= 0)
+		return ret;
+	if (fj.committed) {
+		DSS_NOTICE_LOG(("finishing fold of %s into %s\n", fj.base,
+			fj.first));
+		ret = finish_fold(&fj);
+	} else
+		ret = roll_back_fold(&fj);
+	if (ret < 0)
+		DSS_ERROR_LOG(("can not recover fold of %s: %s\n", fj.base,
+			dss_strerror(-ret)));
+	else
+		ret = 1;
+	free_fold_journal(&fj);
+	return ret;
+}
+
+/**
+ * Remove a base snapshot which has thin snapshots.
+ *
+ * \param base The snapshot to remove.
+ * \param dependents The thin snapshots of \a base, oldest first.
+ * \param num_dependents The number of entries in \a dependents.
+ *
+ * The base snapshot is folded into the oldest of its thin snapshots, which
+ * becomes a full snapshot. All other thin snapshots are rebased onto it.
+ * Afterwards \a base no longer exists. The fold is journaled, so that it can
+ * be finished or undone by \ref recover_fold() if it is interrupted.
+ *
+ * \return Standard.
+ */
+int fold_base_snapshot(const char *base, char **dependents,
+		unsigned num_dependents)
+{
+	struct thin_info *ti = dss_calloc(num_dependents * sizeof(*ti));
+	struct fold_journal fj = {
+		.base = (char *)base,
+		.first = dependents[0],
+		.dependents = dependents + 1,
+		.num_dependents = num_dependents - 1
+	};
+	const char *first = dependents[0];
+	char *tmp = folded_name(first), *name;
+	unsigned u;
+	int ret;
+
+	assert(num_dependents > 0);
+	ret = recover_fold();
+	if (ret < 0)
+		goto out;
+	for (u = 0; u < num_dependents; u++) {
+		ret = read_thin_info(dependents[u], ti + u);
+		if (ret < 0)
+			goto out;
+		if (ret == 0 || strcmp(ti[u].base, base)) {
+			ret = -E_THIN_INFO;
+			goto out;
+		}
+	}
+	DSS_NOTICE_LOG(("folding %s into %s\n", base, first));
+	ret = write_fold_journal(&fj);
+	if (ret < 0)
+		goto out;
+	/* The base must stay intact until the fold is committed. */
+	for (u = 1; u < num_dependents; u++) {
+		ret = rebase_thin_snapshot(dependents[u], ti + u, first, ti);
+		if (ret < 0)
+			goto rollback;
+		name = rebased_name(dependents[u]);
+		ret = write_thin_info(name, ti + u);
+		free(name);
+		if (ret < 0)
+			goto rollback;
+	}
+	ret = build_full_tree(first, ti, tmp);
+	if (ret < 0)
+		goto rollback;
+	ret = dss_syncfs(".");
+	if (ret < 0)
+		goto rollback;
+	fj.committed = 1;
+	ret = write_fold_journal(&fj);
+	if (ret < 0)
+		goto rollback;
+	ret = finish_fold(&fj);
+	goto out;
+rollback:
+	roll_back_fold(&fj);
+out:
+	if (ret < 0)
+		DSS_ERROR_LOG(("can not fold %s: %s\n", base,
+			dss_strerror(-ret)));
+	for (u = 0; u < num_dependents; u++)
+		free_thin_info(ti + u);
+	free(ti);
+	free(tmp);
+	return ret;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/** \file thin.h Thin snapshots, see thin.c. */
+
+/** What distinguishes a thin snapshot from a full one. */
+struct thin_info {
+	/** The full snapshot this snapshot is based on. */
+	char *base;
+	/** Paths of the base snapshot which do not exist in this snapshot. */
+	char **deleted;
+	/** The number of entries in \a deleted. */
+	unsigned num_deleted;
+	/** The allocated size of \a deleted. */
+	unsigned array_size;
+	/** Whether \a deleted is sorted. */
+	int sorted;
+	/** Paths of the source, only known while the snapshot is created. */
+	char **present;
+	/** The number of entries in \a present. */
+	unsigned num_present;
+	/** The allocated size of \a present. */
+	unsigned present_size;
+};
+
+int read_thin_info(const char *snapshot_name, struct thin_info *ti);
+int write_thin_info(const char *snapshot_name, struct thin_info *ti);
+void remove_thin_info(const char *snapshot_name);
+void free_thin_info(struct thin_info *ti);
+void thin_info_add_deleted(struct thin_info *ti, const char *rsync_path);
+int thin_info_add_itemized(struct thin_info *ti, const char *line);
+int list_deleted_paths(struct thin_info *ti, const char *base);
+int materialize_snapshot(const char *snapshot_name, struct thin_info *ti);
+int recover_fold(void);
+int fold_base_snapshot(const char *base, char **dependents,
+		unsigned num_dependents);
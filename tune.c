@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/**
+ * \file tune.c Transport settings found by trial transfers.
+ *
+ * Whether compression, the delta algorithm or a particular ssh cipher pays off
+ * depends on the speed of the network and on the CPUs of both hosts. The tune
+ * command of dss therefore transfers a sample of the source with different
+ * settings, measures each transfer and stores the best settings per host in
+ * the dest dir. Later snapshots of the host use these settings.
+ *
+ * This file contains the measurement of the trial transfers and the code which
+ * reads and writes the settings file. Each line of this file contains a host
+ * name followed by the settings for this host, for example
+ *
+ *	www compress=1 whole_file=0 cipher=aes128-gcm@openssh.com
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "gcc-compat.h"
+#include "log.h"
+#include "err.h"
+#include "str.h"
+#include "file.h"
+#include "sig.h"
+#include "tv.h"
+#include "tune.h"
+
+/** The settings file, relative to the dest dir. */
+#define TRANSPORT_FILE ".dss-transport"
+
+/**
+ * Free the resources of a transport settings structure.
+ *
+ * \param ts The settings to free.
+ *
+ * The structure is reset to the default settings.
+ */
+void free_transport_settings(struct transport_settings *ts)
+{
+	free(ts->cipher);
+	memset(ts, 0, sizeof(*ts));
+}
+
+static int parse_settings(char *line, struct transport_settings *ts)
+{
+	char *word, *save;
+
+	free_transport_settings(ts);
+	for (word = strtok_r(line, " \t", &save); word;
+			word = strtok_r(NULL, " \t", &save)) {
+		if (!strcmp(word, "compress=1"))
+			ts->compress = 1;
+		else if (!strcmp(word, "whole_file=1"))
+			ts->whole_file = 1;
+		else if (!strncmp(word, "cipher=", 7) && word[7])
+			ts->cipher = dss_strdup(word + 7);
+		else if (strcmp(word, "compress=0")
+				&& strcmp(word, "whole_file=0"))
+			return -E_SYNTAX;
+	}
+	return 1;
+}
+
+/*
+ * Return the settings line of the given host, or NULL. The line is modified
+ * in place to start after the host name.
+ */
+static char *find_host(char *line, const char *host)
+{
+	size_t len = strlen(host);
+
+	if (strncmp(line, host, len))
+		return NULL;
+	if (line[len] != ' ' && line[len] != '\t' && line[len] != '\0')
+		return NULL;
+	return line + len;
+}
+
+/**
+ * Read the tuned transport settings of a host.
+ *
+ * \param host The remote host.
+ * \param ts Result pointer.
+ *
+ * \return Positive if settings for \a host were found, zero if not, negative
+ * on errors. In the latter two cases, \a ts contains the default settings.
+ */
+int load_transport_settings(const char *host, struct transport_settings *ts)
+{
+	FILE *f = fopen(TRANSPORT_FILE, "r");
+	char line[1024];
+	int ret = 0;
+
+	free_transport_settings(ts);
+	if (!f)
+		return errno == ENOENT? 0 : -ERRNO_TO_DSS_ERROR(errno);
+	while (fgets(line, sizeof(line), f)) {
+		char *p;
+
+		line[strcspn(line, "\n")] = '\0';
+		p = find_host(line, host);
+		if (!p)
+			continue;
+		ret = parse_settings(p, ts);
+		if (ret < 0) {
+			DSS_WARNING_LOG(("%s: bad settings for %s\n",
+				TRANSPORT_FILE, host));
+			free_transport_settings(ts);
+		}
+		break;
+	}
+	fclose(f);
+	return ret;
+}
+
+/**
+ * Store the transport settings of a host.
+ *
+ * \param host The remote host.
+ * \param ts The settings to store.
+ *
+ * The settings of other hosts are preserved. The settings file is replaced
+ * atomically.
+ *
+ * \return Standard.
+ */
+int save_transport_settings(const char *host,
+		const struct transport_settings *ts)
+{
+	FILE *in = fopen(TRANSPORT_FILE, "r"), *out;
+	char line[1024];
+	int ret;
+
+	out = fopen(TRANSPORT_FILE ".tmp", "w");
+	if (!out) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	while (in && fgets(line, sizeof(line), in)) {
+		char *copy = dss_strdup(line);
+		int match;
+
+		copy[strcspn(copy, "\n")] = '\0';
+		match = find_host(copy, host) != NULL;
+		free(copy);
+		if (!match)
+			fputs(line, out);
+	}
+	fprintf(out, "%s compress=%d whole_file=%d", host, ts->compress,
+		ts->whole_file);
+	if (ts->cipher)
+		fprintf(out, " cipher=%s", ts->cipher);
+	fprintf(out, "\n");
+	if (fclose(out) == EOF) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	ret = dss_rename(TRANSPORT_FILE ".tmp", TRANSPORT_FILE);
+out:
+	if (ret < 0)
+		unlink(TRANSPORT_FILE ".tmp");
+	if (in)
+		fclose(in);
+	return ret;
+}
+
+/*
+ * The fields of an rsync --list-only line: permissions, size, date, time and
+ * path. rsync 3.1 and newer group the digits of the size with commas.
+ */
+static int parse_listing_line(char *line, int64_t *size, char **path)
+{
+	char *p = line, *q;
+	int field;
+
+	if (line[0] != '-') /* regular files only */
+		return 0;
+	p += strcspn(p, " ");
+	p += strspn(p, " ");
+	*size = 0;
+	for (; *p && *p != ' '; p++) {
+		if (*p == ',' || *p == '.')
+			continue;
+		if (*p < '0' || *p > '9')
+			return 0;
+		*size = *size * 10 + *p - '0';
+	}
+	for (field = 0; field < 2; field++) { /* skip date and time */
+		p += strspn(p, " ");
+		p += strcspn(p, " ");
+	}
+	if (*p != ' ')
+		return 0;
+	*path = p + 1;
+	q = *path + strlen(*path);
+	while (q > *path && q[-1] == '\n')
+		*--q = '\0';
+	return **path != '\0';
+}
+
+/**
+ * Pick a sample of the source for the trial transfers.
+ *
+ * \param listing The output of rsync --list-only -r for the source.
+ * \param files_from Where to write the list of selected files.
+ * \param max_size Stop selecting files when their total size exceeds this.
+ * \param sample_size Result: The total size of the selected files.
+ *
+ * Files larger than a quarter of \a max_size are skipped, so that the sample
+ * is not dominated by a few large files. The listing is read twice. The first
+ * pass adds up the sizes of the candidates. If they exceed \a max_size, the
+ * second pass selects candidates at a regular stride, so that the sample is
+ * spread across the whole tree rather than taken from its first directories.
+ *
+ * \return The number of selected files, or a negative error code.
+ */
+int select_sample(const char *listing, const char *files_from,
+		int64_t max_size, int64_t *sample_size)
+{
+	FILE *in = fopen(listing, "r"), *out = NULL;
+	char line[4096];
+	int ret, num = 0;
+	int64_t size, total = 0, idx = 0;
+	char *path;
+
+	*sample_size = 0;
+	if (!in)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	out = fopen(files_from, "w");
+	if (!out) {
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+		goto out;
+	}
+	while (fgets(line, sizeof(line), in)) {
+		if (!parse_listing_line(line, &size, &path))
+			continue;
+		if (size > max_size / 4)
+			continue;
+		total += size;
+	}
+	rewind(in);
+	/* select file idx if idx * max_size / total crosses an integer */
+	while (*sample_size < max_size && fgets(line, sizeof(line), in)) {
+		if (!parse_listing_line(line, &size, &path))
+			continue;
+		if (size > max_size / 4)
+			continue;
+		idx++;
+		if (total > max_size && (idx * max_size) / total
+				== ((idx - 1) * max_size) / total)
+			continue;
+		fprintf(out, "%s\n", path);
+		*sample_size += size;
+		num++;
+	}
+	ret = num;
+	if (fclose(out) == EOF)
+		ret = -ERRNO_TO_DSS_ERROR(errno);
+out:
+	fclose(in);
+	return ret;
+}
+
+/**
+ * Run a command and measure its cost.
+ *
+ * \param argv The command to run.
+ * \param output Where stdout and stderr of the command go.
+ * \param tr Result pointer.
+ *
+ * The CPU time includes the CPU time of all processes the command waited for,
+ * e.g. the ssh process of rsync.
+ *
+ * \return Standard. It is an error if the command does not exit successfully.
+ */
+int run_trial(char * const *argv, const char *output, struct trial_result *tr)
+{
+	struct timeval start, end, diff;
+	struct rusage ru;
+	int status, fd;
+	pid_t pid;
+
+	fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return -ERRNO_TO_DSS_ERROR(errno);
+	gettimeofday(&start, NULL);
+	pid = fork();
+	if (pid < 0) {
+		close(fd);
+		return -ERRNO_TO_DSS_ERROR(errno);
+	}
+	if (pid == 0) {
+		if (dup2(fd, STDOUT_FILENO) < 0 || dup2(fd, STDERR_FILENO) < 0)
+			_exit(EXIT_FAILURE);
+		reset_signals();
+		execvp(argv[0], argv);
+		_exit(EXIT_FAILURE);
+	}
+	close(fd);
+	while (wait4(pid, &status, 0, &ru) < 0) {
+		if (errno != EINTR)
+			return -ERRNO_TO_DSS_ERROR(errno);
+	}
+	gettimeofday(&end, NULL);
+	tv_diff(&end, &start, &diff);
+	tr->wall_ms = tv2ms(&diff);
+	tr->cpu_ms = tv2ms(&ru.ru_utime) + tv2ms(&ru.ru_stime);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return -E_BAD_EXIT_CODE;
+	return 1;
+}
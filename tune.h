@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2026 The dss developers
+ *
+ * Licensed under the GPL v2. For licencing details see COPYING.
+ */
+
+/** \file tune.h Transport tuning, see tune.c. */
+
+/** How rsync talks to a remote host. All zero means rsync's defaults. */
+struct transport_settings {
+	/** Whether to pass -z to rsync. */
+	int compress;
+	/** Whether to pass --whole-file to rsync. */
+	int whole_file;
+	/** The ssh cipher, NULL for the default of ssh. */
+	char *cipher;
+};
+
+/** The cost of one trial transfer. */
+struct trial_result {
+	/** Elapsed time in milliseconds. */
+	int64_t wall_ms;
+	/** User and system time in milliseconds. */
+	int64_t cpu_ms;
+};
+
+void free_transport_settings(struct transport_settings *ts);
+int load_transport_settings(const char *host, struct transport_settings *ts);
+int save_transport_settings(const char *host,
+		const struct transport_settings *ts);
+int select_sample(const char *listing, const char *files_from,
+		int64_t max_size, int64_t *sample_size);
+int run_trial(char * const *argv, const char *output, struct trial_result *tr);
@@ -9,6 +9,7 @@
 #include <inttypes.h>
 #include <assert.h>
 #include <string.h>
+#include <stdlib.h>
 
 #include "gcc-compat.h"
 #include "err.h"
@@ -143,3 +144,54 @@ int64_t get_current_time(void)
 	DSS_DEBUG_LOG(("now: %jd\n", (intmax_t)now));
 	return (int64_t)now;
 }
+
+/**
+ * Get the current time with millisecond resolution.
+ *
+ * \return The number of milliseconds since the epoch.
+ */
+int64_t get_current_time_ms(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (int64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+/**
+ * Parse a duration like "5m" or "4d".
+ *
+ * \param str The string to parse.
+ * \param seconds Result pointer.
+ *
+ * The number may be followed by one of the suffixes s, m, h and d for
+ * seconds, minutes, hours and days. A number without suffix means days.
+ *
+ * \return Standard.
+ */
+int parse_duration(const char *str, int64_t *seconds)
+{
+	char *tmp = dss_strdup(str);
+	size_t len = strlen(tmp);
+	int64_t factor = 24 * 3600, val;
+	int ret;
+
+	if (len > 0) {
+		switch (tmp[len - 1]) {
+		case 's': factor = 1; break;
+		case 'm': factor = 60; break;
+		case 'h': factor = 3600; break;
+		case 'd': factor = 24 * 3600; break;
+		default: len++;
+		}
+		tmp[len - 1] = '\0';
+	}
+	ret = dss_atoi64(tmp, &val);
+	free(tmp);
+	if (ret < 0)
+		return ret;
+	if (val <= 0 || val > INT64_MAX / factor)
+		return -E_INVALID_NUMBER;
+	*seconds = val * factor;
+	return 1;
+}
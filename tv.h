@@ -7,3 +7,5 @@ void tv_divide(const unsigned long divisor, const struct timeval *tv,
 	struct timeval *result);
 void ms2tv(const long unsigned n, struct timeval *tv);
 int64_t get_current_time(void);
+int64_t get_current_time_ms(void);
+int parse_duration(const char *str, int64_t *seconds);